@@ -8,39 +8,20 @@
 #include <QtDebug>
 #include <QtWidgets>
 #include <QSettings>
-#include <array>
 #include <cstdio>
 #include <iostream>
 #include <memory>
-#include <stdexcept>
 #include <string>
 #include <vector>
 
 #include "mainpicker.h"
 #include "elidedbutton.h"
-
-std::string execAndGet(const char* cmd) {
-    std::array<char, 128>                    buffer;
-    std::string                              result;
-    std::unique_ptr<FILE, decltype(&pclose)> pipe(popen(cmd, "r"), pclose);
-    if (!pipe) {
-        throw std::runtime_error("popen() failed!");
-    }
-    while (fgets(buffer.data(), buffer.size(), pipe.get()) != nullptr) {
-        result += buffer.data();
-    }
-    return result;
-}
+#include "windowlist.h"
+#include "regionselector.h"
 
 QApplication* pickerPtr     = nullptr;
 MainPicker*   mainPickerPtr = nullptr;
 
-struct SWindowEntry {
-    std::string        name;
-    std::string        clazz;
-    unsigned long long id = 0;
-};
-
 std::vector<SWindowEntry> getWindows(const char* env) {
     std::vector<SWindowEntry> result;
 
@@ -136,42 +117,43 @@ int main(int argc, char* argv[]) {
     SCREENS_SCROLL_AREA_CONTENTS_LAYOUT->addItem(SCREENS_SPACER);
 
     // windows
-    const auto WINDOWS_SCROLL_AREA_CONTENTS =
-        (QWidget*)TAB1->findChild<QWidget*>("windows")->findChild<QScrollArea*>("scrollArea_2")->findChild<QWidget*>("scrollAreaWidgetContents_2");
-
-    const auto WINDOWS_SCROLL_AREA_CONTENTS_LAYOUT = WINDOWS_SCROLL_AREA_CONTENTS->layout();
-
-    // loop over them
-    int windowIterator = 0;
-    for (auto& window : WINDOWLIST) {
-        QString      text = QString::fromStdString(window.clazz + ": " + window.name);
+    const auto WINDOWS_TAB    = TAB1->findChild<QWidget*>("windows");
+    const auto WINDOWS_LIST   = WINDOWS_TAB->findChild<QListView*>("windowList");
+    const auto WINDOWS_FILTER = WINDOWS_TAB->findChild<QLineEdit*>("windowFilter");
 
-        ElidedButton* button = new ElidedButton(text);
-        button->setMinimumSize(0, BUTTON_HEIGHT);
-        WINDOWS_SCROLL_AREA_CONTENTS_LAYOUT->addWidget(button);
+    const auto WINDOWS_MODEL = new WindowListModel(WINDOWLIST, WINDOWS_LIST);
+    WINDOWS_LIST->setModel(WINDOWS_MODEL);
+    WINDOWS_LIST->setItemDelegate(new WindowItemDelegate(BUTTON_HEIGHT, WINDOWS_LIST));
+    WINDOWS_LIST->viewport()->setAttribute(Qt::WA_Hover);
 
-        mainPickerPtr->windowIDs[button] = window.id;
+    const auto SELECT_WINDOW = [=](const QModelIndex& index) {
+        if (!index.isValid())
+            return;
 
-        QObject::connect(button, &QPushButton::clicked, [=]() {
-            std::cout << "[SELECTION]";
-            std::cout << (ALLOWTOKENBUTTON->isChecked() ? "r" : "");
-            std::cout << "/";
+        std::cout << "[SELECTION]";
+        std::cout << (ALLOWTOKENBUTTON->isChecked() ? "r" : "");
+        std::cout << "/";
 
-            std::cout << "window:" << mainPickerPtr->windowIDs[button] << "\n";
+        std::cout << "window:" << index.data(WindowListModel::WindowIdRole).toULongLong() << "\n";
 
-            settings->setValue("width", mainPickerPtr->width());
-            settings->setValue("height", mainPickerPtr->height());
-            settings->sync();
+        settings->setValue("width", mainPickerPtr->width());
+        settings->setValue("height", mainPickerPtr->height());
+        settings->sync();
 
-            pickerPtr->quit();
-            return 0;
-        });
-
-        windowIterator++;
-    }
+        pickerPtr->quit();
+    };
 
-    QSpacerItem * WINDOWS_SPACER = new QSpacerItem(0,10000, QSizePolicy::Expanding, QSizePolicy::Expanding);
-    WINDOWS_SCROLL_AREA_CONTENTS_LAYOUT->addItem(WINDOWS_SPACER);
+    QObject::connect(WINDOWS_LIST, &QListView::clicked, SELECT_WINDOW);
+    QObject::connect(WINDOWS_FILTER, &QLineEdit::textChanged, [=](const QString& text) { WINDOWS_MODEL->setFilter(text); });
+    QObject::connect(TABWIDGET, &QTabWidget::currentChanged, [=](int index) {
+        if (TABWIDGET->widget(index) == WINDOWS_TAB)
+            WINDOWS_FILTER->setFocus();
+    });
+    // enter picks the only match left
+    QObject::connect(WINDOWS_FILTER, &QLineEdit::returnPressed, [=]() {
+        if (WINDOWS_MODEL->rowCount() == 1)
+            SELECT_WINDOW(WINDOWS_MODEL->index(0));
+    });
 
     // lastly, region
     const auto   REGION_OBJECT = (QWidget*)TAB1->findChild<QWidget*>("region");
@@ -184,64 +166,30 @@ int main(int argc, char* argv[]) {
     REGION_LAYOUT->addWidget(button);
 
 
-    QObject::connect(button, &QPushButton::clicked, [=]() {
-        auto REGION = execAndGet("slurp -f \"%o %x %y %w %h\"");
-        REGION      = REGION.substr(0, REGION.length());
+    std::unique_ptr<RegionSelector> regionSelector;
 
-        // now, get the screen
-        QScreen* pScreen = nullptr;
-        if (REGION.find_first_of(' ') == std::string::npos) {
-            std::cout << "error1\n";
-            pickerPtr->quit();
-            return 1;
-        }
-        const auto SCREEN_NAME = REGION.substr(0, REGION.find_first_of(' '));
+    QObject::connect(button, &QPushButton::clicked, [&]() {
+        w.hide();
 
-        for (auto& screen : SCREENS) {
-            if (screen->name().toStdString() == SCREEN_NAME) {
-                pScreen = screen;
-                break;
+        regionSelector = std::make_unique<RegionSelector>(SCREENS, [=](QScreen* pScreen, QRect region) {
+            if (!pScreen) {
+                std::cout << "error1\n";
+                pickerPtr->quit();
+                return;
             }
-        }
-
-        if (!pScreen) {
-            std::cout << "error2\n";
-            pickerPtr->quit();
-            return 1;
-        }
-
-        // get all the coords
-        try {
-            REGION       = REGION.substr(REGION.find_first_of(' ') + 1);
-            const auto X = std::stoi(REGION.substr(0, REGION.find_first_of(' ')));
-            REGION       = REGION.substr(REGION.find_first_of(' ') + 1);
-            const auto Y = std::stoi(REGION.substr(0, REGION.find_first_of(' ')));
-            REGION       = REGION.substr(REGION.find_first_of(' ') + 1);
-            const auto W = std::stoi(REGION.substr(0, REGION.find_first_of(' ')));
-            REGION       = REGION.substr(REGION.find_first_of(' ') + 1);
-            const auto H = std::stoi(REGION);
 
             std::cout << "[SELECTION]";
             std::cout << (ALLOWTOKENBUTTON->isChecked() ? "r" : "");
             std::cout << "/";
 
-            std::cout << "region:" << SCREEN_NAME << "@" << X - pScreen->geometry().x() << "," << Y - pScreen->geometry().y() << "," << W << "," << H << "\n";
+            std::cout << "region:" << pScreen->name().toStdString() << "@" << region.x() << "," << region.y() << "," << region.width() << "," << region.height() << "\n";
 
             settings->setValue("width", mainPickerPtr->width());
             settings->setValue("height", mainPickerPtr->height());
             settings->sync();
 
             pickerPtr->quit();
-            return 0;
-        } catch (...) {
-            std::cout << "error3\n";
-            pickerPtr->quit();
-            return 1;
-        }
-
-        std::cout << "error4\n";
-        pickerPtr->quit();
-        return 1;
+        });
     });
 
     w.show();
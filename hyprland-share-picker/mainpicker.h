@@ -4,7 +4,6 @@
 #include <QMainWindow>
 #include <QObject>
 #include <QEvent>
-#include <unordered_map>
 
 QT_BEGIN_NAMESPACE
 namespace Ui { class MainPicker; }
@@ -20,8 +19,6 @@ public:
 
     void onMonitorButtonClicked(QObject* target, QEvent* event);
 
-    std::unordered_map<void*, int> windowIDs; // button -> id
-
 private:
     Ui::MainPicker *ui;
 };
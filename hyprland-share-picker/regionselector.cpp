@@ -0,0 +1,110 @@
+#include "regionselector.h"
+
+#include <QGuiApplication>
+#include <QKeyEvent>
+#include <QMouseEvent>
+#include <QPainter>
+#include <QScreen>
+#include <QWindow>
+
+RegionSelector::RegionSelector(const QList<QScreen *> &screens, Callback done)
+    : done(std::move(done))
+{
+    for (auto &screen : screens) {
+        auto overlay = std::make_unique<RegionOverlay>(this, screen);
+        overlay->showFullScreen();
+        overlays.push_back(std::move(overlay));
+    }
+}
+
+void RegionSelector::finish(QScreen *screen, QRect region)
+{
+    if (finished)
+        return;
+
+    finished = true;
+
+    for (auto &overlay : overlays)
+        overlay->hide();
+
+    done(screen, region);
+}
+
+RegionOverlay::RegionOverlay(RegionSelector *selector, QScreen *screen)
+    : QWidget(nullptr, Qt::FramelessWindowHint | Qt::WindowStaysOnTopHint)
+    , selector(selector)
+    , screen(screen)
+{
+    setAttribute(Qt::WA_TranslucentBackground);
+    setCursor(Qt::CrossCursor);
+    setMouseTracking(true);
+    setWindowTitle("hyprland-share-picker region");
+
+    // fullscreen goes to the window's screen, it has to be set on the native window
+    setGeometry(screen->geometry());
+    winId();
+    windowHandle()->setScreen(screen);
+}
+
+void RegionOverlay::paintEvent(QPaintEvent *)
+{
+    QPainter painter(this);
+    painter.fillRect(rect(), QColor(0, 0, 0, 100));
+
+    if (!dragging)
+        return;
+
+    const auto SELECTION = QRect(anchor, current).normalized();
+
+    painter.setCompositionMode(QPainter::CompositionMode_Clear);
+    painter.fillRect(SELECTION, Qt::transparent);
+    painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
+    painter.setPen(QPen(palette().highlight().color(), 2));
+    painter.drawRect(SELECTION);
+}
+
+void RegionOverlay::mousePressEvent(QMouseEvent *event)
+{
+    if (event->button() != Qt::LeftButton) {
+        selector->finish(nullptr, {});
+        return;
+    }
+
+    anchor = current = event->pos();
+    dragging = true;
+    update();
+}
+
+void RegionOverlay::mouseMoveEvent(QMouseEvent *event)
+{
+    if (!dragging)
+        return;
+
+    current = event->pos();
+    update();
+}
+
+void RegionOverlay::mouseReleaseEvent(QMouseEvent *event)
+{
+    if (!dragging || event->button() != Qt::LeftButton)
+        return;
+
+    dragging = false;
+
+    // widget coordinates are the screen's logical ones, what the portal wants. Both corners are inside the pixels.
+    const auto SELECTION = QRect(anchor, event->pos()).normalized().intersected(rect());
+
+    if (SELECTION.width() < 2 || SELECTION.height() < 2) {
+        // a click, not a drag
+        update();
+        return;
+    }
+
+    selector->finish(screen, SELECTION);
+}
+
+void RegionOverlay::keyPressEvent(QKeyEvent *event)
+{
+    if (event->key() == Qt::Key_Escape)
+        selector->finish(nullptr, {});
+}
@@ -0,0 +1,50 @@
+#ifndef REGIONSELECTOR_H
+#define REGIONSELECTOR_H
+
+#include <QList>
+#include <QRect>
+#include <QWidget>
+#include <functional>
+#include <memory>
+#include <vector>
+
+class QScreen;
+
+// A region picked by dragging over a fullscreen overlay on one of the screens.
+// Replaces slurp: no second client to start, and the rect comes back in the screen's own logical coordinates.
+class RegionSelector
+{
+public:
+    // screen is nullptr if the selection was cancelled
+    using Callback = std::function<void(QScreen *screen, QRect region)>;
+
+    RegionSelector(const QList<QScreen *> &screens, Callback done);
+
+    void finish(QScreen *screen, QRect region);
+
+private:
+    std::vector<std::unique_ptr<QWidget>> overlays;
+    Callback done;
+    bool finished = false;
+};
+
+class RegionOverlay : public QWidget
+{
+public:
+    RegionOverlay(RegionSelector *selector, QScreen *screen);
+
+protected:
+    void paintEvent(QPaintEvent *) override;
+    void mousePressEvent(QMouseEvent *) override;
+    void mouseMoveEvent(QMouseEvent *) override;
+    void mouseReleaseEvent(QMouseEvent *) override;
+    void keyPressEvent(QKeyEvent *) override;
+
+private:
+    RegionSelector *selector = nullptr;
+    QScreen *screen = nullptr;
+    QPoint anchor, current;
+    bool dragging = false;
+};
+
+#endif // REGIONSELECTOR_H
@@ -0,0 +1,101 @@
+#include "windowlist.h"
+
+#include <QApplication>
+#include <QPainter>
+#include <QStyleOptionButton>
+#include <algorithm>
+
+WindowListModel::WindowListModel(std::vector<SWindowEntry> windows, QObject *parent)
+    : QAbstractListModel(parent)
+    , windows(std::move(windows))
+{
+    labels.reserve(this->windows.size());
+    haystack.reserve(this->windows.size());
+    visible.reserve(this->windows.size());
+
+    for (size_t i = 0; i < this->windows.size(); ++i) {
+        labels.push_back(QString::fromStdString(this->windows[i].clazz + ": " + this->windows[i].name));
+        haystack.push_back(labels.back().toCaseFolded());
+        visible.push_back(i);
+    }
+}
+
+int WindowListModel::rowCount(const QModelIndex &parent) const
+{
+    return parent.isValid() ? 0 : visible.size();
+}
+
+QVariant WindowListModel::data(const QModelIndex &index, int role) const
+{
+    if (!index.isValid() || index.row() >= (int)visible.size())
+        return {};
+
+    const auto WINDOW = visible[index.row()];
+
+    switch (role) {
+    case Qt::DisplayRole:
+    case Qt::ToolTipRole:
+        return labels[WINDOW];
+    case WindowIdRole:
+        return QVariant::fromValue(windows[WINDOW].id);
+    default:
+        return {};
+    }
+}
+
+void WindowListModel::setFilter(const QString &filter)
+{
+    const auto NEEDLE = filter.toCaseFolded();
+
+    if (NEEDLE == currentFilter)
+        return;
+
+    // whatever matches the longer filter matched the shorter one too
+    const bool NARROWING = NEEDLE.contains(currentFilter);
+
+    beginResetModel();
+
+    if (NARROWING) {
+        visible.erase(std::remove_if(visible.begin(), visible.end(), [&](int i) { return !haystack[i].contains(NEEDLE); }), visible.end());
+    } else {
+        visible.clear();
+        for (size_t i = 0; i < haystack.size(); ++i) {
+            if (haystack[i].contains(NEEDLE))
+                visible.push_back(i);
+        }
+    }
+
+    currentFilter = NEEDLE;
+
+    endResetModel();
+}
+
+WindowItemDelegate::WindowItemDelegate(int rowHeight, QObject *parent)
+    : QStyledItemDelegate(parent)
+    , rowHeight(rowHeight)
+{
+}
+
+void WindowItemDelegate::paint(QPainter *painter, const QStyleOptionViewItem &option, const QModelIndex &index) const
+{
+    const auto STYLE = option.widget ? option.widget->style() : QApplication::style();
+
+    QStyleOptionButton button;
+    button.rect = option.rect.adjusted(0, 0, 0, -6); // the spacing the screen buttons have in their layout
+    button.state = QStyle::State_Enabled | QStyle::State_Raised;
+    if (option.state & QStyle::State_MouseOver)
+        button.state |= QStyle::State_MouseOver;
+    if (option.state & QStyle::State_HasFocus)
+        button.state |= QStyle::State_HasFocus;
+    button.palette = option.palette;
+    button.fontMetrics = option.fontMetrics;
+    // same margin as ElidedButton
+    button.text = option.fontMetrics.elidedText(index.data(Qt::DisplayRole).toString(), Qt::ElideRight, button.rect.width() - 15);
+
+    STYLE->drawControl(QStyle::CE_PushButton, &button, painter, option.widget);
+}
+
+QSize WindowItemDelegate::sizeHint(const QStyleOptionViewItem &option, const QModelIndex &index) const
+{
+    return QSize(0, rowHeight + 6);
+}
@@ -0,0 +1,51 @@
+#ifndef WINDOWLIST_H
+#define WINDOWLIST_H
+
+#include <QAbstractListModel>
+#include <QStyledItemDelegate>
+#include <string>
+#include <vector>
+
+struct SWindowEntry {
+    std::string        name;
+    std::string        clazz;
+    unsigned long long id = 0;
+};
+
+// All shareable windows, narrowed down by a filter over class and title.
+// Only the visible rows are ever laid out or painted, so thousands of windows cost about as much as a dozen.
+class WindowListModel : public QAbstractListModel
+{
+public:
+    static constexpr int WindowIdRole = Qt::UserRole;
+
+    explicit WindowListModel(std::vector<SWindowEntry> windows, QObject *parent = nullptr);
+
+    int rowCount(const QModelIndex &parent = QModelIndex()) const override;
+    QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const override;
+
+    // case insensitive substring. Typing on narrows down from the current matches instead of all windows.
+    void setFilter(const QString &filter);
+
+private:
+    std::vector<SWindowEntry> windows;
+    std::vector<QString> labels;   // "class: title"
+    std::vector<QString> haystack; // labels, case folded
+    std::vector<int> visible;      // indices into windows
+    QString currentFilter;
+};
+
+// Draws rows as the buttons on the screens tab. Text is elided when a row is painted, for the width it gets then.
+class WindowItemDelegate : public QStyledItemDelegate
+{
+public:
+    explicit WindowItemDelegate(int rowHeight, QObject *parent = nullptr);
+
+    void paint(QPainter *painter, const QStyleOptionViewItem &option, const QModelIndex &index) const override;
+    QSize sizeHint(const QStyleOptionViewItem &option, const QModelIndex &index) const override;
+
+private:
+    int rowHeight;
+};
+
+#endif // WINDOWLIST_H
@@ -20,6 +20,7 @@
   systemd,
   wayland,
   wayland-protocols,
+  zlib,
   debug ? false,
   version ? "git",
 }:
@@ -54,6 +55,7 @@ stdenv.mkDerivation {
     systemd
     wayland
     wayland-protocols
+    zlib
   ];
 
   cmakeBuildType =
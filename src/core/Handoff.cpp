@@ -0,0 +1,282 @@
+#include "Handoff.hpp"
+#include "PortalManager.hpp"
+#include "../helpers/Log.hpp"
+#include "../helpers/Serialization.hpp"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <filesystem>
+
+constexpr uint32_t HANDOFF_MAGIC   = 0x48504458; // XDPH
+constexpr uint32_t HANDOFF_VERSION = 2;
+
+static std::string socketPath() {
+    const auto RUNTIME_DIR = getenv("XDG_RUNTIME_DIR");
+    return (RUNTIME_DIR ? std::string{RUNTIME_DIR} + "/hypr/" : "/tmp/hypr/") + "xdph-handoff.sock";
+}
+
+static uint64_t monotonicNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// --------------- serialization --------------- //
+
+static int serialize(const SHandoffState& state) {
+    std::string out;
+    writeRaw<uint32_t>(out, HANDOFF_MAGIC);
+    writeRaw<uint32_t>(out, HANDOFF_VERSION);
+    writeRaw<uint64_t>(out, state.sentAtNs);
+    writeRaw<uint32_t>(out, state.sessions.size());
+
+    for (auto& s : state.sessions) {
+        writeString(out, s.appid);
+        writeString(out, s.requestHandle);
+        writeString(out, s.sessionHandle);
+        writeRaw<uint32_t>(out, s.cursorMode);
+        writeRaw<uint32_t>(out, s.persistMode);
+        writeRaw<int32_t>(out, s.type);
+        writeString(out, s.output);
+        writeString(out, s.windowClass);
+        writeString(out, s.windowTitle);
+        writeRaw<uint32_t>(out, s.x);
+        writeRaw<uint32_t>(out, s.y);
+        writeRaw<uint32_t>(out, s.w);
+        writeRaw<uint32_t>(out, s.h);
+        writeRaw<uint8_t>(out, s.allowToken);
+        writeRaw<uint32_t>(out, s.framerate);
+    }
+
+    const int FD = memfd_create("xdph-handoff", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (FD < 0)
+        return -1;
+
+    if (write(FD, out.data(), out.size()) != (ssize_t)out.size()) {
+        close(FD);
+        return -1;
+    }
+
+    // the new instance only reads it, make sure it's what we wrote
+    fcntl(FD, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+
+    return FD;
+}
+
+static bool deserialize(int fd, SHandoffState& state) {
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size <= 0)
+        return false;
+
+    const auto DATA = (const char*)mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (DATA == MAP_FAILED)
+        return false;
+
+    CByteReader reader{DATA, (size_t)st.st_size};
+
+    bool        ok = reader.read<uint32_t>() == HANDOFF_MAGIC && reader.read<uint32_t>() == HANDOFF_VERSION;
+
+    if (ok) {
+        state.sentAtNs   = reader.read<uint64_t>();
+        const auto COUNT = reader.read<uint32_t>();
+
+        for (uint32_t i = 0; i < COUNT && reader.good(); ++i) {
+            auto& s         = state.sessions.emplace_back();
+            s.appid         = reader.readString();
+            s.requestHandle = reader.readString();
+            s.sessionHandle = reader.readString();
+            s.cursorMode    = reader.read<uint32_t>();
+            s.persistMode   = reader.read<uint32_t>();
+            s.type          = reader.read<int32_t>();
+            s.output        = reader.readString();
+            s.windowClass   = reader.readString();
+            s.windowTitle   = reader.readString();
+            s.x             = reader.read<uint32_t>();
+            s.y             = reader.read<uint32_t>();
+            s.w             = reader.read<uint32_t>();
+            s.h             = reader.read<uint32_t>();
+            s.allowToken    = reader.read<uint8_t>();
+            s.framerate     = reader.read<uint32_t>();
+        }
+
+        ok = reader.good();
+    }
+
+    munmap((void*)DATA, st.st_size);
+
+    if (!ok)
+        state.sessions.clear();
+
+    return ok;
+}
+
+// --------------- listening side --------------- //
+
+CHandoff::CHandoff() {
+    m_szPath = socketPath();
+
+    if (m_szPath.size() >= sizeof(sockaddr_un::sun_path)) {
+        Debug::log(ERR, "[handoff] socket path {} too long, live restart unavailable", m_szPath);
+        return;
+    }
+
+    std::error_code ec;
+    std::filesystem::create_directory(std::filesystem::path(m_szPath).parent_path(), ec);
+
+    m_iListenFD = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (m_iListenFD < 0) {
+        Debug::log(ERR, "[handoff] couldn't create a socket: {}", strerror(errno));
+        return;
+    }
+
+    // we own the bus name, so whatever is left there is stale
+    unlink(m_szPath.c_str());
+
+    sockaddr_un addr = {.sun_family = AF_UNIX};
+    strncpy(addr.sun_path, m_szPath.c_str(), sizeof(addr.sun_path) - 1);
+
+    if (bind(m_iListenFD, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(m_iListenFD, 1) < 0) {
+        Debug::log(ERR, "[handoff] couldn't listen on {}: {}", m_szPath, strerror(errno));
+        close(m_iListenFD);
+        m_iListenFD = -1;
+        return;
+    }
+
+    Debug::log(LOG, "[handoff] listening on {}", m_szPath);
+}
+
+CHandoff::~CHandoff() {
+    if (m_iListenFD < 0)
+        return;
+
+    close(m_iListenFD);
+    unlink(m_szPath.c_str());
+}
+
+int CHandoff::fd() const {
+    return m_iListenFD;
+}
+
+void CHandoff::onConnection() {
+    const int CLIENT = accept4(m_iListenFD, nullptr, nullptr, SOCK_CLOEXEC);
+    if (CLIENT < 0)
+        return;
+
+    ucred     cred;
+    socklen_t credLen = sizeof(cred);
+    if (getsockopt(CLIENT, SOL_SOCKET, SO_PEERCRED, &cred, &credLen) < 0 || cred.uid != getuid()) {
+        Debug::log(WARN, "[handoff] rejecting a connection from a foreign user");
+        close(CLIENT);
+        return;
+    }
+
+    SHandoffState state;
+    if (g_pPortalManager->m_sPortals.screencopy)
+        state.sessions = g_pPortalManager->m_sPortals.screencopy->exportSessions();
+    state.sentAtNs = monotonicNs();
+
+    const int MEMFD = serialize(state);
+    if (MEMFD < 0) {
+        Debug::log(ERR, "[handoff] couldn't serialize the session state: {}", strerror(errno));
+        close(CLIENT);
+        return;
+    }
+
+    char     byte                             = 'H';
+    iovec    iov                              = {.iov_base = &byte, .iov_len = 1};
+    char     control[CMSG_SPACE(sizeof(int))] = {};
+    msghdr   msg                              = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+
+    cmsghdr* cmsg    = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &MEMFD, sizeof(int));
+
+    const bool SENT = sendmsg(CLIENT, &msg, MSG_NOSIGNAL) == 1;
+    close(MEMFD);
+
+    if (!SENT) {
+        Debug::log(ERR, "[handoff] couldn't send the session state to pid {}: {}", cred.pid, strerror(errno));
+        close(CLIENT);
+        return;
+    }
+
+    Debug::log(LOG, "[handoff] handed {} sessions to pid {}, stepping down", state.sessions.size(), cred.pid);
+
+    // the new instance waits for the hangup, so the name has to be free by then
+    try {
+        g_pPortalManager->getConnection()->releaseName(g_pPortalManager->DBUS_NAME);
+    } catch (std::exception& e) { Debug::log(ERR, "[handoff] couldn't release the bus name: {}", e.what()); }
+
+    close(CLIENT);
+
+    // the socket belongs to the new instance now, don't unlink it on our way out
+    close(m_iListenFD);
+    m_iListenFD = -1;
+
+    g_pPortalManager->terminate();
+}
+
+// --------------- taking over --------------- //
+
+bool CHandoff::takeOver(SHandoffState& state) {
+    const auto BEGIN = std::chrono::steady_clock::now();
+    const auto PATH  = socketPath();
+
+    const int  FD = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (FD < 0)
+        return false;
+
+    sockaddr_un addr = {.sun_family = AF_UNIX};
+    strncpy(addr.sun_path, PATH.c_str(), sizeof(addr.sun_path) - 1);
+
+    if (connect(FD, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        Debug::log(LOG, "[handoff] no running instance to take over from");
+        close(FD);
+        return false;
+    }
+
+    // don't hang forever on a wedged old instance
+    timeval timeout = {.tv_sec = 2, .tv_usec = 0};
+    setsockopt(FD, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    char   byte                             = 0;
+    iovec  iov                              = {.iov_base = &byte, .iov_len = 1};
+    char   control[CMSG_SPACE(sizeof(int))] = {};
+    msghdr msg                              = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+
+    int    memfd = -1;
+    if (recvmsg(FD, &msg, MSG_CMSG_CLOEXEC) == 1) {
+        for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+                memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+
+    if (memfd < 0) {
+        Debug::log(ERR, "[handoff] running instance didn't send any state, starting fresh");
+        close(FD);
+        return false;
+    }
+
+    // wait for the hangup, the old instance released the bus name by then and the bus passed it on to us
+    while (read(FD, &byte, 1) > 0) {
+        ;
+    }
+
+    close(FD);
+
+    if (!deserialize(memfd, state))
+        Debug::log(ERR, "[handoff] got malformed state, starting fresh");
+
+    close(memfd);
+
+    Debug::log(LOG, "[handoff] took over {} sessions in {:.2f}ms", state.sessions.size(),
+               std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - BEGIN).count() / 1000.0);
+
+    return true;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// what a restarting xdph needs to pick up a screencast session that hasn't started yet
+struct SHandoffSession {
+    std::string appid, requestHandle, sessionHandle;
+    uint32_t    cursorMode = 0, persistMode = 0;
+
+    // selection. Window handles don't survive a new wayland connection, class and title do.
+    int32_t     type = -1;
+    std::string output, windowClass, windowTitle;
+    uint32_t    x = 0, y = 0, w = 0, h = 0;
+    bool        allowToken = false;
+
+    uint32_t    framerate = 60; // picked in SelectSources
+};
+
+struct SHandoffState {
+    uint64_t                     sentAtNs = 0; // CLOCK_MONOTONIC in the old instance
+    std::vector<SHandoffSession> sessions;
+};
+
+// Live restart. The running instance listens on $XDG_RUNTIME_DIR/hypr/xdph-handoff.sock,
+// a new one started with --replace queues for the bus name, connects, gets the session state
+// in a sealed memfd over SCM_RIGHTS, and the old one releases the name (straight to the new one) and exits.
+// Only sessions that haven't been started carry over, with their selection: the app can still call Start on them and gets
+// its stream from the new instance without seeing the picker again. Running screencasts end with the old instance,
+// their pipewire nodes are its own and the portal frontend won't Start a session twice.
+class CHandoff {
+  public:
+    CHandoff();
+    ~CHandoff();
+
+    // for the event loop, -1 if we couldn't listen
+    int                  fd() const;
+    void                 onConnection();
+
+    // new instance side, after queueing for the bus name. Blocks until the old instance released it.
+    // false if there was nobody to take over from or it didn't step down.
+    static bool          takeOver(SHandoffState& state);
+
+  private:
+    int         m_iListenFD = -1;
+    std::string m_szPath;
+};
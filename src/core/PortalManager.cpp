@@ -1,21 +1,43 @@
 #include "PortalManager.hpp"
 #include "../helpers/Log.hpp"
 #include "../helpers/MiscFunctions.hpp"
+#include "../helpers/ExecutableCache.hpp"
 
 #include <protocols/hyprland-global-shortcuts-v1-protocol.h>
 #include <protocols/hyprland-toplevel-export-v1-protocol.h>
 #include <protocols/wlr-foreign-toplevel-management-unstable-v1-protocol.h>
 #include <protocols/wlr-screencopy-unstable-v1-protocol.h>
+#include <protocols/ext-image-capture-source-v1-protocol.h>
+#include <protocols/ext-image-copy-capture-v1-protocol.h>
 #include <protocols/linux-dmabuf-unstable-v1-protocol.h>
+#include <protocols/xdg-output-unstable-v1-protocol.h>
 
 #include <pipewire/pipewire.h>
 #include <poll.h>
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <csignal>
 
+#include <algorithm>
+#include <limits>
 #include <thread>
 
+// if teardown doesn't finish in this time, something is stuck and we exit by force
+constexpr int                SHUTDOWN_DEADLINE_MS = 3000;
+
+static volatile sig_atomic_t terminateSignal = 0;
+static int                   signalWakeupFD  = -1;
+
+static void                  onTerminateSignal(int sig) {
+    // async-signal context: only flag it and poke the poll thread, it does the rest
+    terminateSignal    = sig;
+    const uint64_t ONE = 1;
+    write(signalWakeupFD, &ONE, sizeof(ONE));
+}
+
 void handleGlobal(void* data, struct wl_registry* registry, uint32_t name, const char* interface, uint32_t version) {
     g_pPortalManager->onGlobal(data, registry, name, interface, version);
 }
@@ -41,8 +63,13 @@ static void handleOutputDone(void* data, struct wl_output* wl_output) {
 }
 
 static void handleOutputMode(void* data, struct wl_output* wl_output, uint32_t flags, int32_t width, int32_t height, int32_t refresh) {
-    const auto POUTPUT   = (SOutput*)data;
+    const auto POUTPUT = (SOutput*)data;
+
+    if (!(flags & WL_OUTPUT_MODE_CURRENT))
+        return;
+
     POUTPUT->refreshRate = std::round(refresh / 1000.0);
+    POUTPUT->presentClock.setRefresh(refresh);
 }
 
 static void handleOutputScale(void* data, struct wl_output* wl_output, int32_t factor) {
@@ -72,6 +99,69 @@ inline const wl_output_listener outputListener = {
     .description = handleOutputDescription,
 };
 
+static void handleXdgOutputPosition(void* data, zxdg_output_v1* xdgOutput, int32_t x, int32_t y) {
+    const auto POUTPUT = (SOutput*)data;
+    POUTPUT->logical.x = x;
+    POUTPUT->logical.y = y;
+}
+
+static void handleXdgOutputSize(void* data, zxdg_output_v1* xdgOutput, int32_t width, int32_t height) {
+    const auto POUTPUT = (SOutput*)data;
+    POUTPUT->logical.w = width;
+    POUTPUT->logical.h = height;
+}
+
+static void handleXdgOutputDone(void* data, zxdg_output_v1* xdgOutput) {
+    ;
+}
+
+static void handleXdgOutputName(void* data, zxdg_output_v1* xdgOutput, const char* name) {
+    ;
+}
+
+static void handleXdgOutputDescription(void* data, zxdg_output_v1* xdgOutput, const char* description) {
+    ;
+}
+
+inline const zxdg_output_v1_listener xdgOutputListener = {
+    .logical_position = handleXdgOutputPosition,
+    .logical_size     = handleXdgOutputSize,
+    .done             = handleXdgOutputDone,
+    .name             = handleXdgOutputName,
+    .description      = handleXdgOutputDescription,
+};
+
+static void bindXdgOutput(SOutput* pOutput) {
+    const auto MANAGER = (zxdg_output_manager_v1*)g_pPortalManager->m_sWaylandConnection.xdgOutputMgr;
+
+    if (!MANAGER || pOutput->xdgOutput)
+        return;
+
+    pOutput->xdgOutput = zxdg_output_manager_v1_get_xdg_output(MANAGER, pOutput->output);
+    zxdg_output_v1_add_listener(pOutput->xdgOutput, &xdgOutputListener, pOutput);
+}
+
+static void handleSeatCapabilities(void* data, struct wl_seat* wl_seat, uint32_t capabilities) {
+    auto& pointer = g_pPortalManager->m_sWaylandConnection.pointer;
+
+    // only ever asked for, never listened to. Cursor sessions take it to name the pointer.
+    if ((capabilities & WL_SEAT_CAPABILITY_POINTER) && !pointer)
+        pointer = wl_seat_get_pointer(wl_seat);
+    else if (!(capabilities & WL_SEAT_CAPABILITY_POINTER) && pointer) {
+        wl_pointer_destroy(pointer);
+        pointer = nullptr;
+    }
+}
+
+static void handleSeatName(void* data, struct wl_seat* wl_seat, const char* name) {
+    ;
+}
+
+inline const wl_seat_listener seatListener = {
+    .capabilities = handleSeatCapabilities,
+    .name         = handleSeatName,
+};
+
 static void handleDMABUFFormat(void* data, struct zwp_linux_dmabuf_v1* zwp_linux_dmabuf_v1, uint32_t format) {
     ;
 }
@@ -88,8 +178,6 @@ inline const zwp_linux_dmabuf_v1_listener dmabufListener = {
 static void dmabufFeedbackMainDevice(void* data, zwp_linux_dmabuf_feedback_v1* feedback, wl_array* device_arr) {
     Debug::log(LOG, "[core] dmabufFeedbackMainDevice");
 
-    RASSERT(!g_pPortalManager->m_sWaylandConnection.gbm, "double dmabuf feedback");
-
     dev_t device;
     assert(device_arr->size == sizeof(device));
     memcpy(&device, device_arr->data, sizeof(device));
@@ -100,7 +188,11 @@ static void dmabufFeedbackMainDevice(void* data, zwp_linux_dmabuf_feedback_v1* f
         exit(1);
     }
 
-    g_pPortalManager->m_sWaylandConnection.gbmDevice = g_pPortalManager->createGBMDevice(drmDev);
+    // the gbm device itself is created lazily, see getGBMDevice()
+    if (g_pPortalManager->m_sWaylandConnection.dma.mainDevice)
+        drmFreeDevice(&g_pPortalManager->m_sWaylandConnection.dma.mainDevice);
+
+    g_pPortalManager->m_sWaylandConnection.dma.mainDevice = drmDev;
 }
 
 static void dmabufFeedbackFormatTable(void* data, zwp_linux_dmabuf_feedback_v1* feedback, int fd, uint32_t size) {
@@ -141,14 +233,11 @@ static void dmabufFeedbackTrancheTargetDevice(void* data, zwp_linux_dmabuf_feedb
     if (drmGetDeviceFromDevId(device, /* flags */ 0, &drmDev) != 0)
         return;
 
-    if (g_pPortalManager->m_sWaylandConnection.gbmDevice) {
-        drmDevice* drmDevRenderer = NULL;
-        drmGetDevice2(gbm_device_get_fd(g_pPortalManager->m_sWaylandConnection.gbmDevice), /* flags */ 0, &drmDevRenderer);
-        g_pPortalManager->m_sWaylandConnection.dma.deviceUsed = drmDevicesEqual(drmDevRenderer, drmDev);
-    } else {
-        g_pPortalManager->m_sWaylandConnection.gbmDevice      = g_pPortalManager->createGBMDevice(drmDev);
-        g_pPortalManager->m_sWaylandConnection.dma.deviceUsed = g_pPortalManager->m_sWaylandConnection.gbm;
-    }
+    // the gbm device is opened on the main device's render node, so comparing against the main device is enough
+    const auto MAINDEVICE                                 = g_pPortalManager->m_sWaylandConnection.dma.mainDevice;
+    g_pPortalManager->m_sWaylandConnection.dma.deviceUsed = MAINDEVICE && drmDevicesEqual(MAINDEVICE, drmDev);
+
+    drmFreeDevice(&drmDev);
 }
 
 static void dmabufFeedbackTrancheFlags(void* data, zwp_linux_dmabuf_feedback_v1* feedback, uint32_t flags) {
@@ -200,6 +289,8 @@ inline const zwp_linux_dmabuf_feedback_v1_listener dmabufFeedbackListener = {
 //
 
 CPortalManager::CPortalManager() {
+    m_sStartup.exec = std::chrono::steady_clock::now();
+
     const auto XDG_CONFIG_HOME = getenv("XDG_CONFIG_HOME");
     const auto HOME            = getenv("HOME");
 
@@ -213,6 +304,16 @@ CPortalManager::CPortalManager() {
 
     m_sConfig.config->addConfigValue("general:toplevel_dynamic_bind", Hyprlang::INT{0L});
     m_sConfig.config->addConfigValue("screencopy:max_fps", Hyprlang::INT{120L});
+    m_sConfig.config->addConfigValue("screencopy:ext_image_copy_capture", Hyprlang::INT{1L});
+    m_sConfig.config->addConfigValue("screencopy:vblank_align", Hyprlang::INT{1L});
+    m_sConfig.config->addConfigValue("screencopy:max_bandwidth", Hyprlang::INT{0L});
+    m_sConfig.config->addConfigValue("screencopy:software_cursor", Hyprlang::INT{0L});
+    m_sConfig.config->addConfigValue("screencopy:shm_staging", Hyprlang::INT{1L});
+    m_sConfig.config->addConfigValue("screencopy:restore_token_idle_days", Hyprlang::INT{90L});
+    m_sConfig.config->addConfigValue("screencopy:restore_token_max_age_days", Hyprlang::INT{0L});
+    m_sConfig.config->addConfigValue("screenshot:use_picker", Hyprlang::INT{0L});
+
+    m_sConfig.config->registerHandler(&onCaptureRuleKeyword, "capture_rule", {false});
 
     m_sConfig.config->commence();
     m_sConfig.config->parse();
@@ -223,21 +324,47 @@ void CPortalManager::onGlobal(void* data, struct wl_registry* registry, uint32_t
 
     Debug::log(LOG, " | Got interface: {} (ver {})", INTERFACE, version);
 
-    if (INTERFACE == zwlr_screencopy_manager_v1_interface.name && m_sPipewire.loop)
-        m_sPortals.screencopy = std::make_unique<CScreencopyPortal>((zwlr_screencopy_manager_v1*)wl_registry_bind(registry, name, &zwlr_screencopy_manager_v1_interface, version));
+    // objects made by a manager inherit its queue, frames, capture sessions and shortcuts included
+    const auto BINDTO = [registry, name](const wl_interface* iface, uint32_t ver, wl_event_queue* queue) {
+        const auto PROXY = wl_registry_bind(registry, name, iface, ver);
+        wl_proxy_set_queue((wl_proxy*)PROXY, queue);
+        return PROXY;
+    };
+
+    const auto CAPTUREQUEUE = m_sWaylandConnection.queues.capture;
+
+    if (INTERFACE == zwlr_screencopy_manager_v1_interface.name) {
+        m_sWaylandConnection.screencopyMgr = BINDTO(&zwlr_screencopy_manager_v1_interface, version, CAPTUREQUEUE);
+        m_sPortals.screencopy              = std::make_unique<CScreencopyPortal>((zwlr_screencopy_manager_v1*)m_sWaylandConnection.screencopyMgr);
+    }
 
     if (INTERFACE == hyprland_global_shortcuts_manager_v1_interface.name)
         m_sPortals.globalShortcuts = std::make_unique<CGlobalShortcutsPortal>(
-            (hyprland_global_shortcuts_manager_v1*)wl_registry_bind(registry, name, &hyprland_global_shortcuts_manager_v1_interface, version));
+            (hyprland_global_shortcuts_manager_v1*)BINDTO(&hyprland_global_shortcuts_manager_v1_interface, version, m_sWaylandConnection.queues.shortcuts));
 
     else if (INTERFACE == hyprland_toplevel_export_manager_v1_interface.name)
-        m_sWaylandConnection.hyprlandToplevelMgr = wl_registry_bind(registry, name, &hyprland_toplevel_export_manager_v1_interface, version);
+        m_sWaylandConnection.hyprlandToplevelMgr = BINDTO(&hyprland_toplevel_export_manager_v1_interface, version, CAPTUREQUEUE);
+
+    else if (INTERFACE == ext_image_copy_capture_manager_v1_interface.name)
+        m_sWaylandConnection.imageCopyCaptureMgr = BINDTO(&ext_image_copy_capture_manager_v1_interface, 1, CAPTUREQUEUE);
+
+    else if (INTERFACE == ext_output_image_capture_source_manager_v1_interface.name)
+        m_sWaylandConnection.outputImageSourceMgr = BINDTO(&ext_output_image_capture_source_manager_v1_interface, 1, CAPTUREQUEUE);
 
     else if (INTERFACE == wl_output_interface.name) {
         const auto POUTPUT = m_vOutputs.emplace_back(std::make_unique<SOutput>()).get();
         POUTPUT->output    = (wl_output*)wl_registry_bind(registry, name, &wl_output_interface, version);
         wl_output_add_listener(POUTPUT->output, &outputListener, POUTPUT);
         POUTPUT->id = name;
+        bindXdgOutput(POUTPUT);
+    }
+
+    else if (INTERFACE == zxdg_output_manager_v1_interface.name) {
+        // the logical geometry is all we read, any version has it
+        m_sWaylandConnection.xdgOutputMgr = wl_registry_bind(registry, name, &zxdg_output_manager_v1_interface, std::min(version, 3u));
+        for (auto& o : m_vOutputs) {
+            bindXdgOutput(o.get());
+        }
     }
 
     else if (INTERFACE == zwp_linux_dmabuf_v1_interface.name) {
@@ -254,6 +381,11 @@ void CPortalManager::onGlobal(void* data, struct wl_registry* registry, uint32_t
     else if (INTERFACE == wl_shm_interface.name)
         m_sWaylandConnection.shm = (wl_shm*)wl_registry_bind(registry, name, &wl_shm_interface, version);
 
+    else if (INTERFACE == wl_seat_interface.name && !m_sWaylandConnection.seat) {
+        m_sWaylandConnection.seat = (wl_seat*)wl_registry_bind(registry, name, &wl_seat_interface, std::min(version, 2u));
+        wl_seat_add_listener(m_sWaylandConnection.seat, &seatListener, nullptr);
+    }
+
     else if (INTERFACE == zwlr_foreign_toplevel_manager_v1_interface.name) {
         m_sHelpers.toplevel = std::make_unique<CToplevelManager>(registry, name, version);
 
@@ -267,11 +399,41 @@ void CPortalManager::onGlobalRemoved(void* data, struct wl_registry* registry, u
     std::erase_if(m_vOutputs, [&](const auto& other) { return other->id == name; });
 }
 
-void CPortalManager::init() {
-    m_iPID = getpid();
+// in line for the name behind whoever has it. When they release it the bus hands it straight to us, so there's no
+// moment where it's unowned and activation could start yet another instance.
+static uint32_t queueForBusName(sdbus::IConnection& connection, const std::string& name) {
+    auto     bus    = sdbus::createProxy(connection, "org.freedesktop.DBus", "/org/freedesktop/DBus");
+    uint32_t result = 0;
+
+    // flags 0: no DO_NOT_QUEUE
+    bus->callMethod("RequestName").onInterface("org.freedesktop.DBus").withArguments(name, (uint32_t)0).storeResultsTo(result);
+
+    return result;
+}
+
+void CPortalManager::init(bool replace) {
+    // DBUS_REQUEST_NAME_REPLY_*
+    constexpr uint32_t NAME_PRIMARY_OWNER = 1, NAME_IN_QUEUE = 2;
+
+    SHandoffState      handoff;
 
     try {
-        m_pConnection = sdbus::createSessionBusConnection("org.freedesktop.impl.portal.desktop.hyprland");
+        if (replace) {
+            m_pConnection = sdbus::createSessionBusConnection();
+
+            // the running instance only lets go of the name once it handed us its sessions
+            const auto REPLY    = queueForBusName(*m_pConnection, DBUS_NAME);
+            const bool TOOKOVER = CHandoff::takeOver(handoff);
+
+            if (REPLY == NAME_IN_QUEUE && !TOOKOVER) {
+                Debug::log(CRIT, "{} is owned by an instance that didn't step down", DBUS_NAME);
+                exit(1);
+            } else if (REPLY != NAME_IN_QUEUE && REPLY != NAME_PRIMARY_OWNER) {
+                Debug::log(CRIT, "Couldn't get {} (RequestName replied {})", DBUS_NAME, REPLY);
+                exit(1);
+            }
+        } else
+            m_pConnection = sdbus::createSessionBusConnection(DBUS_NAME);
     } catch (std::exception& e) {
         Debug::log(CRIT, "Couldn't create the dbus connection ({})", e.what());
         exit(1);
@@ -282,6 +444,10 @@ void CPortalManager::init() {
         exit(1);
     }
 
+    // calls queue up on the socket until the event loop runs, so owning the name this early is safe
+    Debug::log(LOG, "[core] startup: dbus name acquired after {:.2f}ms",
+               std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_sStartup.exec).count() / 1000.0);
+
     // init wayland connection
     m_sWaylandConnection.display = wl_display_connect(nullptr);
 
@@ -299,121 +465,174 @@ void CPortalManager::init() {
         Debug::log(WARN, "XDG_CURRENT_DESKTOP unset, running on an unknown desktop");
     }
 
+    m_sWaylandConnection.queues.capture   = wl_display_create_queue(m_sWaylandConnection.display);
+    m_sWaylandConnection.queues.toplevel  = wl_display_create_queue(m_sWaylandConnection.display);
+    m_sWaylandConnection.queues.shortcuts = wl_display_create_queue(m_sWaylandConnection.display);
+
     wl_registry* registry = wl_display_get_registry(m_sWaylandConnection.display);
     wl_registry_add_listener(registry, &registryListener, nullptr);
 
-    pw_init(nullptr, nullptr);
-    m_sPipewire.loop = pw_loop_new(nullptr);
-
-    if (!m_sPipewire.loop)
-        Debug::log(ERR, "Pipewire: refused to create a loop. Screensharing will not work.");
-
     Debug::log(LOG, "Gathering exported interfaces");
 
     wl_display_roundtrip(m_sWaylandConnection.display);
 
     if (!m_sPortals.screencopy)
-        Debug::log(WARN, "Screencopy not started: compositor doesn't support zwlr_screencopy_v1 or pw refused a loop");
-    else if (m_sWaylandConnection.hyprlandToplevelMgr)
-        m_sPortals.screencopy->appendToplevelExport(m_sWaylandConnection.hyprlandToplevelMgr);
+        Debug::log(WARN, "Screencopy not started: compositor doesn't support zwlr_screencopy_v1");
+    else {
+        if (m_sWaylandConnection.hyprlandToplevelMgr)
+            m_sPortals.screencopy->appendToplevelExport(m_sWaylandConnection.hyprlandToplevelMgr);
+
+        if (m_sWaylandConnection.imageCopyCaptureMgr && m_sWaylandConnection.outputImageSourceMgr &&
+            std::any_cast<Hyprlang::INT>(m_sConfig.config->getConfigValue("screencopy:ext_image_copy_capture")))
+            m_sPortals.screencopy->appendImageCopyCapture(m_sWaylandConnection.imageCopyCaptureMgr, m_sWaylandConnection.outputImageSourceMgr);
+    }
+
+    g_pExecutableCache = std::make_unique<CExecutableCache>();
 
-    if (!inShellPath("grim"))
+    const bool HAS_GRIM       = inShellPath("grim");
+    const bool HAS_SLURP      = inShellPath("slurp");
+    const bool HAS_HYPRPICKER = inShellPath("hyprpicker");
+
+    if (!HAS_GRIM)
         Debug::log(WARN, "grim not found. Screenshots will not work.");
     else {
         m_sPortals.screenshot = std::make_unique<CScreenshotPortal>();
 
-        if (!inShellPath("slurp"))
+        if (!HAS_SLURP)
             Debug::log(WARN, "slurp not found. You won't be able to select a region when screenshotting.");
 
-        if (!inShellPath("slurp") && !inShellPath("hyprpicker"))
+        if (!HAS_SLURP && !HAS_HYPRPICKER)
             Debug::log(WARN, "Neither slurp nor hyprpicker found. You won't be able to pick colors.");
-        else if (!inShellPath("hyprpicker"))
+        else if (!HAS_HYPRPICKER)
             Debug::log(INFO, "hyprpicker not found. We suggest to use hyprpicker for color picking to be less meh.");
     }
 
     wl_display_roundtrip(m_sWaylandConnection.display);
 
+    m_sEventLoopInternals.pollFDs[POLLFD_DBUS]        = {.fd = m_pConnection->getEventLoopPollData().fd, .events = POLLIN};
+    m_sEventLoopInternals.pollFDs[POLLFD_WAYLAND]     = {.fd = wl_display_get_fd(m_sWaylandConnection.display), .events = POLLIN};
+    m_sEventLoopInternals.pollFDs[POLLFD_PIPEWIRE]    = {.fd = -1 /* see initPipewire() */, .events = POLLIN};
+    m_sEventLoopInternals.pollFDs[POLLFD_WAKEUP]      = {.fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK), .events = POLLIN};
+    m_sEventLoopInternals.pollFDs[POLLFD_EXECUTABLES] = {.fd = g_pExecutableCache->fd(), .events = POLLIN};
+    m_sEventLoopInternals.pollFDs[POLLFD_TIMERS]      = {.fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK), .events = POLLIN};
+
+    if (!handoff.sessions.empty()) {
+        if (m_sPortals.screencopy)
+            m_sPortals.screencopy->importSessions(handoff);
+        else
+            Debug::log(WARN, "[handoff] got {} sessions but screencopy is unavailable, dropping them", handoff.sessions.size());
+    }
+
+    m_pHandoff                                        = std::make_unique<CHandoff>();
+    m_sEventLoopInternals.pollFDs[POLLFD_HANDOFF]     = {.fd = m_pHandoff->fd(), .events = POLLIN};
+
+    signalWakeupFD = m_sEventLoopInternals.pollFDs[POLLFD_WAKEUP].fd;
+
+    struct sigaction sa = {};
+    sa.sa_handler       = onTerminateSignal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, nullptr);
+    sigaction(SIGINT, &sa, nullptr);
+
+    Debug::log(LOG, "[core] startup: ready to serve after {:.2f}ms",
+               std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_sStartup.exec).count() / 1000.0);
+
     startEventLoop();
 }
 
+bool CPortalManager::initPipewire() {
+    if (m_sPipewire.loop)
+        return true;
+
+    const auto BEGIN = std::chrono::steady_clock::now();
+
+    pw_init(nullptr, nullptr);
+    m_sPipewire.loop = pw_loop_new(nullptr);
+
+    if (!m_sPipewire.loop) {
+        Debug::log(ERR, "Pipewire: refused to create a loop. Screensharing will not work.");
+        return false;
+    }
+
+    m_sEventLoopInternals.pollFDs[POLLFD_PIPEWIRE].fd = pw_loop_get_fd(m_sPipewire.loop);
+    wakeupPollThread();
+
+    Debug::log(LOG, "[core] pipewire initialized in {:.2f}ms", std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - BEGIN).count() / 1000.0);
+
+    return true;
+}
+
+gbm_device* CPortalManager::getGBMDevice() {
+    if (m_sWaylandConnection.gbmDevice || !m_sWaylandConnection.dma.mainDevice)
+        return m_sWaylandConnection.gbmDevice;
+
+    m_sWaylandConnection.gbmDevice = createGBMDevice(m_sWaylandConnection.dma.mainDevice);
+
+    return m_sWaylandConnection.gbmDevice;
+}
+
+void CPortalManager::wakeupPollThread() {
+    const uint64_t ONE = 1;
+    if (write(m_sEventLoopInternals.pollFDs[POLLFD_WAKEUP].fd, &ONE, sizeof(ONE)) < 0)
+        Debug::log(ERR, "[core] couldn't wake the poll thread: {}", strerror(errno));
+}
+
 void CPortalManager::startEventLoop() {
 
-    pollfd pollfds[] = {
-        {
-            .fd     = m_pConnection->getEventLoopPollData().fd,
-            .events = POLLIN,
-        },
-        {
-            .fd     = wl_display_get_fd(m_sWaylandConnection.display),
-            .events = POLLIN,
-        },
-        {
-            .fd     = pw_loop_get_fd(m_sPipewire.loop),
-            .events = POLLIN,
-        },
-    };
+    auto& pollfds = m_sEventLoopInternals.pollFDs;
 
     std::thread pollThr([this, &pollfds]() {
         while (1) {
-            int ret = poll(pollfds, 3, 5000 /* 5 seconds, reasonable. It's because we might need to terminate */);
+            // no timeout needed, terminate() and signals wake us through the wakeup fd
+            int ret = poll(pollfds, POLLFD_COUNT, -1);
+            if (ret < 0 && errno == EINTR)
+                continue;
+
             if (ret < 0) {
                 Debug::log(CRIT, "[core] Polling fds failed with {}", strerror(errno));
                 g_pPortalManager->terminate();
             }
 
-            for (size_t i = 0; i < 3; ++i) {
+            for (size_t i = 0; i < POLLFD_COUNT; ++i) {
                 if (pollfds[i].revents & POLLHUP) {
                     Debug::log(CRIT, "[core] Disconnected from pollfd id {}", i);
                     g_pPortalManager->terminate();
                 }
             }
 
-            if (m_bTerminate)
-                break;
+            if (pollfds[POLLFD_WAKEUP].revents & POLLIN) {
+                // used to make us pick up changes to the fd set, and for terminating
+                uint64_t count = 0;
+                read(pollfds[POLLFD_WAKEUP].fd, &count, sizeof(count));
+                ret--;
 
-            if (ret != 0) {
-                Debug::log(TRACE, "[core] got poll event");
-                std::lock_guard<std::mutex> lg(m_sEventLoopInternals.loopRequestMutex);
-                m_sEventLoopInternals.shouldProcess = true;
-                m_sEventLoopInternals.loopSignal.notify_all();
+                if (terminateSignal) {
+                    Debug::log(LOG, "[core] Got signal {}, terminating", (int)terminateSignal);
+                    g_pPortalManager->terminate();
+                }
             }
-        }
-    });
 
-    m_sTimersThread.thread = std::make_unique<std::thread>([this] {
-        while (1) {
-            std::unique_lock lk(m_sTimersThread.loopMutex);
-
-            // find nearest timer ms
-            m_mEventLock.lock();
-            float nearest = 60000; /* reasonable timeout */
-            for (auto& t : m_sTimersThread.timers) {
-                float until = t->duration() - t->passedMs();
-                if (until < nearest)
-                    nearest = until;
-            }
-            m_mEventLock.unlock();
-
-            m_sTimersThread.loopSignal.wait_for(lk, std::chrono::milliseconds((int)nearest), [this] { return m_sTimersThread.shouldProcess; });
-            m_sTimersThread.shouldProcess = false;
-
-            if (m_bTerminate)
-                break;
-
-            // awakened. Check if any timers passed
-            m_mEventLock.lock();
-            bool notify = false;
-            for (auto& t : m_sTimersThread.timers) {
-                if (t->passed()) {
-                    Debug::log(TRACE, "[core] got timer event");
-                    notify = true;
-                    break;
+            if (m_bTerminate) {
+                {
+                    // loopMutex, not loopRequestMutex: the main thread may be between its predicate check and the wait
+                    std::lock_guard<std::mutex> lg(m_sEventLoopInternals.loopMutex);
+                    m_sEventLoopInternals.shouldProcess = true;
+                }
+                m_sEventLoopInternals.loopSignal.notify_all();
+
+                // main tears down now. If that hangs, the deadline gets us out.
+                pollfd deadline = {.fd = m_sEventLoopInternals.deadlineFD, .events = POLLIN};
+                while (poll(&deadline, 1, -1) < 0 && errno == EINTR) {
+                    ;
                 }
+
+                Debug::log(CRIT, "[core] Teardown didn't finish in {}ms, exiting by force", SHUTDOWN_DEADLINE_MS);
+                _exit(1);
             }
-            m_mEventLock.unlock();
 
-            if (notify) {
-                std::lock_guard<std::mutex> lg(m_sEventLoopInternals.loopRequestMutex);
+            if (ret > 0) {
+                Debug::log(TRACE, "[core] got poll event");
+                std::lock_guard<std::mutex> lg(m_sEventLoopInternals.loopMutex);
                 m_sEventLoopInternals.shouldProcess = true;
                 m_sEventLoopInternals.loopSignal.notify_all();
             }
@@ -435,62 +654,105 @@ void CPortalManager::startEventLoop() {
 
         m_mEventLock.lock();
 
-        if (pollfds[0].revents & POLLIN /* dbus */) {
+        if (pollfds[POLLFD_DBUS].revents & POLLIN) {
             while (m_pConnection->processPendingRequest()) {
-                ;
+                if (!m_sStartup.servedFirstMethod) {
+                    m_sStartup.servedFirstMethod = true;
+                    Debug::log(LOG, "[core] startup: first dbus message served after {:.2f}ms",
+                               std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_sStartup.exec).count() / 1000.0);
+                }
             }
         }
 
-        if (pollfds[1].revents & POLLIN /* wl */) {
+        if (pollfds[POLLFD_WAYLAND].revents & POLLIN) {
             wl_display_flush(m_sWaylandConnection.display);
-            if (wl_display_prepare_read(m_sWaylandConnection.display) == 0) {
+            // the default queue only tells us whether anything is already queued, reading fills all of them
+            if (wl_display_prepare_read(m_sWaylandConnection.display) == 0)
                 wl_display_read_events(m_sWaylandConnection.display);
-                wl_display_dispatch_pending(m_sWaylandConnection.display);
-            } else {
-                wl_display_dispatch(m_sWaylandConnection.display);
-            }
+            dispatchWayland();
         }
 
-        if (pollfds[2].revents & POLLIN /* pw */) {
+        if (pollfds[POLLFD_EXECUTABLES].revents & POLLIN)
+            g_pExecutableCache->onWatchEvent();
+
+        if (pollfds[POLLFD_HANDOFF].revents & POLLIN)
+            m_pHandoff->onConnection();
+
+        if (pollfds[POLLFD_PIPEWIRE].revents & POLLIN) {
             while (pw_loop_iterate(m_sPipewire.loop, 0) != 0) {
                 ;
             }
         }
 
-        std::vector<CTimer*> toRemove;
-        for (auto& t : m_sTimersThread.timers) {
-            if (t->passed()) {
-                t->m_fnCallback();
-                toRemove.emplace_back(t.get());
-                Debug::log(TRACE, "[core] calling timer {}", (void*)t.get());
-            }
+        if (pollfds[POLLFD_TIMERS].revents & POLLIN) {
+            uint64_t expirations = 0;
+            read(pollfds[POLLFD_TIMERS].fd, &expirations, sizeof(expirations));
+        }
+
+        // out of the list before any of them runs, callbacks add timers of their own (a tick scheduling the next one)
+        std::vector<std::unique_ptr<CTimer>> passed;
+        for (auto it = m_sTimers.timers.begin(); it != m_sTimers.timers.end();) {
+            if ((*it)->passed()) {
+                passed.emplace_back(std::move(*it));
+                it = m_sTimers.timers.erase(it);
+            } else
+                ++it;
+        }
+
+        for (auto& t : passed) {
+            Debug::log(TRACE, "[core] calling timer {}", (void*)t.get());
+            t->m_fnCallback();
         }
 
         int ret = 0;
         do {
-            ret = wl_display_dispatch_pending(m_sWaylandConnection.display);
+            ret = dispatchWayland();
             wl_display_flush(m_sWaylandConnection.display);
         } while (ret > 0);
 
-        if (!toRemove.empty())
-            std::erase_if(m_sTimersThread.timers,
-                          [&](const auto& t) { return std::find_if(toRemove.begin(), toRemove.end(), [&](const auto& other) { return other == t.get(); }) != toRemove.end(); });
+        rearmTimers();
 
         m_mEventLock.unlock();
     }
 
-    Debug::log(ERR, "[core] Terminated");
+    Debug::log(LOG, "[core] Terminating");
 
-    m_sPortals.globalShortcuts.reset();
+    // timers hold raw session pointers, drop them first. Then streams, buffers and sessions (screencopy does it in that order),
+    // then the rest of the dbus objects, and only after that the connections they live on.
+    m_sTimers.timers.clear();
+    m_pHandoff.reset();
     m_sPortals.screencopy.reset();
+    m_sPortals.globalShortcuts.reset();
     m_sPortals.screenshot.reset();
 
     m_pConnection.reset();
-    pw_loop_destroy(m_sPipewire.loop);
+    if (m_sPipewire.loop)
+        pw_loop_destroy(m_sPipewire.loop);
     wl_display_disconnect(m_sWaylandConnection.display);
+    close(pollfds[POLLFD_TIMERS].fd);
+    g_pExecutableCache.reset();
 
-    m_sTimersThread.thread.release();
-    pollThr.join(); // wait for poll to exit
+    Debug::log(LOG, "[core] Terminated in {:.2f}ms",
+               std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_sEventLoopInternals.terminateBegin).count() / 1000.0);
+
+    // the poll thread is parked on the deadline now, it dies with the process
+    pollThr.detach();
+}
+
+SOutput* CPortalManager::getOutputFromWl(wl_output* output) {
+    for (auto& o : m_vOutputs) {
+        if (o->output == output)
+            return o.get();
+    }
+    return nullptr;
+}
+
+std::vector<SOutput*> CPortalManager::getOutputs() {
+    std::vector<SOutput*> outputs;
+    for (auto& o : m_vOutputs) {
+        outputs.emplace_back(o.get());
+    }
+    return outputs;
 }
 
 sdbus::IConnection* CPortalManager::getConnection() {
@@ -549,24 +811,65 @@ gbm_device* CPortalManager::createGBMDevice(drmDevice* dev) {
 
 void CPortalManager::addTimer(const CTimer& timer) {
     Debug::log(TRACE, "[core] adding timer for {}ms", timer.duration());
-    m_sTimersThread.timers.emplace_back(std::make_unique<CTimer>(timer));
-    m_sTimersThread.shouldProcess = true;
-    m_sTimersThread.loopSignal.notify_all();
+    m_sTimers.timers.emplace_back(std::make_unique<CTimer>(timer));
+    rearmTimers();
 }
 
-void CPortalManager::terminate() {
-    m_bTerminate = true;
+int CPortalManager::dispatchWayland() {
+    const auto DISPLAY = m_sWaylandConnection.display;
+    int        total   = 0;
+
+    // frame events first, they are what sessions are waiting on
+    for (const auto& q : {m_sWaylandConnection.queues.capture, m_sWaylandConnection.queues.shortcuts, m_sWaylandConnection.queues.toplevel}) {
+        const int RET = wl_display_dispatch_queue_pending(DISPLAY, q);
+        if (RET < 0)
+            return -1;
+        total += RET;
+    }
 
-    // if we don't exit in 5s, we'll kill by force. Nuclear option. PIDs are not reused in linux until a wrap-around,
-    // and I doubt anyone will make 4.2M PIDs within 5s.
-    if (fork() == 0)
-        execl("/bin/sh", "/bin/sh", "-c", std::format("sleep 5 && kill -9 {}", m_iPID).c_str(), nullptr);
+    const int RET = wl_display_dispatch_pending(DISPLAY);
+    if (RET < 0)
+        return -1;
+
+    return total + RET;
+}
+
+void CPortalManager::rearmTimers() {
+    // single timerfd for all timers, armed to the nearest one. Zeroed itimerspec disarms.
+    itimerspec spec = {};
+
+    if (!m_sTimers.timers.empty()) {
+        float nearest = std::numeric_limits<float>::max();
+        for (auto& t : m_sTimers.timers) {
+            float until = t->duration() - t->passedMs();
+            if (until < nearest)
+                nearest = until;
+        }
 
-    {
-        m_sEventLoopInternals.shouldProcess = true;
-        m_sEventLoopInternals.loopSignal.notify_all();
+        // 0 would disarm, fire asap for already passed ones
+        const uint64_t NS     = std::max((uint64_t)(std::max(nearest, 0.F) * 1000000.0), (uint64_t)1);
+        spec.it_value.tv_sec  = NS / 1000000000;
+        spec.it_value.tv_nsec = NS % 1000000000;
     }
 
-    m_sTimersThread.shouldProcess = true;
-    m_sTimersThread.loopSignal.notify_all();
+    if (timerfd_settime(m_sEventLoopInternals.pollFDs[POLLFD_TIMERS].fd, 0, &spec, nullptr) < 0)
+        Debug::log(ERR, "[core] couldn't arm the timer fd: {}", strerror(errno));
+}
+
+void CPortalManager::terminate() {
+    if (m_bTerminate)
+        return;
+
+    m_sEventLoopInternals.terminateBegin = std::chrono::steady_clock::now();
+
+    // arm the deadline before flagging, the poll thread waits on it as soon as it sees m_bTerminate
+    m_sEventLoopInternals.deadlineFD = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    itimerspec deadline              = {};
+    deadline.it_value.tv_sec         = SHUTDOWN_DEADLINE_MS / 1000;
+    deadline.it_value.tv_nsec        = (SHUTDOWN_DEADLINE_MS % 1000) * 1000000L;
+    timerfd_settime(m_sEventLoopInternals.deadlineFD, 0, &deadline, nullptr);
+
+    m_bTerminate = true;
+
+    wakeupPollThread();
 }
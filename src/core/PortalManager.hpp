@@ -9,20 +9,43 @@
 #include "../portals/Screenshot.hpp"
 #include "../portals/GlobalShortcuts.hpp"
 #include "../helpers/Timer.hpp"
+#include "../helpers/PresentClock.hpp"
 #include "../shared/ToplevelManager.hpp"
+#include "Handoff.hpp"
 #include <gbm.h>
 #include <xf86drm.h>
 
+#include <atomic>
 #include <mutex>
+#include <poll.h>
 
 struct pw_loop;
+struct zxdg_output_v1;
 
 struct SOutput {
     std::string         name;
     wl_output*          output      = nullptr;
+    zxdg_output_v1*     xdgOutput   = nullptr;
     uint32_t            id          = 0;
     float               refreshRate = 60.0;
     wl_output_transform transform   = WL_OUTPUT_TRANSFORM_NORMAL;
+    CPresentClock       presentClock; // fed by the sessions capturing it
+
+    // where it sits in the compositor's global space, from xdg-output. w and h are 0 until known.
+    struct {
+        int32_t x = 0, y = 0, w = 0, h = 0;
+    } logical;
+};
+
+enum ePollFD {
+    POLLFD_DBUS = 0,
+    POLLFD_WAYLAND,
+    POLLFD_PIPEWIRE,
+    POLLFD_WAKEUP,
+    POLLFD_EXECUTABLES,
+    POLLFD_TIMERS,
+    POLLFD_HANDOFF,
+    POLLFD_COUNT,
 };
 
 struct SDMABUFModifier {
@@ -34,13 +57,22 @@ class CPortalManager {
   public:
     CPortalManager();
 
-    void                init();
+    // replace: take over the sessions of a running instance, see CHandoff
+    void                init(bool replace);
 
     void                onGlobal(void* data, struct wl_registry* registry, uint32_t name, const char* interface, uint32_t version);
     void                onGlobalRemoved(void* data, struct wl_registry* registry, uint32_t name);
 
     sdbus::IConnection* getConnection();
     SOutput*            getOutputFromName(const std::string& name);
+    SOutput*            getOutputFromWl(wl_output* output);
+
+    // all of them, for capturing everything at once
+    std::vector<SOutput*> getOutputs();
+
+    // PipeWire and GBM are only needed once something is shared, keep them off the startup path
+    bool                initPipewire();
+    gbm_device*         getGBMDevice();
 
     struct {
         pw_loop* loop = nullptr;
@@ -57,18 +89,32 @@ class CPortalManager {
     } m_sHelpers;
 
     struct {
-        wl_display* display             = nullptr;
-        void*       hyprlandToplevelMgr = nullptr;
-        void*       linuxDmabuf         = nullptr;
-        void*       linuxDmabufFeedback = nullptr;
-        wl_shm*     shm                 = nullptr;
-        gbm_bo*     gbm                 = nullptr;
-        gbm_device* gbmDevice           = nullptr;
+        wl_display* display              = nullptr;
+        void*       hyprlandToplevelMgr  = nullptr;
+        void*       imageCopyCaptureMgr  = nullptr;
+        void*       outputImageSourceMgr = nullptr;
+        void*       screencopyMgr        = nullptr; // also owned by the screencopy portal, screenshots capture through it
+        void*       xdgOutputMgr         = nullptr;
+        void*       linuxDmabuf          = nullptr;
+        void*       linuxDmabufFeedback  = nullptr;
+        wl_shm*     shm                  = nullptr;
+        wl_seat*    seat                 = nullptr; // the first one, whose pointer screencopy:software_cursor follows
+        wl_pointer* pointer              = nullptr;
+        gbm_bo*     gbm                  = nullptr;
+        gbm_device* gbmDevice            = nullptr;
         struct {
-            void*  formatTable     = nullptr;
-            size_t formatTableSize = 0;
-            bool   deviceUsed      = false;
+            void*      formatTable     = nullptr;
+            size_t     formatTableSize = 0;
+            bool       deviceUsed      = false;
+            drmDevice* mainDevice      = nullptr;
         } dma;
+
+        // so a storm of title changes or shortcut events can't sit in front of frame events, see dispatchWayland
+        struct {
+            wl_event_queue* capture   = nullptr;
+            wl_event_queue* toplevel  = nullptr;
+            wl_event_queue* shortcuts = nullptr;
+        } queues;
     } m_sWaylandConnection;
 
     struct {
@@ -77,35 +123,52 @@ class CPortalManager {
 
     std::vector<SDMABUFModifier> m_vDMABUFMods;
 
+    const std::string            DBUS_NAME = "org.freedesktop.impl.portal.desktop.hyprland";
+
+    // fine from inside a timer callback, capture retries and renegotiation reschedule from the tick that found the problem.
+    // A timer added there runs on a later pass of the loop, never the one it was added in.
     void                         addTimer(const CTimer& timer);
 
     gbm_device*                  createGBMDevice(drmDevice* dev);
 
-    // terminate after the event loop has been created. Before we can exit()
+    // terminate after the event loop has been created. Before we can exit().
+    // Safe to call from any thread, the main loop tears down and a hard deadline kills us if that hangs.
     void terminate();
 
+    // all queues, capture first. Returns the number of events dispatched, -1 on error.
+    // Also for whoever reads the display on their own queue, so events that read put on other queues don't wait for the next wakeup.
+    int                          dispatchWayland();
+
   private:
-    void  startEventLoop();
+    void              startEventLoop();
+    void              wakeupPollThread();
+    void              rearmTimers();
 
-    bool  m_bTerminate = false;
-    pid_t m_iPID       = 0;
+    std::atomic<bool> m_bTerminate = false;
+
+    struct {
+        std::chrono::steady_clock::time_point exec;
+        bool                                  servedFirstMethod = false;
+    } m_sStartup;
 
     struct {
         std::condition_variable loopSignal;
         std::mutex              loopMutex;
         std::atomic<bool>       shouldProcess = false;
         std::mutex              loopRequestMutex;
+        pollfd                  pollFDs[POLLFD_COUNT];
+
+        // armed by terminate(), watched by the poll thread once we're going down
+        int                                   deadlineFD = -1;
+        std::chrono::steady_clock::time_point terminateBegin;
     } m_sEventLoopInternals;
 
     struct {
-        std::condition_variable              loopSignal;
-        std::mutex                           loopMutex;
-        bool                                 shouldProcess = false;
         std::vector<std::unique_ptr<CTimer>> timers;
-        std::unique_ptr<std::thread>         thread;
-    } m_sTimersThread;
+    } m_sTimers;
 
     std::unique_ptr<sdbus::IConnection>   m_pConnection;
+    std::unique_ptr<CHandoff>             m_pHandoff;
     std::vector<std::unique_ptr<SOutput>> m_vOutputs;
 
     std::mutex                            m_mEventLock;
@@ -0,0 +1,153 @@
+#include "ExecutableCache.hpp"
+#include "Log.hpp"
+
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <cstring>
+#include <cstdlib>
+#include <filesystem>
+
+constexpr uint32_t WATCH_MASK = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF;
+
+CExecutableCache::CExecutableCache() {
+    const char* path = std::getenv("PATH");
+
+    if (path) {
+        std::string pathString = path;
+        size_t      nextBegin  = 0;
+        for (size_t i = 0; i <= pathString.size(); i++) {
+            if (i == pathString.size() || pathString[i] == ':') {
+                if (i > nextBegin)
+                    m_vPaths.push_back(pathString.substr(nextBegin, i - nextBegin));
+                nextBegin = i + 1;
+            }
+        }
+    }
+
+    m_iInotifyFD = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    if (m_iInotifyFD < 0) {
+        Debug::log(WARN, "[exec] inotify unavailable ({}), executable lookups won't be cached", strerror(errno));
+        return;
+    }
+
+    watchPaths();
+
+    Debug::log(LOG, "[exec] watching {} dirs for {} $PATH entries", m_mWatches.size(), m_vPaths.size());
+}
+
+void CExecutableCache::watchPaths() {
+    std::unordered_map<int, bool> watches;
+
+    for (const auto& p : m_vPaths) {
+        // a dir that doesn't exist yet (~/.local/bin before anything was installed there) can still appear. Watch the closest
+        // parent that does, anything created in it makes us look again.
+        std::filesystem::path dir     = p;
+        bool                  standIn = false;
+
+        while (true) {
+            const int WD = inotify_add_watch(m_iInotifyFD, dir.c_str(), WATCH_MASK);
+
+            if (WD >= 0) {
+                watches[WD] = watches[WD] || standIn;
+                break;
+            }
+
+            const auto PARENT = dir.parent_path();
+            if ((errno != ENOENT && errno != ENOTDIR) || PARENT.empty() || PARENT == dir)
+                break;
+
+            dir     = PARENT;
+            standIn = true;
+        }
+    }
+
+    // stand-ins we don't need anymore. Their IN_IGNORED comes for a wd we no longer know and is skipped.
+    for (const auto& [wd, standIn] : m_mWatches) {
+        if (!watches.contains(wd))
+            inotify_rm_watch(m_iInotifyFD, wd);
+    }
+
+    m_mWatches = std::move(watches);
+}
+
+CExecutableCache::~CExecutableCache() {
+    if (m_iInotifyFD >= 0)
+        close(m_iInotifyFD);
+}
+
+int CExecutableCache::fd() const {
+    return m_iInotifyFD;
+}
+
+std::string CExecutableCache::lookup(const std::string& exec) {
+    if (exec.starts_with("/") || exec.starts_with("./") || exec.starts_with("../"))
+        return access(exec.c_str(), X_OK) == 0 ? exec : "";
+
+    for (auto& p : m_vPaths) {
+        std::string full = p + "/" + exec;
+        if (access(full.c_str(), X_OK) == 0)
+            return full;
+    }
+
+    return "";
+}
+
+const std::string& CExecutableCache::resolve(const std::string& exec) {
+    if (m_iInotifyFD < 0) {
+        m_szUncached = lookup(exec);
+        return m_szUncached;
+    }
+
+    if (const auto IT = m_mResolved.find(exec); IT != m_mResolved.end())
+        return IT->second;
+
+    // negative results are cached too, a later IN_CREATE drops them
+    return m_mResolved.emplace(exec, lookup(exec)).first->second;
+}
+
+void CExecutableCache::onWatchEvent() {
+    alignas(inotify_event) char buffer[4096];
+    bool                        rewatch = false;
+
+    while (true) {
+        const auto LEN = read(m_iInotifyFD, buffer, sizeof(buffer));
+        if (LEN <= 0)
+            break;
+
+        for (ssize_t off = 0; off < LEN;) {
+            const auto* EVENT = (inotify_event*)(buffer + off);
+            off += sizeof(inotify_event) + EVENT->len;
+
+            if (EVENT->mask & IN_Q_OVERFLOW) {
+                // we lost events, start over
+                Debug::log(TRACE, "[exec] inotify queue overflowed, dropping cache");
+                m_mResolved.clear();
+                rewatch = true;
+                continue;
+            }
+
+            const auto WATCH = m_mWatches.find(EVENT->wd);
+            if (WATCH == m_mWatches.end())
+                continue;
+
+            if ((EVENT->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) || WATCH->second) {
+                // a whole dir changed, or something changed where a missing $PATH dir would be. Start over.
+                Debug::log(TRACE, "[exec] $PATH dir changed, dropping cache");
+                m_mResolved.clear();
+                rewatch = true;
+                continue;
+            }
+
+            if (EVENT->len == 0)
+                continue;
+
+            // only the changed name can resolve differently now, ordering of $PATH included
+            Debug::log(TRACE, "[exec] {} changed in $PATH, invalidating", EVENT->name);
+            m_mResolved.erase(EVENT->name);
+        }
+    }
+
+    if (rewatch)
+        watchPaths();
+}
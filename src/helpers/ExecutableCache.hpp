@@ -0,0 +1,34 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// name -> absolute path cache for $PATH lookups, kept fresh by inotify watches on the $PATH dirs (or their closest parents)
+class CExecutableCache {
+  public:
+    CExecutableCache();
+    ~CExecutableCache();
+
+    // empty if not found
+    const std::string& resolve(const std::string& exec);
+
+    // for the event loop. -1 if inotify is unavailable, in which case nothing is cached.
+    int  fd() const;
+    void onWatchEvent();
+
+  private:
+    std::string                                  lookup(const std::string& exec);
+    // (re)adds a watch for every $PATH dir, or for its closest existing parent while it doesn't exist
+    void                                         watchPaths();
+
+    int                                          m_iInotifyFD = -1;
+    std::vector<std::string>                     m_vPaths;
+    std::unordered_map<int, bool>                m_mWatches; // wd -> stands in for a missing $PATH dir
+    std::unordered_map<std::string, std::string> m_mResolved;
+
+    std::string                                  m_szUncached;
+};
+
+inline std::unique_ptr<CExecutableCache> g_pExecutableCache;
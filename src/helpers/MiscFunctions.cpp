@@ -1,7 +1,10 @@
 #include "MiscFunctions.hpp"
+#include "ExecutableCache.hpp"
 #include "../helpers/Log.hpp"
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
 #include <filesystem>
 #include <cstdlib>
 #include <vector>
@@ -32,31 +35,53 @@ void addHyprlandNotification(const std::string& icon, float timeMs, const std::s
 }
 
 bool inShellPath(const std::string& exec) {
+    return !g_pExecutableCache->resolve(exec).empty();
+}
+
+std::string execAndGet(const std::vector<std::string>& args) {
+    Debug::log(LOG, "execAndGet (no shell): {}", args[0]);
+
+    // build argv before forking, the child must not allocate
+    std::vector<char*> argv;
+    for (auto& a : args) {
+        argv.push_back((char*)a.c_str());
+    }
+    argv.push_back(nullptr);
+
+    int pipeFDs[2];
+    if (pipe2(pipeFDs, O_CLOEXEC) < 0) {
+        Debug::log(ERR, "execAndGet: failed in pipe");
+        return "";
+    }
 
-    if (exec.starts_with("/") || exec.starts_with("./") || exec.starts_with("../"))
-        return std::filesystem::exists(exec);
+    const auto PID = fork();
+    if (PID < 0) {
+        Debug::log(ERR, "execAndGet: failed in fork");
+        close(pipeFDs[0]);
+        close(pipeFDs[1]);
+        return "";
+    }
 
-    // we are relative to our PATH
-    const char* path = std::getenv("PATH");
+    if (PID == 0) {
+        dup2(pipeFDs[1], STDOUT_FILENO);
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
 
-    if (!path)
-        return false;
+    close(pipeFDs[1]);
 
-    // collect paths
-    std::string              pathString = path;
-    std::vector<std::string> paths;
-    uint32_t                 nextBegin = 0;
-    for (uint32_t i = 0; i < pathString.size(); i++) {
-        if (path[i] == ':') {
-            paths.push_back(pathString.substr(nextBegin, i - nextBegin));
-            nextBegin = i + 1;
-        }
+    std::array<char, 4096> buffer;
+    std::string            result;
+    ssize_t                len = 0;
+    while ((len = read(pipeFDs[0], buffer.data(), buffer.size())) > 0 || (len < 0 && errno == EINTR)) {
+        if (len > 0)
+            result.append(buffer.data(), len);
     }
 
-    if (nextBegin < pathString.size())
-        paths.push_back(pathString.substr(nextBegin, pathString.size() - nextBegin));
+    close(pipeFDs[0]);
+    waitpid(PID, nullptr, 0);
 
-    return std::ranges::any_of(paths, [&exec](std::string& path) { return access((path + "/" + exec).c_str(), X_OK) == 0; });
+    return result;
 }
 
 void sendEmptyDbusMethodReply(sdbus::MethodCall& call, u_int32_t responseCode) {
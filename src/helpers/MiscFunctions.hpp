@@ -1,8 +1,11 @@
 #pragma once
 #include <string>
+#include <vector>
 #include <sdbus-c++/Message.h>
 
 std::string execAndGet(const char* cmd);
+// args[0] has to be an absolute path, see CExecutableCache
+std::string execAndGet(const std::vector<std::string>& args);
 void        addHyprlandNotification(const std::string& icon, float timeMs, const std::string& color, const std::string& message);
 bool        inShellPath(const std::string& exec);
 void        sendEmptyDbusMethodReply(sdbus::MethodCall& call, u_int32_t responseCode);
\ No newline at end of file
@@ -0,0 +1,99 @@
+#include "PNG.hpp"
+#include "Log.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <zlib.h>
+
+// deflate output is cut into IDAT chunks of this size
+constexpr size_t IDAT_CHUNK = 256 * 1024;
+
+static void putBE32(std::vector<uint8_t>& out, uint32_t v) {
+    out.push_back(v >> 24);
+    out.push_back(v >> 16);
+    out.push_back(v >> 8);
+    out.push_back(v);
+}
+
+static void putChunk(std::vector<uint8_t>& out, const char type[4], const uint8_t* data, size_t len) {
+    putBE32(out, len);
+    const size_t TYPEAT = out.size();
+    out.insert(out.end(), type, type + 4);
+    if (len)
+        out.insert(out.end(), data, data + len);
+    putBE32(out, crc32(0, out.data() + TYPEAT, len + 4));
+}
+
+bool writePNG(const std::string& path, uint32_t w, uint32_t h, const uint8_t* rgb, size_t stride) {
+    std::vector<uint8_t> png;
+
+    static constexpr uint8_t SIGNATURE[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    png.insert(png.end(), SIGNATURE, SIGNATURE + sizeof(SIGNATURE));
+
+    std::vector<uint8_t> ihdr;
+    putBE32(ihdr, w);
+    putBE32(ihdr, h);
+    ihdr.insert(ihdr.end(), {8 /* depth */, 2 /* rgb */, 0, 0, 0});
+    putChunk(png, "IHDR", ihdr.data(), ihdr.size());
+
+    z_stream zs = {};
+    if (deflateInit(&zs, PNG_DEFLATE_LEVEL) != Z_OK) {
+        Debug::log(ERR, "[png] couldn't set up deflate");
+        return false;
+    }
+
+    // rows go in one by one behind their filter byte, no copy of the whole image
+    std::vector<uint8_t> row((size_t)w * 3 + 1);
+    std::vector<uint8_t> idat(IDAT_CHUNK);
+    int                  ret = Z_OK;
+
+    zs.next_out  = idat.data();
+    zs.avail_out = idat.size();
+
+    for (uint32_t y = 0; y <= h && ret != Z_STREAM_END; ++y) {
+        const bool LAST = y == h;
+
+        if (!LAST) {
+            row[0] = 0; // filter: none
+            memcpy(row.data() + 1, rgb + (size_t)y * stride, (size_t)w * 3);
+            zs.next_in  = row.data();
+            zs.avail_in = row.size();
+        }
+
+        do {
+            ret = deflate(&zs, LAST ? Z_FINISH : Z_NO_FLUSH);
+
+            if (ret == Z_STREAM_ERROR) {
+                Debug::log(ERR, "[png] deflate failed");
+                deflateEnd(&zs);
+                return false;
+            }
+
+            if (zs.avail_out == 0 || ret == Z_STREAM_END) {
+                putChunk(png, "IDAT", idat.data(), idat.size() - zs.avail_out);
+                zs.next_out  = idat.data();
+                zs.avail_out = idat.size();
+            }
+        } while (zs.avail_in > 0 || (LAST && ret != Z_STREAM_END));
+    }
+
+    deflateEnd(&zs);
+
+    putChunk(png, "IEND", nullptr, 0);
+
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file) {
+        Debug::log(ERR, "[png] couldn't open {}: {}", path, strerror(errno));
+        return false;
+    }
+
+    const bool OK = fwrite(png.data(), 1, png.size(), file) == png.size();
+    fclose(file);
+
+    if (!OK)
+        Debug::log(ERR, "[png] short write to {}", path);
+
+    return OK;
+}
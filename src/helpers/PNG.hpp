@@ -0,0 +1,10 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// screenshots are mostly flat areas that compress well at any level, take the fastest
+constexpr int PNG_DEFLATE_LEVEL = 1;
+
+// Writes 8 bit RGB rows as a PNG, deflated at PNG_DEFLATE_LEVEL.
+bool writePNG(const std::string& path, uint32_t w, uint32_t h, const uint8_t* rgb, size_t stride);
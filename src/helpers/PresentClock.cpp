@@ -0,0 +1,79 @@
+#include "PresentClock.hpp"
+#include "Log.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <time.h>
+
+// samples within this fraction of a period of the grid count as on it
+constexpr double GRID_TOLERANCE = 0.1;
+// consecutive on-grid samples before we schedule by it
+constexpr uint32_t LOCK_SAMPLES = 4;
+
+void CPresentClock::setRefresh(int32_t mHz) {
+    if (mHz <= 0)
+        return;
+
+    const double NOMINAL = 1000000000000.0 / mHz;
+    if (NOMINAL == m_fNominalNs)
+        return;
+
+    // a new mode, whatever we learnt is for the old one
+    m_fNominalNs  = NOMINAL;
+    m_fPeriodNs   = NOMINAL;
+    m_iGoodStreak = 0;
+}
+
+void CPresentClock::onPresented(uint64_t ns) {
+    // several sessions on one output report the same presentation, and a retried frame can report an older one
+    if (ns <= m_iLastNs)
+        return;
+
+    const uint64_t LAST = std::exchange(m_iLastNs, ns);
+
+    if (!LAST || m_fPeriodNs <= 0)
+        return;
+
+    const double DELTA   = ns - LAST;
+    const double PERIODS = std::round(DELTA / m_fPeriodNs);
+    const double OFFGRID = DELTA - PERIODS * m_fPeriodNs;
+
+    if (PERIODS < 1 || std::abs(OFFGRID) > m_fPeriodNs * GRID_TOLERANCE) {
+        if (m_iGoodStreak >= LOCK_SAMPLES)
+            Debug::log(LOG, "[present] lost the vblank grid ({:.2f}ms off after {} periods), falling back to timers", OFFGRID / 1000000.0, PERIODS);
+        m_iGoodStreak = 0;
+        return;
+    }
+
+    // follow the real period slowly, one late timestamp shouldn't shift the grid. Long gaps say little about a single period.
+    if (PERIODS <= 8) {
+        m_fPeriodNs += OFFGRID / PERIODS / 16.0;
+        if (m_fNominalNs > 0)
+            m_fPeriodNs = std::clamp(m_fPeriodNs, m_fNominalNs * 0.95, m_fNominalNs * 1.05);
+    }
+
+    if (++m_iGoodStreak == LOCK_SAMPLES)
+        Debug::log(LOG, "[present] locked onto a {:.3f}ms vblank grid", m_fPeriodNs / 1000000.0);
+}
+
+bool CPresentClock::locked() const {
+    return m_iGoodStreak >= LOCK_SAMPLES;
+}
+
+double CPresentClock::periodNs() const {
+    return m_fPeriodNs;
+}
+
+uint64_t CPresentClock::nextVblank(uint64_t ns) const {
+    if (m_fPeriodNs <= 0 || ns <= m_iLastNs)
+        return m_iLastNs;
+
+    return m_iLastNs + (uint64_t)(std::ceil((ns - m_iLastNs) / m_fPeriodNs) * m_fPeriodNs);
+}
+
+uint64_t CPresentClock::now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstdint>
+
+// An output's vblank grid, learnt from the presentation timestamps frames come back with (CLOCK_MONOTONIC).
+// Starts from the mode's nominal refresh and follows the actual period, which drifts a bit from it on most hardware.
+// Samples off the grid (VRR, a compositor that timestamps at copy time) reset the phase and unlock it until it settles again.
+class CPresentClock {
+  public:
+    void     setRefresh(int32_t mHz);
+    void     onPresented(uint64_t ns);
+
+    // enough consecutive samples agreed with the grid to schedule by it
+    bool     locked() const;
+    double   periodNs() const;
+    // the first vblank at or after ns
+    uint64_t nextVblank(uint64_t ns) const;
+
+    static uint64_t now();
+
+  private:
+    double   m_fNominalNs  = 0;
+    double   m_fPeriodNs   = 0;
+    uint64_t m_iLastNs     = 0;
+    uint32_t m_iGoodStreak = 0;
+};
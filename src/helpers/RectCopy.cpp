@@ -0,0 +1,163 @@
+#include "RectCopy.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <thread>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// below this, the copy fits in cache and plain stores are as fast
+constexpr size_t STREAM_MIN_BYTES = 256 * 1024;
+// below this, starting threads costs more than it saves. A 4K frame is ~33MB.
+constexpr size_t PARALLEL_MIN_BYTES = 8 * 1024 * 1024;
+constexpr size_t MAX_COPY_THREADS   = 4;
+
+CDamageRing::CDamageRing(size_t frames) : m_vFrames(frames) {
+    ;
+}
+
+void CDamageRing::beginFrame() {
+    auto& frame = m_vFrames[++m_iLatest % m_vFrames.size()];
+    frame.seq   = m_iLatest;
+    frame.full  = false;
+    frame.rects.clear();
+}
+
+void CDamageRing::add(const SCopyRect& rect) {
+    if (!m_iLatest || rect.w == 0 || rect.h == 0)
+        return;
+
+    m_vFrames[m_iLatest % m_vFrames.size()].rects.emplace_back(rect);
+}
+
+void CDamageRing::addFull(uint32_t w, uint32_t h) {
+    if (!m_iLatest)
+        return;
+
+    auto& frame = m_vFrames[m_iLatest % m_vFrames.size()];
+    frame.full  = true;
+    frame.rects = {SCopyRect{0, 0, w, h}};
+}
+
+uint64_t CDamageRing::latest() const {
+    return m_iLatest;
+}
+
+bool CDamageRing::since(uint64_t frame, std::vector<SCopyRect>& out) const {
+    out.clear();
+
+    if (!frame || frame > m_iLatest || m_iLatest - frame >= m_vFrames.size())
+        return false;
+
+    for (uint64_t seq = frame + 1; seq <= m_iLatest; ++seq) {
+        const auto& FRAME = m_vFrames[seq % m_vFrames.size()];
+
+        if (FRAME.seq != seq || FRAME.full)
+            return false;
+
+        for (const auto& r : FRAME.rects) {
+            // the same rect damaged frame after frame, e.g. a blinking caret
+            if (std::ranges::none_of(out, [&r](const auto& o) { return o.x == r.x && o.y == r.y && o.w == r.w && o.h == r.h; }))
+                out.emplace_back(r);
+        }
+    }
+
+    if (out.size() > MAX_RECTS) {
+        SCopyRect box = out[0];
+        uint32_t  x1 = box.x + box.w, y1 = box.y + box.h;
+        for (const auto& r : out) {
+            x1    = std::max(x1, r.x + r.w);
+            y1    = std::max(y1, r.y + r.h);
+            box.x = std::min(box.x, r.x);
+            box.y = std::min(box.y, r.y);
+        }
+
+        box.w = x1 - box.x;
+        box.h = y1 - box.y;
+        out   = {box};
+    }
+
+    return true;
+}
+
+static void copyRow(uint8_t* dst, const uint8_t* src, size_t len, bool stream) {
+#ifdef __SSE2__
+    if (stream) {
+        // streaming stores want 16 byte aligned destinations, the edges go through memcpy
+        const size_t HEAD = std::min(len, (16 - ((uintptr_t)dst & 15)) & 15);
+        memcpy(dst, src, HEAD);
+
+        size_t i = HEAD;
+        for (; i + 64 <= len; i += 64) {
+            const __m128i A = _mm_loadu_si128((const __m128i*)(src + i));
+            const __m128i B = _mm_loadu_si128((const __m128i*)(src + i + 16));
+            const __m128i C = _mm_loadu_si128((const __m128i*)(src + i + 32));
+            const __m128i D = _mm_loadu_si128((const __m128i*)(src + i + 48));
+            _mm_stream_si128((__m128i*)(dst + i), A);
+            _mm_stream_si128((__m128i*)(dst + i + 16), B);
+            _mm_stream_si128((__m128i*)(dst + i + 32), C);
+            _mm_stream_si128((__m128i*)(dst + i + 48), D);
+        }
+
+        memcpy(dst + i, src + i, len - i);
+        return;
+    }
+#endif
+
+    memcpy(dst, src, len);
+}
+
+size_t copyRects(uint8_t* dst, uint32_t dstStride, const uint8_t* src, uint32_t srcStride, uint32_t bpp, const std::vector<SCopyRect>& rects) {
+    size_t bytes = 0, rows = 0;
+    for (const auto& r : rects) {
+        bytes += (size_t)r.w * r.h * bpp;
+        rows += r.h;
+    }
+
+    const bool STREAM = bytes >= STREAM_MIN_BYTES;
+
+    // rows [begin, end) of all rects one after another, so threads get equal shares whatever the rects look like
+    const auto COPYROWS = [&](size_t begin, size_t end) {
+        size_t first = 0;
+        for (const auto& r : rects) {
+            const size_t FROM = std::max(begin, first), TO = std::min(end, first + r.h);
+
+            for (size_t row = FROM; row < TO; ++row) {
+                const size_t Y = r.y + (row - first);
+                copyRow(dst + Y * dstStride + (size_t)r.x * bpp, src + Y * srcStride + (size_t)r.x * bpp, (size_t)r.w * bpp, STREAM);
+            }
+
+            first += r.h;
+        }
+
+#ifdef __SSE2__
+        if (STREAM)
+            _mm_sfence();
+#endif
+    };
+
+    const size_t THREADS = bytes >= PARALLEL_MIN_BYTES ? std::clamp<size_t>(std::thread::hardware_concurrency(), 1, MAX_COPY_THREADS) : 1;
+
+    if (THREADS == 1) {
+        COPYROWS(0, rows);
+        return bytes;
+    }
+
+    std::vector<std::thread> workers;
+    workers.reserve(THREADS - 1);
+
+    const size_t SHARE = (rows + THREADS - 1) / THREADS;
+    for (size_t i = 1; i < THREADS; ++i) {
+        workers.emplace_back(COPYROWS, std::min(rows, i * SHARE), std::min(rows, (i + 1) * SHARE));
+    }
+
+    COPYROWS(0, std::min(rows, SHARE));
+
+    for (auto& w : workers) {
+        w.join();
+    }
+
+    return bytes;
+}
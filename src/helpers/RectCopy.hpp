@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+struct SCopyRect {
+    uint32_t x = 0, y = 0, w = 0, h = 0;
+};
+
+// The damaged parts of frames, a handful of rects each. Rects past the limit collapse into their bounding box, the
+// copy stays one pass over memory and a burst of small damage can't turn into thousands of tiny row copies.
+class CDamageRing {
+  public:
+    CDamageRing(size_t frames);
+
+    // starts frame number latest() + 1, whose damage is added next
+    void     beginFrame();
+    void     add(const SCopyRect& rect);
+    // everything changed, e.g. the first frame or a failed copy
+    void     addFull(uint32_t w, uint32_t h);
+    uint64_t latest() const;
+
+    // what changed after frame `since` up to latest(). false if that's out of the ring and all of it has to go.
+    bool     since(uint64_t frame, std::vector<SCopyRect>& out) const;
+
+    static constexpr size_t MAX_RECTS = 16;
+
+  private:
+    struct SFrame {
+        uint64_t               seq = 0;
+        std::vector<SCopyRect> rects;
+        bool                   full = false;
+    };
+
+    std::vector<SFrame> m_vFrames;
+    uint64_t            m_iLatest = 0;
+};
+
+// copies rects between two buffers of the same format, row by row. Large copies bypass the cache on the way out (the
+// consumer reads them in another process, they'd only evict our working set) and are split across a few threads.
+// Returns the bytes copied.
+size_t copyRects(uint8_t* dst, uint32_t dstStride, const uint8_t* src, uint32_t srcStride, uint32_t bpp, const std::vector<SCopyRect>& rects);
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// tiny host-endian binary encoding for state that never leaves this machine (handoff, token store)
+
+template <typename T>
+inline void writeRaw(std::string& out, T val) {
+    out.append((const char*)&val, sizeof(T));
+}
+
+inline void writeString(std::string& out, const std::string& str) {
+    writeRaw<uint32_t>(out, str.size());
+    out.append(str);
+}
+
+// bounds-checked, a short read flips good() and returns zeroes from there on
+class CByteReader {
+  public:
+    CByteReader(const char* data, size_t len) : m_pData(data), m_iLen(len) {}
+
+    template <typename T>
+    T read() {
+        T val{};
+        if (!m_bGood || m_iPos + sizeof(T) > m_iLen) {
+            m_bGood = false;
+            return val;
+        }
+        memcpy(&val, m_pData + m_iPos, sizeof(T));
+        m_iPos += sizeof(T);
+        return val;
+    }
+
+    std::string readString() {
+        const auto LEN = read<uint32_t>();
+        if (!m_bGood || m_iPos + LEN > m_iLen) {
+            m_bGood = false;
+            return "";
+        }
+        std::string str{m_pData + m_iPos, LEN};
+        m_iPos += LEN;
+        return str;
+    }
+
+    bool good() const {
+        return m_bGood;
+    }
+
+    size_t pos() const {
+        return m_iPos;
+    }
+
+  private:
+    const char* m_pData = nullptr;
+    size_t      m_iLen  = 0;
+    size_t      m_iPos  = 0;
+    bool        m_bGood = true;
+};
@@ -7,11 +7,11 @@ CTimer::CTimer(float ms, std::function<void()> callback) {
 }
 
 bool CTimer::passed() const {
-    return std::chrono::high_resolution_clock::now() > (m_tStart + std::chrono::milliseconds((uint64_t)m_fDuration));
+    return std::chrono::high_resolution_clock::now() > (m_tStart + std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::duration<float, std::milli>(m_fDuration)));
 }
 
 float CTimer::passedMs() const {
-    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - m_tStart).count();
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - m_tStart).count() / 1000.F;
 }
 
 float CTimer::duration() const {
@@ -8,6 +8,7 @@ void printHelp() {
 | --------------------------------------
 | -v (--verbose) > enable trace logging
 | -q (--quiet) > disable logging
+| -r (--replace) > take over the sessions of a running instance
 | -h (--help) > print this menu
 )#";
 }
@@ -15,6 +16,8 @@ void printHelp() {
 int main(int argc, char** argv, char** envp) {
     g_pPortalManager = std::make_unique<CPortalManager>();
 
+    bool replace = false;
+
     for (int i = 1; i < argc; ++i) {
         std::string arg = argv[i];
 
@@ -24,6 +27,9 @@ int main(int argc, char** argv, char** envp) {
         else if (arg == "--quiet" || arg == "-q")
             Debug::quiet = true;
 
+        else if (arg == "--replace" || arg == "-r")
+            replace = true;
+
         else if (arg == "--help" || arg == "-h") {
             printHelp();
             return 0;
@@ -35,7 +41,7 @@ int main(int argc, char** argv, char** envp) {
 
     Debug::log(LOG, "Initializing xdph...");
 
-    g_pPortalManager->init();
+    g_pPortalManager->init(replace);
 
     return 0;
 }
\ No newline at end of file
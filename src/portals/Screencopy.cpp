@@ -2,320 +2,79 @@
 #include "../core/PortalManager.hpp"
 #include "../helpers/Log.hpp"
 #include "../helpers/MiscFunctions.hpp"
+#include "../shared/CaptureBackend.hpp"
+#include "../shared/CursorCapture.hpp"
 
 #include <libdrm/drm_fourcc.h>
 #include <pipewire/pipewire.h>
 #include <protocols/linux-dmabuf-unstable-v1-protocol.h>
 #include <unistd.h>
+#include <cmath>
+#include <algorithm>
 
-constexpr static int MAX_RETRIES = 10;
+constexpr static int      MAX_RETRIES             = 10;
+constexpr static size_t   HUGEPAGE_MIN_FRAME_SIZE = 8 * 1024 * 1024; // ~1080p BGRA
+constexpr static int      PACING_LOG_FRAMES       = 600;
+constexpr static double   VBLANK_OFFSET_MS        = 1.0; // how long after a vblank we ask, the compositor is done with the flip by then
+constexpr static double   VBLANK_MIN_DELAY_MS     = 0.5;
+constexpr static uint64_t TICK_MERGE_NS           = 500000; // captures closer than this on one output share a wakeup
+constexpr static uint64_t TICK_STATS_NS           = 10000000000ULL;
 
-// --------------- Wayland Protocol Handlers --------------- //
-
-static void wlrOnBuffer(void* data, zwlr_screencopy_frame_v1* frame, uint32_t format, uint32_t width, uint32_t height, uint32_t stride) {
-    const auto PSESSION = (CScreencopyPortal::SSession*)data;
-
-    Debug::log(TRACE, "[sc] wlrOnBuffer for {}", (void*)PSESSION);
-
-    PSESSION->sharingData.frameInfoSHM.w      = width;
-    PSESSION->sharingData.frameInfoSHM.h      = height;
-    PSESSION->sharingData.frameInfoSHM.fmt    = drmFourccFromSHM((wl_shm_format)format);
-    PSESSION->sharingData.frameInfoSHM.size   = stride * height;
-    PSESSION->sharingData.frameInfoSHM.stride = stride;
-
-    // todo: done if ver < 3
-}
-
-static void wlrOnFlags(void* data, zwlr_screencopy_frame_v1* frame, uint32_t flags) {
-    const auto PSESSION = (CScreencopyPortal::SSession*)data;
-
-    Debug::log(TRACE, "[sc] wlrOnFlags for {}", (void*)PSESSION);
-
-    // todo: maybe check for y invert?
-}
-
-static void wlrOnReady(void* data, zwlr_screencopy_frame_v1* frame, uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec) {
-    const auto PSESSION = (CScreencopyPortal::SSession*)data;
-
-    Debug::log(TRACE, "[sc] wlrOnReady for {}", (void*)PSESSION);
-
-    PSESSION->sharingData.status = FRAME_READY;
-
-    PSESSION->sharingData.tvSec         = ((((uint64_t)tv_sec_hi) << 32) + (uint64_t)tv_sec_lo);
-    PSESSION->sharingData.tvNsec        = tv_nsec;
-    PSESSION->sharingData.tvTimestampNs = PSESSION->sharingData.tvSec * SPA_NSEC_PER_SEC + PSESSION->sharingData.tvNsec;
-
-    Debug::log(TRACE, "[sc] frame timestamp sec: {} nsec: {} combined: {}ns", PSESSION->sharingData.tvSec, PSESSION->sharingData.tvNsec, PSESSION->sharingData.tvTimestampNs);
-
-    g_pPortalManager->m_sPortals.screencopy->m_pPipewire->enqueue(PSESSION);
-
-    if (g_pPortalManager->m_sPortals.screencopy->m_pPipewire->streamFromSession(PSESSION))
-        g_pPortalManager->m_sPortals.screencopy->queueNextShareFrame(PSESSION);
-
-    zwlr_screencopy_frame_v1_destroy(frame);
-    PSESSION->sharingData.frameCallback = nullptr;
-}
-
-static void wlrOnFailed(void* data, zwlr_screencopy_frame_v1* frame) {
-    const auto PSESSION = (CScreencopyPortal::SSession*)data;
-
-    Debug::log(TRACE, "[sc] wlrOnFailed for {}", (void*)PSESSION);
-
-    PSESSION->sharingData.status = FRAME_FAILED;
-}
-
-static void wlrOnDamage(void* data, zwlr_screencopy_frame_v1* frame, uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
-    const auto PSESSION = (CScreencopyPortal::SSession*)data;
-
-    Debug::log(TRACE, "[sc] wlrOnDamage for {}", (void*)PSESSION);
-
-    if (PSESSION->sharingData.damageCount > 3) {
-        PSESSION->sharingData.damage[0] = {0, 0, PSESSION->sharingData.frameInfoDMA.w, PSESSION->sharingData.frameInfoDMA.h};
-        return;
-    }
-
-    PSESSION->sharingData.damage[PSESSION->sharingData.damageCount++] = {x, y, width, height};
-
-    Debug::log(TRACE, "[sc] wlr damage: {} {} {} {}", x, y, width, height);
-}
-
-static void wlrOnDmabuf(void* data, zwlr_screencopy_frame_v1* frame, uint32_t format, uint32_t width, uint32_t height) {
-    const auto PSESSION = (CScreencopyPortal::SSession*)data;
-
-    Debug::log(TRACE, "[sc] wlrOnDmabuf for {}", (void*)PSESSION);
-
-    PSESSION->sharingData.frameInfoDMA.w   = width;
-    PSESSION->sharingData.frameInfoDMA.h   = height;
-    PSESSION->sharingData.frameInfoDMA.fmt = format;
-}
-
-static void wlrOnBufferDone(void* data, zwlr_screencopy_frame_v1* frame) {
-    const auto PSESSION = (CScreencopyPortal::SSession*)data;
-
-    Debug::log(TRACE, "[sc] wlrOnBufferDone for {}", (void*)PSESSION);
-
-    const auto PSTREAM = g_pPortalManager->m_sPortals.screencopy->m_pPipewire->streamFromSession(PSESSION);
-
-    if (!PSTREAM) {
-        Debug::log(TRACE, "[sc] wlrOnBufferDone: no stream");
-        zwlr_screencopy_frame_v1_destroy(frame);
-        PSESSION->sharingData.frameCallback = nullptr;
-        PSESSION->sharingData.status        = FRAME_NONE;
-        return;
-    }
-
-    Debug::log(TRACE, "[sc] pw format {} size {}x{}", (int)PSTREAM->pwVideoInfo.format, PSTREAM->pwVideoInfo.size.width, PSTREAM->pwVideoInfo.size.height);
-    Debug::log(TRACE, "[sc] wlr format {} size {}x{}", (int)PSESSION->sharingData.frameInfoSHM.fmt, PSESSION->sharingData.frameInfoSHM.w, PSESSION->sharingData.frameInfoSHM.h);
-    Debug::log(TRACE, "[sc] wlr format dma {} size {}x{}", (int)PSESSION->sharingData.frameInfoDMA.fmt, PSESSION->sharingData.frameInfoDMA.w, PSESSION->sharingData.frameInfoDMA.h);
-
-    const auto FMT = PSTREAM->isDMA ? PSESSION->sharingData.frameInfoDMA.fmt : PSESSION->sharingData.frameInfoSHM.fmt;
-    if ((PSTREAM->pwVideoInfo.format != pwFromDrmFourcc(FMT) && PSTREAM->pwVideoInfo.format != pwStripAlpha(pwFromDrmFourcc(FMT))) ||
-        (PSTREAM->pwVideoInfo.size.width != PSESSION->sharingData.frameInfoDMA.w || PSTREAM->pwVideoInfo.size.height != PSESSION->sharingData.frameInfoDMA.h)) {
-        Debug::log(LOG, "[sc] Incompatible formats, renegotiate stream");
-        PSESSION->sharingData.status = FRAME_RENEG;
-        zwlr_screencopy_frame_v1_destroy(frame);
-        g_pPortalManager->m_sPortals.screencopy->m_pPipewire->updateStreamParam(PSTREAM);
-        g_pPortalManager->m_sPortals.screencopy->queueNextShareFrame(PSESSION);
-        PSESSION->sharingData.status = FRAME_NONE;
-        return;
-    }
-
-    if (!PSTREAM->currentPWBuffer) {
-        Debug::log(TRACE, "[sc] wlrOnBufferDone: dequeue, no current buffer");
-        g_pPortalManager->m_sPortals.screencopy->m_pPipewire->dequeue(PSESSION);
-    }
+void CScreencopyPortal::onCreateSession(sdbus::MethodCall& call) {
+    sdbus::ObjectPath requestHandle, sessionHandle;
 
-    if (!PSTREAM->currentPWBuffer) {
-        zwlr_screencopy_frame_v1_destroy(frame);
-        PSESSION->sharingData.frameCallback = nullptr;
-        Debug::log(LOG, "[screencopy/pipewire] Out of buffers");
-        PSESSION->sharingData.status = FRAME_NONE;
-        if (PSESSION->sharingData.copyRetries++ < MAX_RETRIES) {
-            Debug::log(LOG, "[sc] Retrying screencopy ({}/{})", PSESSION->sharingData.copyRetries, MAX_RETRIES);
-            g_pPortalManager->m_sPortals.screencopy->m_pPipewire->updateStreamParam(PSTREAM);
-            g_pPortalManager->m_sPortals.screencopy->queueNextShareFrame(PSESSION);
-        }
+    if (!ensurePipewire()) {
+        auto reply = call.createReply();
+        reply << (uint32_t)1;
+        reply << std::unordered_map<std::string, sdbus::Variant>{};
+        reply.send();
         return;
     }
 
-    zwlr_screencopy_frame_v1_copy_with_damage(frame, PSTREAM->currentPWBuffer->wlBuffer);
-    PSESSION->sharingData.copyRetries = 0;
-
-    Debug::log(TRACE, "[sc] wlr frame copied");
-}
-
-static const zwlr_screencopy_frame_v1_listener wlrFrameListener = {
-    .buffer       = wlrOnBuffer,
-    .flags        = wlrOnFlags,
-    .ready        = wlrOnReady,
-    .failed       = wlrOnFailed,
-    .damage       = wlrOnDamage,
-    .linux_dmabuf = wlrOnDmabuf,
-    .buffer_done  = wlrOnBufferDone,
-};
-
-static void hlOnBuffer(void* data, hyprland_toplevel_export_frame_v1* frame, uint32_t format, uint32_t width, uint32_t height, uint32_t stride) {
-    const auto PSESSION = (CScreencopyPortal::SSession*)data;
-
-    Debug::log(TRACE, "[sc] hlOnBuffer for {}", (void*)PSESSION);
-
-    PSESSION->sharingData.frameInfoSHM.w      = width;
-    PSESSION->sharingData.frameInfoSHM.h      = height;
-    PSESSION->sharingData.frameInfoSHM.fmt    = drmFourccFromSHM((wl_shm_format)format);
-    PSESSION->sharingData.frameInfoSHM.size   = stride * height;
-    PSESSION->sharingData.frameInfoSHM.stride = stride;
-
-    // todo: done if ver < 3
-}
-
-static void hlOnFlags(void* data, hyprland_toplevel_export_frame_v1* frame, uint32_t flags) {
-    const auto PSESSION = (CScreencopyPortal::SSession*)data;
-
-    Debug::log(TRACE, "[sc] hlOnFlags for {}", (void*)PSESSION);
-
-    // todo: maybe check for y invert?
-}
-
-static void hlOnReady(void* data, hyprland_toplevel_export_frame_v1* frame, uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec) {
-    const auto PSESSION = (CScreencopyPortal::SSession*)data;
-
-    Debug::log(TRACE, "[sc] hlOnReady for {}", (void*)PSESSION);
-
-    PSESSION->sharingData.status = FRAME_READY;
-
-    PSESSION->sharingData.tvSec         = ((((uint64_t)tv_sec_hi) << 32) + (uint64_t)tv_sec_lo);
-    PSESSION->sharingData.tvNsec        = tv_nsec;
-    PSESSION->sharingData.tvTimestampNs = PSESSION->sharingData.tvSec * SPA_NSEC_PER_SEC + PSESSION->sharingData.tvNsec;
-
-    Debug::log(TRACE, "[sc] frame timestamp sec: {} nsec: {} combined: {}ns", PSESSION->sharingData.tvSec, PSESSION->sharingData.tvNsec, PSESSION->sharingData.tvTimestampNs);
-
-    g_pPortalManager->m_sPortals.screencopy->m_pPipewire->enqueue(PSESSION);
-
-    g_pPortalManager->m_sPortals.screencopy->queueNextShareFrame(PSESSION);
-
-    hyprland_toplevel_export_frame_v1_destroy(frame);
-    PSESSION->sharingData.windowFrameCallback = nullptr;
-}
-
-static void hlOnFailed(void* data, hyprland_toplevel_export_frame_v1* frame) {
-    const auto PSESSION = (CScreencopyPortal::SSession*)data;
-
-    Debug::log(TRACE, "[sc] hlOnFailed for {}", (void*)PSESSION);
-
-    PSESSION->sharingData.status = FRAME_FAILED;
-}
-
-static void hlOnDamage(void* data, hyprland_toplevel_export_frame_v1* frame, uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
-    const auto PSESSION = (CScreencopyPortal::SSession*)data;
-
-    Debug::log(TRACE, "[sc] hlOnDamage for {}", (void*)PSESSION);
-
-    if (PSESSION->sharingData.damageCount > 3) {
-        PSESSION->sharingData.damage[0] = {0, 0, PSESSION->sharingData.frameInfoDMA.w, PSESSION->sharingData.frameInfoDMA.h};
-        return;
-    }
+    call >> requestHandle;
+    call >> sessionHandle;
 
-    PSESSION->sharingData.damage[PSESSION->sharingData.damageCount++] = {x, y, width, height};
+    std::string appID;
+    call >> appID;
 
-    Debug::log(TRACE, "[sc] hl damage: {} {} {} {}", x, y, width, height);
-}
+    Debug::log(LOG, "[screencopy] New session:");
+    Debug::log(LOG, "[screencopy]  | {}", requestHandle.c_str());
+    Debug::log(LOG, "[screencopy]  | {}", sessionHandle.c_str());
+    Debug::log(LOG, "[screencopy]  | appid: {}", appID);
 
-static void hlOnDmabuf(void* data, hyprland_toplevel_export_frame_v1* frame, uint32_t format, uint32_t width, uint32_t height) {
-    const auto PSESSION = (CScreencopyPortal::SSession*)data;
+    const auto PSESSION = createSession(appID, requestHandle, sessionHandle);
 
-    Debug::log(TRACE, "[sc] hlOnDmabuf for {}", (void*)PSESSION);
+    PSESSION->request            = createDBusRequest(requestHandle);
+    PSESSION->request->onDestroy = [PSESSION]() { PSESSION->request.release(); };
 
-    PSESSION->sharingData.frameInfoDMA.w   = width;
-    PSESSION->sharingData.frameInfoDMA.h   = height;
-    PSESSION->sharingData.frameInfoDMA.fmt = format;
+    auto reply = call.createReply();
+    reply << (uint32_t)0;
+    reply << std::unordered_map<std::string, sdbus::Variant>{};
+    reply.send();
 }
 
-static void hlOnBufferDone(void* data, hyprland_toplevel_export_frame_v1* frame) {
-    const auto PSESSION = (CScreencopyPortal::SSession*)data;
-
-    Debug::log(TRACE, "[sc] hlOnBufferDone for {}", (void*)PSESSION);
-
-    const auto PSTREAM = g_pPortalManager->m_sPortals.screencopy->m_pPipewire->streamFromSession(PSESSION);
-
-    if (!PSTREAM) {
-        Debug::log(TRACE, "[sc] hlOnBufferDone: no stream");
-        hyprland_toplevel_export_frame_v1_destroy(frame);
-        PSESSION->sharingData.windowFrameCallback = nullptr;
-        PSESSION->sharingData.status              = FRAME_NONE;
-        return;
-    }
-
-    Debug::log(TRACE, "[sc] pw format {} size {}x{}", (int)PSTREAM->pwVideoInfo.format, PSTREAM->pwVideoInfo.size.width, PSTREAM->pwVideoInfo.size.height);
-    Debug::log(TRACE, "[sc] hl format {} size {}x{}", (int)PSESSION->sharingData.frameInfoSHM.fmt, PSESSION->sharingData.frameInfoSHM.w, PSESSION->sharingData.frameInfoSHM.h);
+bool CScreencopyPortal::ensurePipewire() {
+    if (m_pPipewire)
+        return true;
 
-    const auto FMT = PSTREAM->isDMA ? PSESSION->sharingData.frameInfoDMA.fmt : PSESSION->sharingData.frameInfoSHM.fmt;
-    if ((PSTREAM->pwVideoInfo.format != pwFromDrmFourcc(FMT) && PSTREAM->pwVideoInfo.format != pwStripAlpha(pwFromDrmFourcc(FMT))) ||
-        (PSTREAM->pwVideoInfo.size.width != PSESSION->sharingData.frameInfoDMA.w || PSTREAM->pwVideoInfo.size.height != PSESSION->sharingData.frameInfoDMA.h)) {
-        Debug::log(LOG, "[sc] Incompatible formats, renegotiate stream");
-        PSESSION->sharingData.status = FRAME_RENEG;
-        hyprland_toplevel_export_frame_v1_destroy(frame);
-        PSESSION->sharingData.windowFrameCallback = nullptr;
-        g_pPortalManager->m_sPortals.screencopy->m_pPipewire->updateStreamParam(PSTREAM);
-        g_pPortalManager->m_sPortals.screencopy->queueNextShareFrame(PSESSION);
-        PSESSION->sharingData.status = FRAME_NONE;
-        return;
-    }
+    // first screencast, bring up pipewire and gbm now
+    if (!g_pPortalManager->initPipewire())
+        return false;
 
-    if (!PSTREAM->currentPWBuffer) {
-        Debug::log(TRACE, "[sc] wlrOnBufferDone: dequeue, no current buffer");
-        g_pPortalManager->m_sPortals.screencopy->m_pPipewire->dequeue(PSESSION);
-    }
+    m_pPipewire = std::make_unique<CPipewireConnection>();
 
-    if (!PSTREAM->currentPWBuffer) {
-        hyprland_toplevel_export_frame_v1_destroy(frame);
-        PSESSION->sharingData.windowFrameCallback = nullptr;
-        Debug::log(LOG, "[screencopy/pipewire] Out of buffers");
-        PSESSION->sharingData.status = FRAME_NONE;
-        if (PSESSION->sharingData.copyRetries++ < MAX_RETRIES) {
-            Debug::log(LOG, "[sc] Retrying screencopy ({}/{})", PSESSION->sharingData.copyRetries, MAX_RETRIES);
-            g_pPortalManager->m_sPortals.screencopy->m_pPipewire->updateStreamParam(PSTREAM);
-            g_pPortalManager->m_sPortals.screencopy->queueNextShareFrame(PSESSION);
-        }
-        return;
-    }
+    if (!g_pPortalManager->getGBMDevice())
+        Debug::log(WARN, "[screencopy] no gbm device, dmabuf sharing will not be available");
 
-    hyprland_toplevel_export_frame_v1_copy(frame, PSTREAM->currentPWBuffer->wlBuffer, false);
-    PSESSION->sharingData.copyRetries = 0;
-	
-    Debug::log(TRACE, "[sc] wlr frame copied");
+    return true;
 }
 
-static const hyprland_toplevel_export_frame_v1_listener hyprlandFrameListener = {
-    .buffer       = hlOnBuffer,
-    .damage       = hlOnDamage,
-    .flags        = hlOnFlags,
-    .ready        = hlOnReady,
-    .failed       = hlOnFailed,
-    .linux_dmabuf = hlOnDmabuf,
-    .buffer_done  = hlOnBufferDone,
-};
-
-// --------------------------------------------------------- //
-
-void CScreencopyPortal::onCreateSession(sdbus::MethodCall& call) {
-    sdbus::ObjectPath requestHandle, sessionHandle;
-
+CScreencopyPortal::SSession* CScreencopyPortal::createSession(const std::string& appid, const sdbus::ObjectPath& requestHandle, const sdbus::ObjectPath& sessionHandle) {
     g_pPortalManager->m_sHelpers.toplevel->activate();
 
-    call >> requestHandle;
-    call >> sessionHandle;
-
-    std::string appID;
-    call >> appID;
-
-    Debug::log(LOG, "[screencopy] New session:");
-    Debug::log(LOG, "[screencopy]  | {}", requestHandle.c_str());
-    Debug::log(LOG, "[screencopy]  | {}", sessionHandle.c_str());
-    Debug::log(LOG, "[screencopy]  | appid: {}", appID);
-
-    const auto PSESSION = m_vSessions.emplace_back(std::make_unique<SSession>(appID, requestHandle, sessionHandle)).get();
+    const auto PSESSION = m_vSessions.emplace_back(std::make_unique<SSession>(appid, requestHandle, sessionHandle)).get();
+    PSESSION->policy    = resolveCapturePolicy(appid);
 
-    // create objects
     PSESSION->session            = createDBusSession(sessionHandle);
     PSESSION->session->onDestroy = [PSESSION, this]() {
         if (PSESSION->sharingData.active) {
@@ -328,13 +87,8 @@ void CScreencopyPortal::onCreateSession(sdbus::MethodCall& call) {
         // deactivate toplevel so it doesn't listen and waste battery
         g_pPortalManager->m_sHelpers.toplevel->deactivate();
     };
-    PSESSION->request            = createDBusRequest(requestHandle);
-    PSESSION->request->onDestroy = [PSESSION]() { PSESSION->request.release(); };
 
-    auto reply = call.createReply();
-    reply << (uint32_t)0;
-    reply << std::unordered_map<std::string, sdbus::Variant>{};
-    reply.send();
+    return PSESSION;
 }
 
 void CScreencopyPortal::onSelectSources(sdbus::MethodCall& call) {
@@ -446,8 +200,8 @@ void CScreencopyPortal::onSelectSources(sdbus::MethodCall& call) {
                 Debug::log(LOG, "[screencopy] Restore token v3 {} with data: {} {} {} {} {}", restoreData.token, windowHandle, windowClass, restoreData.output,
                            restoreData.withCursor, restoreData.timeIssued);
 
-                // find window
-                if (windowHandle != 0 || !windowClass.empty()) {
+                // find window. Not needed for tokens in the store, they carry the identity themselves
+                if ((windowHandle != 0 || !windowClass.empty()) && !restoreTokens()->lookup(restoreData.token)) {
                     if (windowHandle != 0) {
                         for (auto& h : g_pPortalManager->m_sHelpers.toplevel->m_vToplevels) {
                             if ((uint64_t)h->handle == windowHandle) {
@@ -459,13 +213,10 @@ void CScreencopyPortal::onSelectSources(sdbus::MethodCall& call) {
                     }
 
                     if (restoreData.windowHandle == 0 && !windowClass.empty()) {
-                        // try class
-                        for (auto& h : g_pPortalManager->m_sHelpers.toplevel->m_vToplevels) {
-                            if (h->windowClass == windowClass) {
-                                restoreData.windowHandle = (uint64_t)h->handle;
-                                Debug::log(LOG, "[screencopy] token v3 window found by class {}", windowClass);
-                                break;
-                            }
+                        // try class, the most recently focused one wins
+                        if (const auto PTOPLEVEL = g_pPortalManager->m_sHelpers.toplevel->findByIdentity(windowClass, ""); PTOPLEVEL) {
+                            restoreData.windowHandle = (uint64_t)PTOPLEVEL->handle;
+                            Debug::log(LOG, "[screencopy] token v3 window found by class {}", windowClass);
                         }
                     }
                 }
@@ -479,13 +230,39 @@ void CScreencopyPortal::onSelectSources(sdbus::MethodCall& call) {
         }
     }
 
+    // tokens from the store are authoritative, the rest of the restore data only covers ones issued before it existed
+    const auto* PGRANT = restoreData.exists && !restoreData.token.empty() ? restoreTokens()->lookup(restoreData.token) : nullptr;
+
+    SSelectionData SHAREDATA;
+    if (PGRANT) {
+        SHAREDATA.type       = (eSelectionType)PGRANT->type;
+        SHAREDATA.x          = PGRANT->x;
+        SHAREDATA.y          = PGRANT->y;
+        SHAREDATA.w          = PGRANT->w;
+        SHAREDATA.h          = PGRANT->h;
+        SHAREDATA.allowToken = true;
+
+        // for windows, the output is only where it was last seen
+        if (SHAREDATA.type == TYPE_WINDOW) {
+            if (const auto PTOPLEVEL = g_pPortalManager->m_sHelpers.toplevel->findByIdentity(PGRANT->windowClass, PGRANT->windowTitle, PGRANT->output); PTOPLEVEL)
+                SHAREDATA.windowHandle = PTOPLEVEL->handle;
+        } else
+            SHAREDATA.output = PGRANT->output;
+    }
+
+    const bool GRANTVALID       = PGRANT && (SHAREDATA.type == TYPE_WINDOW ? SHAREDATA.windowHandle != nullptr : g_pPortalManager->getOutputFromName(SHAREDATA.output) != nullptr);
     const bool RESTOREDATAVALID = restoreData.exists &&
         (g_pPortalManager->m_sHelpers.toplevel->exists((zwlr_foreign_toplevel_handle_v1*)restoreData.windowHandle) || g_pPortalManager->getOutputFromName(restoreData.output));
 
-    SSelectionData SHAREDATA;
-    if (RESTOREDATAVALID) {
+    if (GRANTVALID) {
+        Debug::log(LOG, "[screencopy] restore token {} valid, not prompting", restoreData.token);
+
+        PSESSION->cursorMode   = PGRANT->cursorMode;
+        PSESSION->restoreToken = restoreData.token;
+    } else if (RESTOREDATAVALID) {
         Debug::log(LOG, "[screencopy] restore data valid, not prompting");
 
+        SHAREDATA              = {};
         SHAREDATA.output       = restoreData.output;
         SHAREDATA.windowHandle = (zwlr_foreign_toplevel_handle_v1*)restoreData.windowHandle;
         SHAREDATA.type         = restoreData.windowHandle ? TYPE_WINDOW : TYPE_OUTPUT;
@@ -506,14 +283,13 @@ void CScreencopyPortal::onSelectSources(sdbus::MethodCall& call) {
         const auto POUTPUT = g_pPortalManager->getOutputFromName(SHAREDATA.output);
 
         if (POUTPUT) {
-            static auto* const* PFPS = (Hyprlang::INT* const*)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:max_fps")->getDataStaticPtr();
-
-            if (**PFPS <= 0)
+            if (PSESSION->policy.maxFPS == 0)
                 PSESSION->sharingData.framerate = POUTPUT->refreshRate;
             else
-                PSESSION->sharingData.framerate = std::clamp(POUTPUT->refreshRate, 1.F, (float)**PFPS);
+                PSESSION->sharingData.framerate = std::clamp(POUTPUT->refreshRate, 1.F, (float)PSESSION->policy.maxFPS);
         }
-    }
+    } else if (SHAREDATA.type == TYPE_WINDOW && PSESSION->policy.maxFPS != 0)
+        PSESSION->sharingData.framerate = std::min(PSESSION->sharingData.framerate, PSESSION->policy.maxFPS);
 
     PSESSION->selection = SHAREDATA;
 
@@ -560,6 +336,16 @@ void CScreencopyPortal::onStart(sdbus::MethodCall& call) {
         // give them a token :)
         std::unordered_map<std::string, sdbus::Variant> mapData;
 
+        SRestoreGrant                                   grant;
+        grant.type       = PSESSION->selection.type;
+        grant.output     = PSESSION->selection.output;
+        grant.x          = PSESSION->selection.x;
+        grant.y          = PSESSION->selection.y;
+        grant.w          = PSESSION->selection.w;
+        grant.h          = PSESSION->selection.h;
+        grant.cursorMode = PSESSION->cursorMode;
+        grant.persistent = PSESSION->persistMode == 2;
+
         switch (PSESSION->selection.type) {
             case TYPE_GEOMETRY:
             case TYPE_OUTPUT: mapData["output"] = PSESSION->selection.output; break;
@@ -567,15 +353,30 @@ void CScreencopyPortal::onStart(sdbus::MethodCall& call) {
                 mapData["windowHandle"] = (uint64_t)PSESSION->selection.windowHandle;
                 for (auto& w : g_pPortalManager->m_sHelpers.toplevel->m_vToplevels) {
                     if (w->handle == PSESSION->selection.windowHandle) {
-                        mapData["windowClass"] = w->windowClass;
+                        mapData["windowClass"] = w->windowClass();
+                        grant.windowClass      = w->windowClass();
+                        grant.windowTitle      = w->windowTitle();
+                        if (const auto POUTPUT = w->outputs.empty() ? nullptr : g_pPortalManager->getOutputFromWl(w->outputs.front()); POUTPUT)
+                            grant.output = POUTPUT->name;
                         break;
                     }
                 }
                 break;
             default: Debug::log(ERR, "[screencopy] wonk selection in token saving"); break;
         }
-        mapData["timeIssued"] = uint64_t(time(nullptr));
-        mapData["token"]      = std::string("todo");
+
+        // keep the token stable across restores, only the last seen identity moves
+        std::string token;
+        if (const auto PGRANT = PSESSION->restoreToken.empty() ? nullptr : restoreTokens()->lookup(PSESSION->restoreToken); PGRANT) {
+            token          = PSESSION->restoreToken;
+            grant.issued   = PGRANT->issued;
+            grant.lastUsed = time(nullptr);
+            restoreTokens()->update(token, grant);
+        } else
+            token = restoreTokens()->issue(grant);
+
+        mapData["timeIssued"] = uint64_t(grant.issued ? grant.issued : time(nullptr));
+        mapData["token"]      = token;
         mapData["withCursor"] = PSESSION->cursorMode;
 
         sdbus::Variant                                       restoreData{mapData};
@@ -615,8 +416,9 @@ void CScreencopyPortal::startSharing(CScreencopyPortal::SSession* pSession) {
 
     startFrameCopy(pSession);
 
-    wl_display_dispatch(g_pPortalManager->m_sWaylandConnection.display);
-    wl_display_roundtrip(g_pPortalManager->m_sWaylandConnection.display);
+    // the constraints come in on the capture queue
+    wl_display_roundtrip_queue(g_pPortalManager->m_sWaylandConnection.display, g_pPortalManager->m_sWaylandConnection.queues.capture);
+    wl_display_roundtrip_queue(g_pPortalManager->m_sWaylandConnection.display, g_pPortalManager->m_sWaylandConnection.queues.capture);
 
     if (pSession->sharingData.frameInfoDMA.fmt == DRM_FORMAT_INVALID) {
         Debug::log(ERR, "[screencopy] Couldn't obtain a format from dma"); // todo: blocks shm
@@ -641,52 +443,150 @@ void CScreencopyPortal::startSharing(CScreencopyPortal::SSession* pSession) {
 }
 
 void CScreencopyPortal::startFrameCopy(CScreencopyPortal::SSession* pSession) {
-    const auto POUTPUT = g_pPortalManager->getOutputFromName(pSession->selection.output);
+    pSession->sharingData.frameQueued = false;
 
     if (!pSession->sharingData.active) {
         Debug::log(TRACE, "[sc] startFrameCopy: not copying, inactive session");
         return;
     }
 
-    if (!POUTPUT && (pSession->selection.type == TYPE_GEOMETRY || pSession->selection.type == TYPE_OUTPUT)) {
-        Debug::log(ERR, "[screencopy] Output {} not found??", pSession->selection.output);
-        return;
+    auto& backend = pSession->sharingData.backend;
+
+    if (!backend) {
+        backend = createBackend(pSession);
+        if (!backend)
+            return;
+
+        Debug::log(LOG, "[screencopy] session {} captures through {}", (void*)pSession, backend->name());
     }
 
-    if ((pSession->sharingData.frameCallback && (pSession->selection.type == TYPE_GEOMETRY || pSession->selection.type == TYPE_OUTPUT)) ||
-        (pSession->sharingData.windowFrameCallback && pSession->selection.type == TYPE_WINDOW)) {
+    if (backend->busy()) {
+        const auto PSTREAM = m_pPipewire->streamFromSession(pSession);
+
+        const auto PCURSOR = backend->softwareCursor();
+
+        // the compositor is holding the copy until something changes. Consumers that want every frame get the last one again,
+        // and a cursor we paint ourselves moves on it without waiting for the screen.
+        if (PSTREAM && (PSTREAM->constantRate || (PCURSOR && PCURSOR->dirty()))) {
+            if (m_pPipewire->resendLatest(pSession))
+                pSession->sharingData.pacing.resent++;
+            if (PSTREAM->constantRate)
+                queueNextShareFrame(pSession);
+            return;
+        }
+
         Debug::log(ERR, "[screencopy] tried scheduling on already scheduled cb (type {})", (int)pSession->selection.type);
         return;
     }
 
-    if (pSession->selection.type == TYPE_GEOMETRY) {
-        pSession->sharingData.frameCallback = zwlr_screencopy_manager_v1_capture_output_region(m_sState.screencopy, pSession->cursorMode, POUTPUT->output, pSession->selection.x,
-                                                                                               pSession->selection.y, pSession->selection.w, pSession->selection.h);
-        pSession->sharingData.transform     = POUTPUT->transform;
-    } else if (pSession->selection.type == TYPE_OUTPUT) {
-        pSession->sharingData.frameCallback = zwlr_screencopy_manager_v1_capture_output(m_sState.screencopy, pSession->cursorMode, POUTPUT->output);
-        pSession->sharingData.transform     = POUTPUT->transform;
-    } else if (pSession->selection.type == TYPE_WINDOW) {
-        if (!pSession->selection.windowHandle) {
-            Debug::log(ERR, "[screencopy] selected invalid window?");
+    pSession->sharingData.status = FRAME_QUEUED;
+
+    if (!backend->requestFrame()) {
+        pSession->sharingData.status = FRAME_NONE;
+        return;
+    }
+
+    Debug::log(TRACE, "[screencopy] frame requested");
+}
+
+std::unique_ptr<ICaptureBackend> CScreencopyPortal::createBackend(CScreencopyPortal::SSession* pSession) {
+    switch (pSession->selection.type) {
+        case TYPE_OUTPUT:
+            if (m_sState.imageCopy && m_sState.outputSource)
+                return std::make_unique<CImageCopyCaptureBackend>(pSession, m_sState.imageCopy, m_sState.outputSource);
+            // an output source has no sub-rectangle, regions always go through wlr-screencopy
+            [[fallthrough]];
+        case TYPE_GEOMETRY: return std::make_unique<CWlrScreencopyBackend>(pSession, m_sState.screencopy);
+        case TYPE_WINDOW:
+            if (!m_sState.toplevel) {
+                Debug::log(ERR, "[screencopy] window selected without toplevel export");
+                return nullptr;
+            }
+            return std::make_unique<CToplevelExportBackend>(pSession, m_sState.toplevel);
+        default: Debug::log(ERR, "[screencopy] Unsupported selection {}", (int)pSession->selection.type); return nullptr;
+    }
+}
+
+void CScreencopyPortal::onFrameConstraints(CScreencopyPortal::SSession* pSession, bool changed) {
+    const auto& BACKEND = pSession->sharingData.backend;
+    const auto  PSTREAM = m_pPipewire ? m_pPipewire->streamFromSession(pSession) : nullptr;
+
+    if (!PSTREAM) {
+        Debug::log(TRACE, "[sc] onFrameConstraints: no stream");
+        BACKEND->cancel();
+        pSession->sharingData.status = FRAME_NONE;
+        return;
+    }
+
+    if (changed)
+        pSession->sharingData.formatChecked = false;
+
+    if (!pSession->sharingData.formatChecked) {
+        Debug::log(TRACE, "[sc] pw format {} size {}x{}", (int)PSTREAM->pwVideoInfo.format, PSTREAM->pwVideoInfo.size.width, PSTREAM->pwVideoInfo.size.height);
+        Debug::log(TRACE, "[sc] shm format {} size {}x{}", (int)pSession->sharingData.frameInfoSHM.fmt, pSession->sharingData.frameInfoSHM.w, pSession->sharingData.frameInfoSHM.h);
+        Debug::log(TRACE, "[sc] dma format {} size {}x{}", (int)pSession->sharingData.frameInfoDMA.fmt, pSession->sharingData.frameInfoDMA.w, pSession->sharingData.frameInfoDMA.h);
+
+        const auto FMT = PSTREAM->isDMA ? pSession->sharingData.frameInfoDMA.fmt : pSession->sharingData.frameInfoSHM.fmt;
+        if ((PSTREAM->pwVideoInfo.format != pwFromDrmFourcc(FMT) && PSTREAM->pwVideoInfo.format != pwStripAlpha(pwFromDrmFourcc(FMT))) ||
+            (PSTREAM->pwVideoInfo.size.width != pSession->sharingData.frameInfoDMA.w || PSTREAM->pwVideoInfo.size.height != pSession->sharingData.frameInfoDMA.h)) {
+            Debug::log(LOG, "[sc] Incompatible formats, renegotiate stream");
+            pSession->sharingData.status = FRAME_RENEG;
+            BACKEND->cancel();
+            m_pPipewire->updateStreamParam(PSTREAM);
+            queueNextShareFrame(pSession);
+            pSession->sharingData.status = FRAME_NONE;
             return;
         }
-        pSession->sharingData.windowFrameCallback =
-            hyprland_toplevel_export_manager_v1_capture_toplevel_with_wlr_toplevel_handle(m_sState.toplevel, pSession->cursorMode, pSession->selection.windowHandle);
-        pSession->sharingData.transform = WL_OUTPUT_TRANSFORM_NORMAL;
-    } else {
-        Debug::log(ERR, "[screencopy] Unsupported selection {}", (int)pSession->selection.type);
+
+        pSession->sharingData.formatChecked = true;
+        rebalanceBandwidth();
+    }
+
+    if (!PSTREAM->currentPWBuffer) {
+        Debug::log(TRACE, "[sc] onFrameConstraints: dequeue, no current buffer");
+        m_pPipewire->dequeue(pSession);
+    }
+
+    if (!PSTREAM->currentPWBuffer) {
+        BACKEND->cancel();
+        Debug::log(LOG, "[screencopy/pipewire] Out of buffers");
+        pSession->sharingData.status = FRAME_NONE;
+        if (pSession->sharingData.copyRetries++ < MAX_RETRIES) {
+            Debug::log(LOG, "[sc] Retrying screencopy ({}/{})", pSession->sharingData.copyRetries, MAX_RETRIES);
+            m_pPipewire->updateStreamParam(PSTREAM);
+            queueNextShareFrame(pSession);
+        }
         return;
     }
 
-    pSession->sharingData.status = FRAME_QUEUED;
+    pSession->sharingData.damageCount = 0;
+    pSession->sharingData.copyBegun   = std::chrono::steady_clock::now();
+    BACKEND->copy(PSTREAM->currentPWBuffer, pSession->policy.damage == CAPTURE_DAMAGE_FULL);
+    pSession->sharingData.copyRetries = 0;
 
-    if (pSession->sharingData.frameCallback)
-        zwlr_screencopy_frame_v1_add_listener(pSession->sharingData.frameCallback, &wlrFrameListener, pSession);
-    else if (pSession->sharingData.windowFrameCallback)
-        hyprland_toplevel_export_frame_v1_add_listener(pSession->sharingData.windowFrameCallback, &hyprlandFrameListener, pSession);
+    Debug::log(TRACE, "[sc] frame copied");
+}
+
+void CScreencopyPortal::onFrameReady(CScreencopyPortal::SSession* pSession) {
+    pSession->sharingData.status = FRAME_READY;
+
+    updatePacing(pSession);
+
+    m_pPipewire->enqueue(pSession);
+
+    if (m_pPipewire->streamFromSession(pSession))
+        queueNextShareFrame(pSession);
+}
 
-    Debug::log(TRACE, "[screencopy] frame callbacks initialized");
+void CScreencopyPortal::onFrameFailed(CScreencopyPortal::SSession* pSession, bool retry) {
+    pSession->sharingData.status = FRAME_FAILED;
+
+    if (retry && m_pPipewire->streamFromSession(pSession))
+        queueNextShareFrame(pSession);
+}
+
+CScreencopyPortal::SSession::~SSession() {
+    ; // here and not in the header, ICaptureBackend is incomplete there
 }
 
 void CScreencopyPortal::queueNextShareFrame(CScreencopyPortal::SSession* pSession) {
@@ -695,17 +595,289 @@ void CScreencopyPortal::queueNextShareFrame(CScreencopyPortal::SSession* pSessio
     if (PSTREAM && !PSTREAM->streamState)
         return;
 
+    // one chain of frames per session, a frame that comes in while the next tick is already set waits for it
+    if (pSession->sharingData.frameQueued)
+        return;
+
+    pSession->sharingData.frameQueued = true;
+
     // calculate frame delta and queue next frame
     const auto FRAMETOOKMS           = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now() - pSession->sharingData.begunFrame).count() / 1000.0;
-    const auto MSTILNEXTREFRESH      = 1000.0 / (pSession->sharingData.framerate) - FRAMETOOKMS;
+    const auto FRAMERATE             = pSession->sharingData.qosFramerate ? std::min(pSession->sharingData.framerate, pSession->sharingData.qosFramerate) : pSession->sharingData.framerate;
+    const auto FRAMEINTERVALMS       = std::max(1000.0 / FRAMERATE, pSession->sharingData.backend ? pSession->sharingData.backend->minFrameIntervalMs() : 0.0);
+    const auto MSTILNEXTREFRESH      = FRAMEINTERVALMS - FRAMETOOKMS;
     pSession->sharingData.begunFrame = std::chrono::system_clock::now();
 
-    Debug::log(TRACE, "[screencopy] set fps {}, frame took {:.2f}ms, ms till next refresh {:.2f}, estimated actual fps: {:.2f}", pSession->sharingData.framerate, FRAMETOOKMS,
-               MSTILNEXTREFRESH, std::clamp(1000.0 / FRAMETOOKMS, 1.0, (double)pSession->sharingData.framerate));
+    Debug::log(TRACE, "[screencopy] set fps {}, frame took {:.2f}ms, ms till next refresh {:.2f}, estimated actual fps: {:.2f}", FRAMERATE, FRAMETOOKMS, MSTILNEXTREFRESH,
+               std::clamp(1000.0 / FRAMETOOKMS, 1.0, (double)FRAMERATE));
+
+    static auto* const* PVBLANKALIGN = (Hyprlang::INT* const*)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:vblank_align")->getDataStaticPtr();
+
+    const double DELAYMS = std::clamp(MSTILNEXTREFRESH - 1.0 /* safezone */, 6.0, 1000.0);
+    const auto   POUTPUT = pacingOutput(pSession);
+
+    if (!POUTPUT) {
+        g_pPortalManager->addTimer({(float)DELAYMS, [pSession]() { g_pPortalManager->m_sPortals.screencopy->startFrameCopy(pSession); }});
+        return;
+    }
+
+    const auto& CLOCK   = POUTPUT->presentClock;
+    const bool  ALIGNED = **PVBLANKALIGN && CLOCK.locked();
+    const auto  NOW     = CPresentClock::now();
+    const auto  WANTED  = NOW + (uint64_t)((ALIGNED ? std::max(MSTILNEXTREFRESH, 0.0) : DELAYMS) * 1000000.0);
+    uint64_t    target  = WANTED;
+
+    if (CLOCK.periodNs() > 0) {
+        // snap to the output's tick grid, so sessions on it with compatible rates (60 and 30 on 60Hz) share ticks.
+        // Locked, that's just after the real vblanks: every capture sees a frame that was just presented, at the same phase,
+        // instead of drifting across the refresh cycle. Otherwise a grid of the refresh period at whatever phase.
+        const auto OFFSET   = ALIGNED ? (uint64_t)(VBLANK_OFFSET_MS * 1000000.0) : 0;
+        const auto MINDELAY = (uint64_t)(VBLANK_MIN_DELAY_MS * 1000000.0);
+
+        target = CLOCK.nextVblank(WANTED - std::min(WANTED, (uint64_t)(CLOCK.periodNs() / 2.0))) + OFFSET;
+        if (target < NOW + MINDELAY)
+            target = CLOCK.nextVblank(NOW + MINDELAY - OFFSET) + OFFSET;
+
+        if (ALIGNED)
+            pSession->sharingData.pacing.onGrid++;
+
+        Debug::log(TRACE, "[screencopy] {}: next capture in {:.2f}ms, {:.2f}ms after the interval wanted it", ALIGNED ? "vblank aligned" : "on the refresh grid",
+                   (target - NOW) / 1000000.0, ((double)target - WANTED) / 1000000.0);
+    }
+
+    scheduleOnTick(pSession, POUTPUT, std::min(target, NOW + 1000000000ULL));
+}
+
+void CScreencopyPortal::scheduleOnTick(CScreencopyPortal::SSession* pSession, SOutput* pOutput, uint64_t atNs) {
+    for (auto& t : m_vTicks) {
+        if (t->outputID != pOutput->id || (t->atNs > atNs ? t->atNs - atNs : atNs - t->atNs) > TICK_MERGE_NS)
+            continue;
+
+        if (std::find(t->sessions.begin(), t->sessions.end(), pSession) == t->sessions.end())
+            t->sessions.emplace_back(pSession);
+        return;
+    }
+
+    const auto PTICK = m_vTicks.emplace_back(std::make_unique<STick>(STick{pOutput->id, atNs, {pSession}})).get();
+    const auto NOW   = CPresentClock::now();
+
+    g_pPortalManager->addTimer({atNs > NOW ? (float)((atNs - NOW) / 1000000.0) : 0.F, [this, PTICK]() { runTick(PTICK); }});
+}
+
+void CScreencopyPortal::runTick(STick* pTick) {
+    // out of the list first, a session queueing its next frame from in here gets a new tick
+    const auto SESSIONS = std::move(pTick->sessions);
+    std::erase_if(m_vTicks, [pTick](const auto& t) { return t.get() == pTick; });
+
+    for (auto& s : SESSIONS) {
+        startFrameCopy(s);
+    }
+
+    // one wakeup and one flush (the main loop's, after all timers) for all of them
+    const auto NOW = CPresentClock::now();
+    m_sTickStats.wakeups++;
+    m_sTickStats.captures += SESSIONS.size();
+
+    if (!m_sTickStats.sinceNs)
+        m_sTickStats.sinceNs = NOW;
+    else if (NOW - m_sTickStats.sinceNs >= TICK_STATS_NS) {
+        const double SECONDS = (NOW - m_sTickStats.sinceNs) / 1000000000.0;
+        Debug::log(TRACE, "[screencopy] capture ticks: {:.1f} wakeups/s, {:.2f} captures per wakeup", m_sTickStats.wakeups / SECONDS,
+                   (double)m_sTickStats.captures / m_sTickStats.wakeups);
+        m_sTickStats = {.sinceNs = NOW};
+    }
+}
+
+SOutput* CScreencopyPortal::pacingOutput(CScreencopyPortal::SSession* pSession) {
+    if (pSession->selection.type != TYPE_OUTPUT && pSession->selection.type != TYPE_GEOMETRY)
+        return nullptr;
+
+    return g_pPortalManager->getOutputFromName(pSession->selection.output);
+}
+
+void CScreencopyPortal::updatePacing(CScreencopyPortal::SSession* pSession) {
+    const auto NOW       = CPresentClock::now();
+    const auto PRESENTED = pSession->sharingData.tvTimestampNs;
+    const auto POUTPUT   = pacingOutput(pSession);
+    auto&      pacing    = pSession->sharingData.pacing;
+
+    if (POUTPUT && PRESENTED)
+        POUTPUT->presentClock.onPresented(PRESENTED);
+
+    if (pacing.lastReadyNs) {
+        const double INTERVAL = (NOW - pacing.lastReadyNs) / 1000000.0;
+        pacing.frames++;
+        pacing.intervalSum += INTERVAL;
+        pacing.intervalSqSum += INTERVAL * INTERVAL;
+        pacing.latencySum += PRESENTED && PRESENTED <= NOW ? (NOW - PRESENTED) / 1000000.0 : 0.0;
+    }
+
+    pacing.lastReadyNs = NOW;
+
+    if (pacing.frames < PACING_LOG_FRAMES)
+        return;
+
+    // compare runs with screencopy:vblank_align on and off
+    const double MEAN = pacing.intervalSum / pacing.frames;
+    Debug::log(LOG, "[screencopy] session {} pacing over {} frames: interval {:.2f}ms (stddev {:.2f}ms), presented to ready {:.2f}ms, {} on the vblank grid, {} resent",
+               (void*)pSession, pacing.frames, MEAN, std::sqrt(std::max(pacing.intervalSqSum / pacing.frames - MEAN * MEAN, 0.0)), pacing.latencySum / pacing.frames, pacing.onGrid,
+               pacing.resent);
+
+    pacing = {.lastReadyNs = NOW};
+}
+void CScreencopyPortal::rebalanceBandwidth() {
+    static auto* const* PMAXBANDWIDTH = (Hyprlang::INT* const*)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:max_bandwidth")->getDataStaticPtr();
+
+    struct SDemand {
+        SSession* session    = nullptr;
+        double    frameBytes = 0, wanted = 0, weight = 1; // wanted in bytes/s
+    };
+
+    std::vector<SDemand> demands;
+    double               totalWanted = 0;
+
+    for (auto& s : m_vSessions) {
+        const auto PSTREAM = m_pPipewire ? m_pPipewire->streamFromSession(s.get()) : nullptr;
+        if (!s->sharingData.active || !PSTREAM)
+            continue;
+
+        // what a copy moves through memory: the frame written once, by the compositor or the gpu
+        const auto& DATA       = s->sharingData;
+        const auto  FRAMEBYTES = PSTREAM->isDMA ? (double)DATA.frameInfoDMA.w * DATA.frameInfoDMA.h * 4 : (double)DATA.frameInfoSHM.size;
+        if (FRAMEBYTES <= 0 || DATA.framerate == 0)
+            continue;
+
+        demands.emplace_back(SDemand{s.get(), FRAMEBYTES, FRAMEBYTES * DATA.framerate, (double)s->policy.priority});
+        totalWanted += demands.back().wanted;
+    }
+
+    const double BUDGET = **PMAXBANDWIDTH > 0 ? **PMAXBANDWIDTH * 1000000.0 : 0.0;
+
+    // water-filling: the smallest demands per unit of weight are served in full, the rest split what's left by weight
+    std::sort(demands.begin(), demands.end(), [](const auto& a, const auto& b) { return a.wanted / a.weight < b.wanted / b.weight; });
+
+    double remaining       = BUDGET;
+    double remainingWeight = 0;
+    bool   changed         = false;
+    for (auto& d : demands) {
+        remainingWeight += d.weight;
+    }
+
+    for (auto& d : demands) {
+        auto&          data    = d.session->sharingData;
+        const uint32_t OLDCAP  = data.qosFramerate;
+        double         granted = d.wanted;
+
+        if (BUDGET > 0 && totalWanted > BUDGET) {
+            granted = std::min(d.wanted, remaining * d.weight / remainingWeight);
+            remaining -= granted;
+            remainingWeight -= d.weight;
+        }
+
+        // never below one frame a second, a cast that stops entirely looks broken
+        const auto RATE   = std::max((uint32_t)(granted / d.frameBytes), 1u);
+        data.qosFramerate = RATE >= data.framerate ? 0 : RATE;
+
+        if (data.qosFramerate == OLDCAP)
+            continue;
+
+        changed = true;
+        Debug::log(LOG, "[qos] session {} ({}, priority {}): {} fps -> {} fps, {:.1f} of {:.1f} MB/s wanted", (void*)d.session, d.session->appid, d.session->policy.priority,
+                   OLDCAP ? OLDCAP : data.framerate, data.qosFramerate ? data.qosFramerate : data.framerate, granted / 1000000.0, d.wanted / 1000000.0);
+    }
+
+    if (changed)
+        Debug::log(LOG, "[qos] {} casts want {:.1f} MB/s, budget {:.1f} MB/s", demands.size(), totalWanted / 1000000.0, BUDGET > 0 ? BUDGET / 1000000.0 : INFINITY);
+}
+
+std::vector<SHandoffSession> CScreencopyPortal::exportSessions() {
+    std::vector<SHandoffSession> sessions;
+
+    for (auto& s : m_vSessions) {
+        // closed ones linger with a released session object
+        if (!s->session)
+            continue;
+
+        // its node goes away with us and the app can't Start the session again, nothing to carry over
+        if (s->sharingData.active) {
+            Debug::log(LOG, "[handoff] session {} is streaming, it ends with this instance", s->sessionHandle.c_str());
+            continue;
+        }
 
-    g_pPortalManager->addTimer(
-        {std::clamp(MSTILNEXTREFRESH - 1.0 /* safezone */, 6.0, 1000.0), [pSession]() { g_pPortalManager->m_sPortals.screencopy->startFrameCopy(pSession); }});
+        SHandoffSession hs;
+        hs.appid         = s->appid;
+        hs.requestHandle = s->requestHandle;
+        hs.sessionHandle = s->sessionHandle;
+        hs.cursorMode    = s->cursorMode;
+        hs.persistMode   = s->persistMode;
+        hs.type          = s->selection.type;
+        hs.output        = s->selection.output;
+        hs.x             = s->selection.x;
+        hs.y             = s->selection.y;
+        hs.w             = s->selection.w;
+        hs.h             = s->selection.h;
+        hs.allowToken    = s->selection.allowToken;
+        hs.framerate     = s->sharingData.framerate;
+
+        if (s->selection.type == TYPE_WINDOW) {
+            for (auto& w : g_pPortalManager->m_sHelpers.toplevel->m_vToplevels) {
+                if (w->handle == s->selection.windowHandle) {
+                    hs.windowClass = w->windowClass();
+                    hs.windowTitle = w->windowTitle();
+                    break;
+                }
+            }
+        }
+
+        sessions.emplace_back(std::move(hs));
+    }
+
+    return sessions;
+}
+
+void CScreencopyPortal::importSessions(const SHandoffState& state) {
+    for (auto& hs : state.sessions) {
+        const auto PSESSION             = createSession(hs.appid, sdbus::ObjectPath{hs.requestHandle}, sdbus::ObjectPath{hs.sessionHandle});
+        PSESSION->cursorMode            = hs.cursorMode;
+        PSESSION->persistMode           = hs.persistMode;
+        PSESSION->sharingData.framerate = hs.framerate;
+
+        SSelectionData selection;
+        selection.type       = (eSelectionType)hs.type;
+        selection.output     = hs.output;
+        selection.x          = hs.x;
+        selection.y          = hs.y;
+        selection.w          = hs.w;
+        selection.h          = hs.h;
+        selection.allowToken = hs.allowToken;
+
+        if (selection.type == TYPE_WINDOW) {
+            if (const auto PTOPLEVEL = g_pPortalManager->m_sHelpers.toplevel->findByIdentity(hs.windowClass, hs.windowTitle); PTOPLEVEL)
+                selection.windowHandle = PTOPLEVEL->handle;
+
+            if (!selection.windowHandle || !m_sState.toplevel) {
+                Debug::log(WARN, "[handoff] window {} of session {} is gone", hs.windowClass, hs.sessionHandle);
+                selection.type = TYPE_INVALID;
+            }
+        }
+
+        PSESSION->selection = selection;
+
+        Debug::log(LOG, "[handoff] restored session {} for {}, waiting for Start", hs.sessionHandle, hs.appid);
+    }
+
+    if (!state.sessions.empty())
+        Debug::log(LOG, "[handoff] sessions restored {:.2f}ms after the old instance stepped down",
+                   (std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count() - state.sentAtNs) / 1000000.0);
+}
+
+CRestoreTokenStore* CScreencopyPortal::restoreTokens() {
+    if (!m_pRestoreTokens)
+        m_pRestoreTokens = std::make_unique<CRestoreTokenStore>();
+
+    return m_pRestoreTokens.get();
 }
+
 bool CScreencopyPortal::hasToplevelCapabilities() {
     return m_sState.toplevel;
 }
@@ -732,17 +904,39 @@ CScreencopyPortal::CScreencopyPortal(zwlr_screencopy_manager_v1* mgr) {
     m_pObject->finishRegistration();
 
     m_sState.screencopy = mgr;
-    m_pPipewire         = std::make_unique<CPipewireConnection>();
 
     Debug::log(LOG, "[screencopy] init successful");
 }
 
+CScreencopyPortal::~CScreencopyPortal() {
+    // stop pw and the compositor from touching our buffers before the sessions owning them go away
+    for (auto& s : m_vSessions) {
+        if (!m_pPipewire)
+            break;
+
+        m_pPipewire->removeSessionFrameCallbacks(s.get());
+        m_pPipewire->destroyStream(s.get());
+    }
+
+    m_vSessions.clear();
+    m_pPipewire.reset();
+
+    Debug::log(LOG, "[screencopy] torn down");
+}
+
 void CScreencopyPortal::appendToplevelExport(void* proto) {
     m_sState.toplevel = (hyprland_toplevel_export_manager_v1*)proto;
 
     Debug::log(LOG, "[screencopy] Registered for toplevel export");
 }
 
+void CScreencopyPortal::appendImageCopyCapture(void* copyManager, void* outputSourceManager) {
+    m_sState.imageCopy    = (ext_image_copy_capture_manager_v1*)copyManager;
+    m_sState.outputSource = (ext_output_image_capture_source_manager_v1*)outputSourceManager;
+
+    Debug::log(LOG, "[screencopy] Registered for ext-image-copy-capture, outputs are captured through it");
+}
+
 bool CPipewireConnection::good() {
     return m_pContext && m_pCore;
 }
@@ -768,13 +962,9 @@ CPipewireConnection::CPipewireConnection() {
 void CPipewireConnection::removeSessionFrameCallbacks(CScreencopyPortal::SSession* pSession) {
     Debug::log(TRACE, "[pipewire] removeSessionFrameCallbacks called");
 
-    if (pSession->sharingData.frameCallback)
-        zwlr_screencopy_frame_v1_destroy(pSession->sharingData.frameCallback);
-    if (pSession->sharingData.windowFrameCallback)
-        hyprland_toplevel_export_frame_v1_destroy(pSession->sharingData.windowFrameCallback);
-
-    pSession->sharingData.windowFrameCallback = nullptr;
-    pSession->sharingData.frameCallback       = nullptr;
+    // persistent capture sessions stay, only the frame in flight goes
+    if (pSession->sharingData.backend)
+        pSession->sharingData.backend->cancel();
 
     pSession->sharingData.status = FRAME_NONE;
 }
@@ -840,6 +1030,12 @@ static void pwStreamParamChanged(void* data, uint32_t id, const spa_pod* param)
     spa_format_video_raw_parse(param, &PSTREAM->pwVideoInfo);
     Debug::log(TRACE, "[pw] Framerate: {}/{}", PSTREAM->pwVideoInfo.max_framerate.num, PSTREAM->pwVideoInfo.max_framerate.denom);
     PSTREAM->pSession->sharingData.framerate = PSTREAM->pwVideoInfo.max_framerate.num / PSTREAM->pwVideoInfo.max_framerate.denom;
+    g_pPortalManager->m_sPortals.screencopy->rebalanceBandwidth();
+
+    // with damage:full every tick copies anyway
+    PSTREAM->constantRate = PSTREAM->pSession->policy.constantRate && PSTREAM->pSession->policy.damage == CAPTURE_DAMAGE_WAIT;
+    if (PSTREAM->constantRate)
+        Debug::log(LOG, "[pw] stream {} runs at a constant rate, still frames are re-sent", (void*)PSTREAM);
 
     uint32_t                   data_type = 1 << SPA_DATA_MemFd;
 
@@ -858,43 +1054,19 @@ static void pwStreamParamChanged(void* data, uint32_t id, const spa_pod* param)
             uint32_t       n_modifiers = SPA_POD_CHOICE_N_VALUES(pod_modifier) - 1;
             uint64_t*      modifiers   = (uint64_t*)SPA_POD_CHOICE_VALUES(pod_modifier);
             modifiers++;
-            uint32_t         flags = GBM_BO_USE_RENDERING;
-            uint64_t         modifier;
             uint32_t         n_params;
             spa_pod_builder* builder[2] = {&dynBuilder[0].b, &dynBuilder[1].b};
 
-            gbm_bo*          bo =
-                gbm_bo_create_with_modifiers2(g_pPortalManager->m_sWaylandConnection.gbmDevice, PSTREAM->pSession->sharingData.frameInfoDMA.w,
-                                              PSTREAM->pSession->sharingData.frameInfoDMA.h, PSTREAM->pSession->sharingData.frameInfoDMA.fmt, modifiers, n_modifiers, flags);
-            if (bo) {
-                modifier = gbm_bo_get_modifier(bo);
-                gbm_bo_destroy(bo);
-                goto fixate_format;
-            }
+            const auto       MODIFIER = g_pPortalManager->m_sPortals.screencopy->m_pPipewire->negotiateModifier(
+                PSTREAM->pSession->sharingData.frameInfoDMA.fmt, PSTREAM->pSession->sharingData.frameInfoDMA.w, PSTREAM->pSession->sharingData.frameInfoDMA.h, modifiers, n_modifiers);
 
-            Debug::log(TRACE, "[pw] unable to allocate a dmabuf with modifiers. Falling back to the old api");
-            for (uint32_t i = 0; i < n_modifiers; i++) {
-                switch (modifiers[i]) {
-                    case DRM_FORMAT_MOD_INVALID:
-                        flags =
-                            GBM_BO_USE_RENDERING; // ;cast->ctx->state->config->screencast_conf.force_mod_linear ? GBM_BO_USE_RENDERING | GBM_BO_USE_LINEAR : GBM_BO_USE_RENDERING;
-                        break;
-                    case DRM_FORMAT_MOD_LINEAR: flags = GBM_BO_USE_RENDERING | GBM_BO_USE_LINEAR; break;
-                    default: continue;
-                }
-                bo = gbm_bo_create(g_pPortalManager->m_sWaylandConnection.gbmDevice, PSTREAM->pSession->sharingData.frameInfoDMA.w, PSTREAM->pSession->sharingData.frameInfoDMA.h,
-                                   PSTREAM->pSession->sharingData.frameInfoDMA.fmt, flags);
-                if (bo) {
-                    modifier = gbm_bo_get_modifier(bo);
-                    gbm_bo_destroy(bo);
-                    goto fixate_format;
-                }
+            if (!MODIFIER) {
+                Debug::log(ERR, "[pw] failed to alloc dma");
+                return;
             }
 
-            Debug::log(ERR, "[pw] failed to alloc dma");
-            return;
+            uint64_t modifier = *MODIFIER;
 
-        fixate_format:
             params[0] = fixate_format(&dynBuilder[2].b, pwFromDrmFourcc(PSTREAM->pSession->sharingData.frameInfoDMA.fmt), PSTREAM->pSession->sharingData.frameInfoDMA.w,
                                       PSTREAM->pSession->sharingData.frameInfoDMA.h, PSTREAM->pSession->sharingData.framerate, &modifier);
 
@@ -926,7 +1098,9 @@ static void pwStreamParamChanged(void* data, uint32_t id, const spa_pod* param)
 
     uint32_t blocks = 1;
 
-    params[0] = build_buffer(&dynBuilder[0].b, blocks, PSTREAM->pSession->sharingData.frameInfoSHM.size, PSTREAM->pSession->sharingData.frameInfoSHM.stride, data_type);
+    const auto& POLICY = PSTREAM->pSession->policy;
+    params[0] = build_buffer(&dynBuilder[0].b, blocks, PSTREAM->pSession->sharingData.frameInfoSHM.size, PSTREAM->pSession->sharingData.frameInfoSHM.stride, data_type,
+                             POLICY.buffers, POLICY.buffersMin, POLICY.pipelineDepth);
 
     params[1] = (const spa_pod*)spa_pod_builder_add_object(&dynBuilder[1].b, SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta, SPA_PARAM_META_type, SPA_POD_Id(SPA_META_Header),
                                                            SPA_PARAM_META_size, SPA_POD_Int(sizeof(struct spa_meta_header)));
@@ -962,7 +1136,13 @@ static void pwStreamAddBuffer(void* data, pw_buffer* buffer) {
         return;
     }
 
-    const auto PBUFFER = PSTREAM->buffers.emplace_back(g_pPortalManager->m_sPortals.screencopy->m_pPipewire->createBuffer(PSTREAM, type == SPA_DATA_DmaBuf)).get();
+    auto pBuffer = g_pPortalManager->m_sPortals.screencopy->m_pPipewire->createBuffer(PSTREAM, type == SPA_DATA_DmaBuf);
+    if (!pBuffer) {
+        Debug::log(ERR, "[pipewire] couldn't allocate a buffer");
+        return;
+    }
+
+    const auto PBUFFER = PSTREAM->buffers.emplace_back(std::move(pBuffer)).get();
 
     PBUFFER->pwBuffer = buffer;
     buffer->user_data = PBUFFER;
@@ -972,7 +1152,7 @@ static void pwStreamAddBuffer(void* data, pw_buffer* buffer) {
     for (uint32_t plane = 0; plane < buffer->buffer->n_datas; plane++) {
         spaData[plane].type          = type;
         spaData[plane].maxsize       = PBUFFER->size[plane];
-        spaData[plane].mapoffset     = 0;
+        spaData[plane].mapoffset     = PBUFFER->mapOffset;
         spaData[plane].chunk->size   = PBUFFER->size[plane];
         spaData[plane].chunk->stride = PBUFFER->stride[plane];
         spaData[plane].chunk->offset = PBUFFER->offset[plane];
@@ -999,13 +1179,13 @@ static void pwStreamRemoveBuffer(void* data, pw_buffer* buffer) {
     if (PSTREAM->currentPWBuffer == PBUFFER)
         PSTREAM->currentPWBuffer = nullptr;
 
-    if (PBUFFER->isDMABUF)
-        gbm_bo_destroy(PBUFFER->bo);
+    std::erase(PSTREAM->parked, PBUFFER);
 
-    wl_buffer_destroy(PBUFFER->wlBuffer);
-    for (int plane = 0; plane < PBUFFER->planeCount; plane++) {
-        close(PBUFFER->fd[plane]);
-    }
+    // it painted its cursor into this one and remembers what was under it
+    if (const auto PCURSOR = PSTREAM->pSession->sharingData.backend ? PSTREAM->pSession->sharingData.backend->softwareCursor() : nullptr; PCURSOR)
+        PCURSOR->forget(PBUFFER);
+
+    PBUFFER->allocator->release(PBUFFER);
 
     for (uint32_t plane = 0; plane < buffer->buffer->n_datas; plane++) {
         buffer->buffer->datas[plane].fd = -1;
@@ -1087,15 +1267,22 @@ void CPipewireConnection::destroyStream(CScreencopyPortal::SSession* pSession) {
         }
     }
 
+    // we're done with it, don't let disconnect call back into us
+    spa_hook_remove(&PSTREAM->streamListener);
+
     pw_stream_flush(PSTREAM->stream, false);
     pw_stream_disconnect(PSTREAM->stream);
     pw_stream_destroy(PSTREAM->stream);
 
     std::erase_if(m_vStreams, [&](const auto& other) { return other.get() == PSTREAM; });
+
+    // the others get their share back. Not while the portal itself is going away.
+    if (g_pPortalManager->m_sPortals.screencopy)
+        g_pPortalManager->m_sPortals.screencopy->rebalanceBandwidth();
 }
 
 static bool wlr_query_dmabuf_modifiers(uint32_t drm_format, uint32_t num_modifiers, uint64_t* modifiers, uint32_t* max_modifiers) {
-    if (g_pPortalManager->m_vDMABUFMods.empty())
+    if (g_pPortalManager->m_vDMABUFMods.empty() || !g_pPortalManager->m_sWaylandConnection.gbmDevice)
         return false;
 
     if (num_modifiers == 0) {
@@ -1149,13 +1336,16 @@ uint32_t CPipewireConnection::buildFormatsFor(spa_pod_builder* b[2], const spa_p
     if (build_modifierlist(stream, stream->pSession->sharingData.frameInfoDMA.fmt, &modifiers, &modCount) && modCount > 0) {
         Debug::log(LOG, "[pw] Building modifiers for dma");
 
-        paramCount = 2;
-        params[0]  = build_format(b[0], pwFromDrmFourcc(stream->pSession->sharingData.frameInfoDMA.fmt), stream->pSession->sharingData.frameInfoDMA.w,
-                                  stream->pSession->sharingData.frameInfoDMA.h, stream->pSession->sharingData.framerate, modifiers, modCount);
-        assert(params[0] != NULL);
-        params[1] = build_format(b[1], pwFromDrmFourcc(stream->pSession->sharingData.frameInfoSHM.fmt), stream->pSession->sharingData.frameInfoSHM.w,
-                                 stream->pSession->sharingData.frameInfoSHM.h, stream->pSession->sharingData.framerate, NULL, 0);
-        assert(params[1] != NULL);
+        // earlier params are preferred by pw
+        const size_t DMAIDX = stream->pSession->policy.memory == CAPTURE_MEMORY_SHM ? 1 : 0;
+
+        paramCount     = 2;
+        params[DMAIDX] = build_format(b[DMAIDX], pwFromDrmFourcc(stream->pSession->sharingData.frameInfoDMA.fmt), stream->pSession->sharingData.frameInfoDMA.w,
+                                      stream->pSession->sharingData.frameInfoDMA.h, stream->pSession->sharingData.framerate, modifiers, modCount);
+        assert(params[DMAIDX] != NULL);
+        params[!DMAIDX] = build_format(b[!DMAIDX], pwFromDrmFourcc(stream->pSession->sharingData.frameInfoSHM.fmt), stream->pSession->sharingData.frameInfoSHM.w,
+                                       stream->pSession->sharingData.frameInfoSHM.h, stream->pSession->sharingData.framerate, NULL, 0);
+        assert(params[!DMAIDX] != NULL);
     } else {
         Debug::log(LOG, "[pw] Building modifiers for shm");
 
@@ -1170,6 +1360,58 @@ uint32_t CPipewireConnection::buildFormatsFor(spa_pod_builder* b[2], const spa_p
     return paramCount;
 }
 
+std::optional<uint64_t> CPipewireConnection::negotiateModifier(uint32_t fourcc, uint32_t w, uint32_t h, const uint64_t* modifiers, uint32_t modCount) {
+    const auto BEGIN = std::chrono::steady_clock::now();
+
+    SModifierCacheKey KEY = {fourcc, w, h, std::vector<uint64_t>(modifiers, modifiers + modCount)};
+
+    if (const auto IT = m_mModifierCache.find(KEY); IT != m_mModifierCache.end()) {
+        m_sModifierCacheStats.hits++;
+        Debug::log(LOG, "[pw] modifier cache hit for {:x} {}x{}: {:x} (hit rate {:.1f}%, {}us)", fourcc, w, h, IT->second,
+                   100.0 * m_sModifierCacheStats.hits / (m_sModifierCacheStats.hits + m_sModifierCacheStats.misses),
+                   std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - BEGIN).count());
+        return IT->second;
+    }
+
+    m_sModifierCacheStats.misses++;
+
+    const auto GBMDEVICE = g_pPortalManager->m_sWaylandConnection.gbmDevice;
+
+    // find out what gbm can actually allocate out of what the consumer offered
+    std::optional<uint64_t> result;
+    gbm_bo*                 bo = gbm_bo_create_with_modifiers2(GBMDEVICE, w, h, fourcc, modifiers, modCount, GBM_BO_USE_RENDERING);
+    if (bo) {
+        result = gbm_bo_get_modifier(bo);
+        gbm_bo_destroy(bo);
+    } else {
+        Debug::log(TRACE, "[pw] unable to allocate a dmabuf with modifiers. Falling back to the old api");
+        for (uint32_t i = 0; i < modCount; i++) {
+            uint32_t flags = GBM_BO_USE_RENDERING;
+            switch (modifiers[i]) {
+                case DRM_FORMAT_MOD_INVALID: flags = GBM_BO_USE_RENDERING; break;
+                case DRM_FORMAT_MOD_LINEAR: flags = GBM_BO_USE_RENDERING | GBM_BO_USE_LINEAR; break;
+                default: continue;
+            }
+            bo = gbm_bo_create(GBMDEVICE, w, h, fourcc, flags);
+            if (bo) {
+                result = gbm_bo_get_modifier(bo);
+                gbm_bo_destroy(bo);
+                break;
+            }
+        }
+    }
+
+    // failures aren't cached, they might be transient (e.g. vram pressure)
+    if (result)
+        m_mModifierCache[std::move(KEY)] = *result;
+
+    Debug::log(LOG, "[pw] modifier cache miss for {:x} {}x{}: {} (hit rate {:.1f}%, {}us)", fourcc, w, h, result ? std::format("{:x}", *result) : "none",
+               100.0 * m_sModifierCacheStats.hits / (m_sModifierCacheStats.hits + m_sModifierCacheStats.misses),
+               std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - BEGIN).count());
+
+    return result;
+}
+
 bool CPipewireConnection::buildModListFor(CPipewireConnection::SPWStream* stream, uint32_t drmFmt, uint64_t** mods, uint32_t* modCount) {
     return true;
 }
@@ -1202,6 +1444,16 @@ void CPipewireConnection::enqueue(CScreencopyPortal::SSession* pSession) {
     if (CORRUPT)
         Debug::log(TRACE, "[pw] buffer corrupt");
 
+    if (!CORRUPT && !PSTREAM->currentPWBuffer->copiedInto) {
+        // the first copy into a fresh buffer is where page faults would hit, pooled shm buffers come pre-faulted
+        PSTREAM->currentPWBuffer->copiedInto = true;
+        Debug::log(LOG, "[pw] first copy into buffer {} ({}) took {:.2f}ms", (void*)PSTREAM->currentPWBuffer, PSTREAM->currentPWBuffer->allocator->name(),
+                   std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - pSession->sharingData.copyBegun).count() / 1000.0);
+    }
+
+    if (!CORRUPT)
+        PSTREAM->currentPWBuffer->contentSeq = ++PSTREAM->contentSeq;
+
     Debug::log(TRACE, "[pw] Enqueue data:");
 
     spa_meta_header* header = (spa_meta_header*)spa_buffer_find_meta_data(spaBuf, SPA_META_Header, sizeof(*header));
@@ -1271,6 +1523,18 @@ void CPipewireConnection::enqueue(CScreencopyPortal::SSession* pSession) {
     PSTREAM->currentPWBuffer = nullptr;
 }
 
+// pwStreamAddBuffer couldn't allocate for it. Hand it straight back marked corrupted so pw doesn't hold on to it as ours.
+static void queueUnbacked(CPipewireConnection::SPWStream* stream, pw_buffer* buffer) {
+    Debug::log(TRACE, "[pw] buffer {} on {} has nothing behind it, returning it", (void*)buffer, (void*)stream);
+
+    for (uint32_t plane = 0; plane < buffer->buffer->n_datas; plane++) {
+        buffer->buffer->datas[plane].chunk->size  = 0;
+        buffer->buffer->datas[plane].chunk->flags = SPA_CHUNK_FLAG_CORRUPTED;
+    }
+
+    pw_stream_queue_buffer(stream->stream, buffer);
+}
+
 void CPipewireConnection::dequeue(CScreencopyPortal::SSession* pSession) {
     const auto PSTREAM = streamFromSession(pSession);
 
@@ -1281,6 +1545,12 @@ void CPipewireConnection::dequeue(CScreencopyPortal::SSession* pSession) {
 
     Debug::log(TRACE, "[pw] dequeue on {}", (void*)PSTREAM);
 
+    if (!PSTREAM->parked.empty()) {
+        PSTREAM->currentPWBuffer = PSTREAM->parked.front();
+        PSTREAM->parked.erase(PSTREAM->parked.begin());
+        return;
+    }
+
     const auto PWBUF = pw_stream_dequeue_buffer(PSTREAM->stream);
 
     if (!PWBUF) {
@@ -1291,107 +1561,131 @@ void CPipewireConnection::dequeue(CScreencopyPortal::SSession* pSession) {
 
     const auto PBUF = (SBuffer*)PWBUF->user_data;
 
+    if (!PBUF)
+        queueUnbacked(PSTREAM, PWBUF);
+
     PSTREAM->currentPWBuffer = PBUF;
 }
 
-std::unique_ptr<SBuffer> CPipewireConnection::createBuffer(CPipewireConnection::SPWStream* pStream, bool dmabuf) {
-    std::unique_ptr<SBuffer> pBuffer = std::make_unique<SBuffer>();
+bool CPipewireConnection::resendLatest(CScreencopyPortal::SSession* pSession) {
+    const auto PSTREAM = streamFromSession(pSession);
 
-    pBuffer->isDMABUF = dmabuf;
+    if (!PSTREAM || !PSTREAM->contentSeq)
+        return false;
 
-    Debug::log(TRACE, "[pw] createBuffer: type {}", dmabuf ? "dma" : "shm");
+    // pw hands free buffers out oldest first. The one with the latest frame is usually the first, the others are kept
+    // for the next copies, those overwrite them anyway.
+    SBuffer* latest = nullptr;
+    while (!latest && PSTREAM->parked.size() < PSTREAM->buffers.size()) {
+        const auto PWBUF = pw_stream_dequeue_buffer(PSTREAM->stream);
+        if (!PWBUF)
+            break;
 
-    if (dmabuf) {
-        pBuffer->w   = pStream->pSession->sharingData.frameInfoDMA.w;
-        pBuffer->h   = pStream->pSession->sharingData.frameInfoDMA.h;
-        pBuffer->fmt = pStream->pSession->sharingData.frameInfoDMA.fmt;
+        const auto PBUF = (SBuffer*)PWBUF->user_data;
+        if (!PBUF)
+            queueUnbacked(PSTREAM, PWBUF);
+        else if (PBUF->contentSeq == PSTREAM->contentSeq)
+            latest = PBUF;
+        else
+            PSTREAM->parked.emplace_back(PBUF);
+    }
 
-        uint32_t flags = GBM_BO_USE_RENDERING;
+    if (!latest) {
+        Debug::log(TRACE, "[pw] resend on {}: the latest frame is still with the consumer", (void*)PSTREAM);
+        return false;
+    }
 
-        if (pStream->pwVideoInfo.modifier != DRM_FORMAT_MOD_INVALID) {
-            uint64_t* mods = (uint64_t*)&pStream->pwVideoInfo.modifier;
-            pBuffer->bo    = gbm_bo_create_with_modifiers2(g_pPortalManager->m_sWaylandConnection.gbmDevice, pBuffer->w, pBuffer->h, pBuffer->fmt, mods, 1, flags);
-        } else {
-            pBuffer->bo = gbm_bo_create(g_pPortalManager->m_sWaylandConnection.gbmDevice, pBuffer->w, pBuffer->h, pBuffer->fmt, flags);
-        }
+    spa_buffer* spaBuf = latest->pwBuffer->buffer;
 
-        if (!pBuffer->bo) {
-            Debug::log(ERR, "[pw] Couldn't create a drm buffer");
-            return nullptr;
-        }
+    // the cursor moved on it since, if we paint it
+    const auto PCURSOR = pSession->sharingData.backend ? pSession->sharingData.backend->softwareCursor() : nullptr;
 
-        pBuffer->planeCount = gbm_bo_get_plane_count(pBuffer->bo);
+    std::vector<CCursorCapture::SRect> cursorDamage;
+    if (PCURSOR && PCURSOR->dirty())
+        cursorDamage = PCURSOR->paint(latest, false);
+
+    // same picture, later time
+    spa_meta_header* header = (spa_meta_header*)spa_buffer_find_meta_data(spaBuf, SPA_META_Header, sizeof(*header));
+    if (header) {
+        header->pts        = CPresentClock::now();
+        header->flags      = 0;
+        header->seq        = PSTREAM->seq++;
+        header->dts_offset = 0;
+    }
 
-        zwp_linux_buffer_params_v1* params = zwp_linux_dmabuf_v1_create_params((zwp_linux_dmabuf_v1*)g_pPortalManager->m_sWaylandConnection.linuxDmabuf);
-        if (!params) {
-            Debug::log(ERR, "[pw] zwp_linux_dmabuf_v1_create_params failed");
-            gbm_bo_destroy(pBuffer->bo);
-            return nullptr;
+    if (spa_meta* damage = spa_buffer_find_meta(spaBuf, SPA_META_VideoDamage); damage) {
+        spa_region* damageRegion = (spa_region*)spa_meta_first(damage);
+        for (const auto& r : cursorDamage) {
+            if (!spa_meta_check(damageRegion + 1, damage))
+                break;
+            *damageRegion++ = SPA_REGION(r.x, r.y, (uint32_t)r.w, (uint32_t)r.h);
         }
+        *damageRegion = SPA_REGION(0, 0, 0, 0);
+    }
 
-        for (size_t plane = 0; plane < (size_t)pBuffer->planeCount; plane++) {
-            pBuffer->size[plane]   = 0;
-            pBuffer->stride[plane] = gbm_bo_get_stride_for_plane(pBuffer->bo, plane);
-            pBuffer->offset[plane] = gbm_bo_get_offset(pBuffer->bo, plane);
-            uint64_t mod           = gbm_bo_get_modifier(pBuffer->bo);
-            pBuffer->fd[plane]     = gbm_bo_get_fd_for_plane(pBuffer->bo, plane);
-
-            if (pBuffer->fd[plane] < 0) {
-                Debug::log(ERR, "[pw] gbm_bo_get_fd_for_plane failed");
-                zwp_linux_buffer_params_v1_destroy(params);
-                gbm_bo_destroy(pBuffer->bo);
-                for (size_t plane_tmp = 0; plane_tmp < plane; plane_tmp++) {
-                    close(pBuffer->fd[plane_tmp]);
-                }
-                return NULL;
-            }
+    for (uint32_t plane = 0; plane < spaBuf->n_datas; plane++) {
+        spaBuf->datas[plane].chunk->flags = SPA_CHUNK_FLAG_NONE;
+    }
 
-            zwp_linux_buffer_params_v1_add(params, pBuffer->fd[plane], plane, pBuffer->offset[plane], pBuffer->stride[plane], mod >> 32, mod & 0xffffffff);
-        }
+    Debug::log(TRACE, "[pw] resend on {}: buffer {} with frame {}", (void*)PSTREAM, (void*)latest, latest->contentSeq);
 
-        pBuffer->wlBuffer = zwp_linux_buffer_params_v1_create_immed(params, pBuffer->w, pBuffer->h, pBuffer->fmt, /* flags */ 0);
-        zwp_linux_buffer_params_v1_destroy(params);
+    pw_stream_queue_buffer(PSTREAM->stream, latest->pwBuffer);
 
-        if (!pBuffer->wlBuffer) {
-            Debug::log(ERR, "[pw] zwp_linux_buffer_params_v1_create_immed failed");
-            gbm_bo_destroy(pBuffer->bo);
-            for (size_t plane = 0; plane < (size_t)pBuffer->planeCount; plane++) {
-                close(pBuffer->fd[plane]);
-            }
+    return true;
+}
 
-            return nullptr;
+IBufferAllocator* CPipewireConnection::allocatorFor(CPipewireConnection::SPWStream* pStream, bool dmabuf) {
+    std::unique_ptr<IBufferAllocator>* allocator = &pStream->allocators.memfd;
+
+    if (dmabuf)
+        allocator = &pStream->allocators.gbm;
+    else {
+        switch (pStream->pSession->policy.shm) {
+            case CAPTURE_SHM_MEMFD: allocator = &pStream->allocators.memfd; break;
+            case CAPTURE_SHM_HUGEPAGE: allocator = &pStream->allocators.hugepage; break;
+            default:
+                // below that, a frame spans too few hugepages to make up for the rounding
+                allocator = pStream->pSession->sharingData.frameInfoSHM.size >= HUGEPAGE_MIN_FRAME_SIZE ? &pStream->allocators.hugepage : &pStream->allocators.memfd;
+                break;
         }
-    } else {
+    }
 
-        pBuffer->w   = pStream->pSession->sharingData.frameInfoSHM.w;
-        pBuffer->h   = pStream->pSession->sharingData.frameInfoSHM.h;
-        pBuffer->fmt = pStream->pSession->sharingData.frameInfoSHM.fmt;
+    if (!*allocator) {
+        if (allocator == &pStream->allocators.gbm)
+            *allocator = std::make_unique<CGBMBufferAllocator>();
+        else
+            *allocator = std::make_unique<CMemfdBufferAllocator>(allocator == &pStream->allocators.hugepage);
+    }
 
-        pBuffer->planeCount = 1;
-        pBuffer->size[0]    = pStream->pSession->sharingData.frameInfoSHM.size;
-        pBuffer->stride[0]  = pStream->pSession->sharingData.frameInfoSHM.stride;
-        pBuffer->offset[0]  = 0;
-        pBuffer->fd[0]      = anonymous_shm_open();
+    if (pStream->allocators.current != allocator->get()) {
+        Debug::log(LOG, "[pw] stream {} allocates from {}", (void*)pStream, (*allocator)->name());
+        pStream->allocators.current = allocator->get();
+    }
 
-        if (pBuffer->fd[0] == -1) {
-            Debug::log(ERR, "[screencopy] anonymous_shm_open failed");
-            return nullptr;
-        }
+    return allocator->get();
+}
 
-        if (ftruncate(pBuffer->fd[0], pBuffer->size[0]) < 0) {
-            Debug::log(ERR, "[screencopy] ftruncate failed");
-            return nullptr;
-        }
+std::unique_ptr<SBuffer> CPipewireConnection::createBuffer(CPipewireConnection::SPWStream* pStream, bool dmabuf) {
+    Debug::log(TRACE, "[pw] createBuffer: type {}", dmabuf ? "dma" : "shm");
 
-        pBuffer->wlBuffer = import_wl_shm_buffer(pBuffer->fd[0], wlSHMFromDrmFourcc(pStream->pSession->sharingData.frameInfoSHM.fmt), pStream->pSession->sharingData.frameInfoSHM.w,
-                                                 pStream->pSession->sharingData.frameInfoSHM.h, pStream->pSession->sharingData.frameInfoSHM.stride);
-        if (!pBuffer->wlBuffer) {
-            Debug::log(ERR, "[screencopy] import_wl_shm_buffer failed");
-            return nullptr;
-        }
+    const auto     ALLOCATOR = allocatorFor(pStream, dmabuf);
+
+    SBufferRequest request;
+    if (dmabuf) {
+        request.w        = pStream->pSession->sharingData.frameInfoDMA.w;
+        request.h        = pStream->pSession->sharingData.frameInfoDMA.h;
+        request.fmt      = pStream->pSession->sharingData.frameInfoDMA.fmt;
+        request.modifier = pStream->pwVideoInfo.modifier;
+    } else {
+        request.w      = pStream->pSession->sharingData.frameInfoSHM.w;
+        request.h      = pStream->pSession->sharingData.frameInfoSHM.h;
+        request.fmt    = pStream->pSession->sharingData.frameInfoSHM.fmt;
+        request.size   = pStream->pSession->sharingData.frameInfoSHM.size;
+        request.stride = pStream->pSession->sharingData.frameInfoSHM.stride;
+        request.count  = pStream->pSession->policy.buffers; // what we ask pw for, it goes with that unless the consumer objects
     }
 
-    return pBuffer;
+    return ALLOCATOR->allocate(request);
 }
 
 void CPipewireConnection::updateStreamParam(SPWStream* pStream) {
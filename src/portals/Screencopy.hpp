@@ -2,11 +2,19 @@
 
 #include <protocols/wlr-screencopy-unstable-v1-protocol.h>
 #include <protocols/hyprland-toplevel-export-v1-protocol.h>
+#include <protocols/ext-image-capture-source-v1-protocol.h>
+#include <protocols/ext-image-copy-capture-v1-protocol.h>
 #include <sdbus-c++/sdbus-c++.h>
 #include "../shared/ScreencopyShared.hpp"
+#include "../shared/CapturePolicy.hpp"
+#include "../shared/RestoreTokenStore.hpp"
+#include "../shared/BufferAllocator.hpp"
 #include <gbm.h>
 #include "../shared/Session.hpp"
+#include "../core/Handoff.hpp"
 #include <chrono>
+#include <optional>
+#include <unordered_map>
 
 enum cursorModes {
     HIDDEN   = 1,
@@ -33,27 +41,17 @@ struct pw_core;
 struct pw_stream;
 struct pw_buffer;
 
-struct SBuffer {
-    bool       isDMABUF = false;
-    uint32_t   w = 0, h = 0, fmt = 0;
-    int        planeCount = 0;
-
-    int        fd[4];
-    uint32_t   size[4], stride[4], offset[4];
-
-    gbm_bo*    bo = nullptr;
-
-    wl_buffer* wlBuffer = nullptr;
-    pw_buffer* pwBuffer = nullptr;
-};
-
 class CPipewireConnection;
+class ICaptureBackend;
+struct SOutput;
 
 class CScreencopyPortal {
   public:
     CScreencopyPortal(zwlr_screencopy_manager_v1*);
+    ~CScreencopyPortal();
 
     void appendToplevelExport(void*);
+    void appendImageCopyCapture(void* copyManager, void* outputSourceManager);
 
     void onCreateSession(sdbus::MethodCall& call);
     void onSelectSources(sdbus::MethodCall& call);
@@ -64,24 +62,40 @@ class CScreencopyPortal {
         sdbus::ObjectPath             requestHandle, sessionHandle;
         uint32_t                      cursorMode  = HIDDEN;
         uint32_t                      persistMode = 0;
+        std::string                   restoreToken; // the one we restored from, reused when handing out a new one
 
         std::unique_ptr<SDBusRequest> request;
         std::unique_ptr<SDBusSession> session;
         SSelectionData                selection;
+        SCapturePolicy                policy;
+
+        ~SSession();
 
         struct {
-            bool                                  active              = false;
-            zwlr_screencopy_frame_v1*             frameCallback       = nullptr;
-            hyprland_toplevel_export_frame_v1*    windowFrameCallback = nullptr;
-            frameStatus                           status              = FRAME_NONE;
-            uint64_t                              tvSec               = 0;
-            uint32_t                              tvNsec              = 0;
-            uint64_t                              tvTimestampNs       = 0;
-            uint32_t                              nodeID              = 0;
-            uint32_t                              framerate           = 60;
-            wl_output_transform                   transform           = WL_OUTPUT_TRANSFORM_NORMAL;
-            std::chrono::system_clock::time_point begunFrame          = std::chrono::system_clock::now();
-            uint32_t                              copyRetries         = 0;
+            bool                                  active = false;
+            std::unique_ptr<ICaptureBackend>      backend; // created on the first frame
+            frameStatus                           status        = FRAME_NONE;
+            bool                                  formatChecked = false; // stream matches the constraints we last got
+            uint64_t                              tvSec         = 0;
+            uint32_t                              tvNsec        = 0;
+            uint64_t                              tvTimestampNs = 0;
+            uint32_t                              nodeID        = 0;
+            uint32_t                              framerate     = 60;
+            uint32_t                              qosFramerate  = 0; // lower cap from rebalanceBandwidth, 0 if none
+            wl_output_transform                   transform     = WL_OUTPUT_TRANSFORM_NORMAL;
+            std::chrono::system_clock::time_point begunFrame    = std::chrono::system_clock::now();
+            std::chrono::steady_clock::time_point copyBegun;
+            uint32_t                              copyRetries = 0;
+            bool                                  frameQueued = false; // a timer or tick will call startFrameCopy
+
+            // frame pacing over the last PACING_LOG_FRAMES frames, times in ms. See queueNextShareFrame.
+            struct {
+                uint64_t lastReadyNs = 0;
+                uint32_t frames      = 0;
+                uint32_t onGrid      = 0; // of them scheduled on the output's vblank grid
+                uint32_t resent      = 0; // of them sent again without a copy, see CPipewireConnection::resendLatest
+                double   intervalSum = 0, intervalSqSum = 0, latencySum = 0;
+            } pacing;
 
             struct {
                 uint32_t w = 0, h = 0, size = 0, stride = 0, fmt = 0;
@@ -103,8 +117,21 @@ class CScreencopyPortal {
 
     void                                 startFrameCopy(SSession* pSession);
     void                                 queueNextShareFrame(SSession* pSession);
+
+    // the frame state machine, fed by the capture backends
+    void                                 onFrameConstraints(SSession* pSession, bool changed);
+    void                                 onFrameReady(SSession* pSession);
+    void                                 onFrameFailed(SSession* pSession, bool retry);
+
+    // fits all casts into screencopy:max_bandwidth by capping their rates, weighted by policy priority.
+    // Call when a stream's size or rate changes or it goes away.
+    void                                 rebalanceBandwidth();
     bool                                 hasToplevelCapabilities();
 
+    // live restart, see CHandoff
+    std::vector<SHandoffSession>         exportSessions();
+    void                                 importSessions(const SHandoffState& state);
+
     std::unique_ptr<CPipewireConnection> m_pPipewire;
 
   private:
@@ -112,12 +139,40 @@ class CScreencopyPortal {
 
     std::vector<std::unique_ptr<SSession>> m_vSessions;
 
+    // loaded on first use, keeps the token log off the startup path
+    std::unique_ptr<CRestoreTokenStore>    m_pRestoreTokens;
+    CRestoreTokenStore*                    restoreTokens();
+
     SSession*                              getSession(sdbus::ObjectPath& path);
+    SSession*                              createSession(const std::string& appid, const sdbus::ObjectPath& requestHandle, const sdbus::ObjectPath& sessionHandle);
     void                                   startSharing(SSession* pSession);
+    std::unique_ptr<ICaptureBackend>       createBackend(SSession* pSession);
+    // the output whose vblanks a session's frames follow, nullptr for windows
+    SOutput*                               pacingOutput(SSession* pSession);
+    void                                   updatePacing(SSession* pSession);
+
+    // captures due together on one output, started from one timer. See queueNextShareFrame.
+    struct STick {
+        uint32_t               outputID = 0;
+        uint64_t               atNs     = 0; // CLOCK_MONOTONIC
+        std::vector<SSession*> sessions;
+    };
+
+    std::vector<std::unique_ptr<STick>>    m_vTicks;
+    void                                   scheduleOnTick(SSession* pSession, SOutput* pOutput, uint64_t atNs);
+    void                                   runTick(STick* pTick);
+
+    struct {
+        uint64_t wakeups = 0, captures = 0;
+        uint64_t sinceNs = 0;
+    } m_sTickStats;
+    bool                                   ensurePipewire();
 
     struct {
-        zwlr_screencopy_manager_v1*          screencopy = nullptr;
-        hyprland_toplevel_export_manager_v1* toplevel   = nullptr;
+        zwlr_screencopy_manager_v1*                 screencopy   = nullptr;
+        hyprland_toplevel_export_manager_v1*        toplevel     = nullptr;
+        ext_image_copy_capture_manager_v1*          imageCopy    = nullptr;
+        ext_output_image_capture_source_manager_v1* outputSource = nullptr;
     } m_sState;
 
     const std::string INTERFACE_NAME = "org.freedesktop.impl.portal.ScreenCast";
@@ -136,6 +191,8 @@ class CPipewireConnection {
 
     void enqueue(CScreencopyPortal::SSession* pSession);
     void dequeue(CScreencopyPortal::SSession* pSession);
+    // queues a free buffer that already holds the latest frame, with no damage. false if none is free.
+    bool resendLatest(CScreencopyPortal::SSession* pSession);
 
     struct SPWStream {
         CScreencopyPortal::SSession*          pSession    = nullptr;
@@ -147,13 +204,28 @@ class CPipewireConnection {
         uint32_t                              seq   = 0;
         bool                                  isDMA = false;
 
+        // constant_rate: the latest frame's number, and free buffers dequeued while looking for it, handed out before pw's
+        bool                                  constantRate = false;
+        uint64_t                              contentSeq   = 0;
+        std::vector<SBuffer*>                 parked;
+
+        // created on first use, a memfd one owns the stream's shm pool
+        struct {
+            std::unique_ptr<IBufferAllocator> gbm, memfd, hugepage;
+            IBufferAllocator*                 current = nullptr;
+        } allocators;
+
         std::vector<std::unique_ptr<SBuffer>> buffers;
     };
 
     std::unique_ptr<SBuffer> createBuffer(SPWStream* pStream, bool dmabuf);
+    IBufferAllocator*        allocatorFor(SPWStream* pStream, bool dmabuf);
     SPWStream*               streamFromSession(CScreencopyPortal::SSession* pSession);
     void                     removeSessionFrameCallbacks(CScreencopyPortal::SSession* pSession);
     uint32_t                 buildFormatsFor(spa_pod_builder* b[2], const spa_pod* params[2], SPWStream* stream);
+
+    // picks the modifier gbm can allocate out of a consumer's offer. Cached, repeat negotiations skip the trial allocations.
+    std::optional<uint64_t>  negotiateModifier(uint32_t fourcc, uint32_t w, uint32_t h, const uint64_t* modifiers, uint32_t modCount);
     void                     updateStreamParam(SPWStream* pStream);
 
   private:
@@ -161,6 +233,30 @@ class CPipewireConnection {
 
     bool                                    buildModListFor(SPWStream* stream, uint32_t drmFmt, uint64_t** mods, uint32_t* modCount);
 
+    // the whole offer, so a hit is always a modifier the consumer asked for
+    struct SModifierCacheKey {
+        uint32_t              fourcc = 0, w = 0, h = 0;
+        std::vector<uint64_t> modifiers;
+
+        bool                  operator==(const SModifierCacheKey&) const = default;
+    };
+
+    struct SModifierCacheKeyHash {
+        size_t operator()(const SModifierCacheKey& k) const {
+            uint64_t modsetHash = 14695981039346656037ull;
+            for (const auto& m : k.modifiers)
+                modsetHash = (modsetHash ^ m) * 1099511628211ull;
+
+            return std::hash<uint64_t>{}(modsetHash ^ ((uint64_t)k.fourcc << 32) ^ ((uint64_t)k.w << 16) ^ k.h);
+        }
+    };
+
+    std::unordered_map<SModifierCacheKey, uint64_t, SModifierCacheKeyHash> m_mModifierCache;
+
+    struct {
+        uint64_t hits = 0, misses = 0;
+    } m_sModifierCacheStats;
+
     pw_context*                             m_pContext = nullptr;
     pw_core*                                m_pCore    = nullptr;
 };
\ No newline at end of file
@@ -2,15 +2,135 @@
 #include "../core/PortalManager.hpp"
 #include "../helpers/Log.hpp"
 #include "../helpers/MiscFunctions.hpp"
+#include "../helpers/ExecutableCache.hpp"
+#include "../helpers/PNG.hpp"
+#include "../helpers/PresentClock.hpp"
+#include "../shared/OutputGrab.hpp"
+#include "../shared/ScreencopyShared.hpp"
 
 #include <regex>
 #include <filesystem>
 
 std::string lastScreenshot;
 
-void        pickHyprPicker(sdbus::MethodCall& call) {
-    const std::string HYPRPICKER_CMD = "hyprpicker --format=rgb --no-fancy";
-    std::string       rgbColor       = execAndGet(HYPRPICKER_CMD.c_str());
+static std::string trimNewline(std::string str) {
+    while (!str.empty() && (str.back() == '\n' || str.back() == ' '))
+        str.pop_back();
+    return str;
+}
+
+// every output as it is right now, nullptr if we can't (no wlr-screencopy, no xdg-output, a frame failed)
+static std::unique_ptr<COutputGrab> grabOutputs() {
+    const auto MANAGER = (zwlr_screencopy_manager_v1*)g_pPortalManager->m_sWaylandConnection.screencopyMgr;
+
+    if (!MANAGER || !g_pPortalManager->m_sWaylandConnection.xdgOutputMgr)
+        return nullptr;
+
+    // like grim, no cursor unless asked
+    auto grab = std::make_unique<COutputGrab>(MANAGER, g_pPortalManager->getOutputs(), false);
+
+    if (!grab->capture(1000))
+        return nullptr;
+
+    return grab;
+}
+
+static bool saveBox(COutputGrab& grab, int32_t x, int32_t y, int32_t w, int32_t h, const std::string& path) {
+    const auto START = CPresentClock::now();
+
+    SRGBImage  image;
+    if (!grab.compose(x, y, w, h, image))
+        return false;
+
+    const auto COMPOSED = CPresentClock::now();
+
+    if (!writePNG(path, image.w, image.h, image.rgb.data(), image.w * 3))
+        return false;
+
+    Debug::log(TRACE, "[screenshot] {}x{}: composed in {:.1f}ms, encoded in {:.1f}ms", image.w, image.h, (COMPOSED - START) / 1000000.0,
+               (CPresentClock::now() - COMPOSED) / 1000000.0);
+
+    return true;
+}
+
+// region as slurp prints it, "x,y wxh" in the global logical space
+static bool saveRegion(COutputGrab& grab, const std::string& region, const std::string& path) {
+    int32_t x = 0, y = 0, w = 0, h = 0;
+    if (sscanf(region.c_str(), "%d,%d %dx%d", &x, &y, &w, &h) != 4 || w <= 0 || h <= 0) {
+        Debug::log(ERR, "[screenshot] can't make sense of region \"{}\"", region);
+        return false;
+    }
+
+    return saveBox(grab, x, y, w, h, path);
+}
+
+// just the window's own buffer, whatever covers it and wherever it is
+static bool saveWindow(zwlr_foreign_toplevel_handle_v1* window, const std::string& path) {
+    const auto MANAGER = (hyprland_toplevel_export_manager_v1*)g_pPortalManager->m_sWaylandConnection.hyprlandToplevelMgr;
+    const auto PHANDLE = g_pPortalManager->m_sHelpers.toplevel->handleFor(window);
+
+    if (!MANAGER || !PHANDLE) {
+        Debug::log(ERR, "[screenshot] can't capture windows: {}", MANAGER ? "the window is gone" : "no hyprland-toplevel-export");
+        return false;
+    }
+
+    const auto  START = CPresentClock::now();
+
+    COutputGrab grab(MANAGER, window, PHANDLE->windowClass(), false);
+    if (!grab.capture(1000))
+        return false;
+
+    Debug::log(LOG, "[screenshot] window {} captured in {:.1f}ms", PHANDLE->windowClass(), (CPresentClock::now() - START) / 1000000.0);
+
+    int32_t x = 0, y = 0, w = 0, h = 0;
+    grab.bounds(x, y, w, h);
+
+    return saveBox(grab, x, y, w, h, path);
+}
+
+// the share picker instead of slurp: a screen, a region of one or a single window
+static void screenshotFromPicker(const std::string& path) {
+    const auto REQUESTED = CPresentClock::now();
+
+    // windows for the list, and their handles have to outlive the capture
+    g_pPortalManager->m_sHelpers.toplevel->activate();
+
+    // screens and regions come out of what was on screen when the request came in, same as with slurp
+    const auto GRAB      = grabOutputs();
+    const auto SELECTION = promptForScreencopySelection();
+    const auto POUTPUT   = g_pPortalManager->getOutputFromName(SELECTION.output);
+
+    switch (SELECTION.type) {
+        case TYPE_WINDOW:
+            if (SELECTION.windowHandle)
+                saveWindow(SELECTION.windowHandle, path);
+            break;
+        case TYPE_OUTPUT:
+            if (!POUTPUT)
+                break;
+            if (!GRAB || !saveBox(*GRAB, POUTPUT->logical.x, POUTPUT->logical.y, POUTPUT->logical.w, POUTPUT->logical.h, path))
+                execAndGet({g_pExecutableCache->resolve("grim"), "-o", POUTPUT->name, path});
+            break;
+        case TYPE_GEOMETRY: {
+            if (!POUTPUT)
+                break;
+            // the picker's regions are relative to their screen
+            const int32_t X = POUTPUT->logical.x + SELECTION.x, Y = POUTPUT->logical.y + SELECTION.y;
+            if (!GRAB || !saveBox(*GRAB, X, Y, SELECTION.w, SELECTION.h, path))
+                execAndGet({g_pExecutableCache->resolve("grim"), "-g", std::format("{},{} {}x{}", X, Y, SELECTION.w, SELECTION.h), path});
+            break;
+        }
+        default: Debug::log(LOG, "[screenshot] nothing picked"); break;
+    }
+
+    g_pPortalManager->m_sHelpers.toplevel->deactivate();
+
+    Debug::log(LOG, "[screenshot] picker screenshot took {:.1f}ms", (CPresentClock::now() - REQUESTED) / 1000000.0);
+}
+
+void pickHyprPicker(sdbus::MethodCall& call) {
+    const std::string HYPRPICKER = g_pExecutableCache->resolve("hyprpicker");
+    std::string       rgbColor   = execAndGet({HYPRPICKER, "--format=rgb", "--no-fancy"});
 
     if (rgbColor.size() > 12) {
         Debug::log(ERR, "hyprpicker returned strange output: " + rgbColor);
@@ -51,8 +171,10 @@ void        pickHyprPicker(sdbus::MethodCall& call) {
 }
 
 void pickSlurp(sdbus::MethodCall& call) {
-    const std::string PICK_COLOR_CMD = "grim -g \"$(slurp -p)\" -t ppm -";
-    std::string       ppmColor       = execAndGet(PICK_COLOR_CMD.c_str());
+    const std::string GRIM     = g_pExecutableCache->resolve("grim");
+    const std::string SLURP    = g_pExecutableCache->resolve("slurp");
+    const std::string POINT    = trimNewline(execAndGet({SLURP, "-p"}));
+    std::string       ppmColor = POINT.empty() ? "" : execAndGet({GRIM, "-g", POINT, "-t", "ppm", "-"});
 
     // unify whitespace
     ppmColor = std::regex_replace(ppmColor, std::regex("\\s+"), std::string(" "));
@@ -132,7 +254,12 @@ void CScreenshotPortal::onScreenshot(sdbus::MethodCall& call) {
     Debug::log(LOG, "[screenshot]  | {}", requestHandle.c_str());
     Debug::log(LOG, "[screenshot]  | appid: {}", appID);
 
-    bool isInteractive = options.count("interactive") && options["interactive"].get<bool>() && inShellPath("slurp");
+    static auto* const* PPICKER = (Hyprlang::INT* const*)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screenshot:use_picker")->getDataStaticPtr();
+
+    const bool INTERACTIVE = options.count("interactive") && options["interactive"].get<bool>();
+    // the picker lists windows through the screencopy portal and the toplevel manager
+    const bool USEPICKER     = INTERACTIVE && **PPICKER && g_pPortalManager->m_sPortals.screencopy && g_pPortalManager->m_sHelpers.toplevel;
+    bool       isInteractive = INTERACTIVE && !USEPICKER && inShellPath("slurp");
 
     // make screenshot
 
@@ -142,8 +269,7 @@ void CScreenshotPortal::onScreenshot(sdbus::MethodCall& call) {
     const std::string                               HYPR_DIR             = RUNTIME_DIR ? std::string{RUNTIME_DIR} + "/hypr/" : "/tmp/hypr/";
     const std::string                               SNAP_FILE            = std::format("xdph_screenshot_{:x}.png", rand()); // rand() is good enough
     const std::string                               FILE_PATH            = HYPR_DIR + SNAP_FILE;
-    const std::string                               SNAP_CMD             = "grim '" + FILE_PATH + "'";
-    const std::string                               SNAP_INTERACTIVE_CMD = "grim -g \"$(slurp)\" '" + FILE_PATH + "'";
+    const std::string                               GRIM                 = g_pExecutableCache->resolve("grim");
 
     std::unordered_map<std::string, sdbus::Variant> results;
     results["uri"] = "file://" + FILE_PATH;
@@ -156,10 +282,39 @@ void CScreenshotPortal::onScreenshot(sdbus::MethodCall& call) {
         std::filesystem::remove(lastScreenshot);
     lastScreenshot = FILE_PATH;
 
-    if (isInteractive)
-        execAndGet(SNAP_INTERACTIVE_CMD.c_str());
-    else
-        execAndGet(SNAP_CMD.c_str());
+    if (USEPICKER)
+        screenshotFromPicker(FILE_PATH);
+    else if (isInteractive) {
+        // freeze the screen first, the selection takes seconds and whatever happens meanwhile isn't what was asked for
+        const auto REQUESTED = CPresentClock::now();
+        const auto GRAB      = grabOutputs();
+
+        if (GRAB)
+            Debug::log(LOG, "[screenshot] outputs captured, contents from {:.1f}ms after the request", (int64_t)(GRAB->m_iCapturedNs - REQUESTED) / 1000000.0);
+        else
+            Debug::log(LOG, "[screenshot] couldn't capture the outputs up front, grim will after the selection");
+
+        const auto REGION = trimNewline(execAndGet({g_pExecutableCache->resolve("slurp")}));
+        if (!REGION.empty() && (!GRAB || !saveRegion(*GRAB, REGION, FILE_PATH)))
+            execAndGet({GRIM, "-g", REGION, FILE_PATH});
+
+        Debug::log(LOG, "[screenshot] interactive screenshot took {:.1f}ms", (CPresentClock::now() - REQUESTED) / 1000000.0);
+    } else {
+        // every output at once and composed by their layout here, no grim process in between
+        const auto REQUESTED = CPresentClock::now();
+        const auto GRAB      = grabOutputs();
+
+        int32_t    x = 0, y = 0, w = 0, h = 0;
+        if (GRAB)
+            GRAB->bounds(x, y, w, h);
+
+        if (!GRAB || !saveBox(*GRAB, x, y, w, h, FILE_PATH)) {
+            Debug::log(LOG, "[screenshot] couldn't capture the outputs ourselves, falling back to grim");
+            execAndGet({GRIM, FILE_PATH});
+        }
+
+        Debug::log(LOG, "[screenshot] screenshot took {:.1f}ms", (CPresentClock::now() - REQUESTED) / 1000000.0);
+    }
 
     uint32_t responseCode = std::filesystem::exists(FILE_PATH) ? 0 : 1;
 
@@ -0,0 +1,311 @@
+#include "BufferAllocator.hpp"
+#include "ScreencopyShared.hpp"
+#include "../core/PortalManager.hpp"
+#include "../helpers/Log.hpp"
+
+#include <libdrm/drm_fourcc.h>
+#include <protocols/linux-dmabuf-unstable-v1-protocol.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
+
+// x86_64 and aarch64 (4k granule) default
+constexpr size_t HUGEPAGE_SIZE = 2 * 1024 * 1024;
+
+// --------------- GBM --------------- //
+
+std::unique_ptr<SBuffer> CGBMBufferAllocator::allocate(const SBufferRequest& request) {
+    std::unique_ptr<SBuffer> pBuffer = std::make_unique<SBuffer>();
+
+    pBuffer->isDMABUF  = true;
+    pBuffer->allocator = this;
+    pBuffer->w         = request.w;
+    pBuffer->h         = request.h;
+    pBuffer->fmt       = request.fmt;
+
+    const auto GBMDEVICE = g_pPortalManager->m_sWaylandConnection.gbmDevice;
+    uint32_t   flags     = GBM_BO_USE_RENDERING;
+
+    if (request.modifier != DRM_FORMAT_MOD_INVALID) {
+        uint64_t mod = request.modifier;
+        pBuffer->bo  = gbm_bo_create_with_modifiers2(GBMDEVICE, pBuffer->w, pBuffer->h, pBuffer->fmt, &mod, 1, flags);
+    } else {
+        pBuffer->bo = gbm_bo_create(GBMDEVICE, pBuffer->w, pBuffer->h, pBuffer->fmt, flags);
+    }
+
+    if (!pBuffer->bo) {
+        Debug::log(ERR, "[alloc] Couldn't create a drm buffer");
+        return nullptr;
+    }
+
+    pBuffer->planeCount = gbm_bo_get_plane_count(pBuffer->bo);
+
+    zwp_linux_buffer_params_v1* params = zwp_linux_dmabuf_v1_create_params((zwp_linux_dmabuf_v1*)g_pPortalManager->m_sWaylandConnection.linuxDmabuf);
+    if (!params) {
+        Debug::log(ERR, "[alloc] zwp_linux_dmabuf_v1_create_params failed");
+        gbm_bo_destroy(pBuffer->bo);
+        return nullptr;
+    }
+
+    for (size_t plane = 0; plane < (size_t)pBuffer->planeCount; plane++) {
+        pBuffer->size[plane]   = 0;
+        pBuffer->stride[plane] = gbm_bo_get_stride_for_plane(pBuffer->bo, plane);
+        pBuffer->offset[plane] = gbm_bo_get_offset(pBuffer->bo, plane);
+        uint64_t mod           = gbm_bo_get_modifier(pBuffer->bo);
+        pBuffer->fd[plane]     = gbm_bo_get_fd_for_plane(pBuffer->bo, plane);
+
+        if (pBuffer->fd[plane] < 0) {
+            Debug::log(ERR, "[alloc] gbm_bo_get_fd_for_plane failed");
+            zwp_linux_buffer_params_v1_destroy(params);
+            gbm_bo_destroy(pBuffer->bo);
+            for (size_t plane_tmp = 0; plane_tmp < plane; plane_tmp++) {
+                close(pBuffer->fd[plane_tmp]);
+            }
+            return nullptr;
+        }
+
+        zwp_linux_buffer_params_v1_add(params, pBuffer->fd[plane], plane, pBuffer->offset[plane], pBuffer->stride[plane], mod >> 32, mod & 0xffffffff);
+    }
+
+    pBuffer->wlBuffer = zwp_linux_buffer_params_v1_create_immed(params, pBuffer->w, pBuffer->h, pBuffer->fmt, /* flags */ 0);
+    zwp_linux_buffer_params_v1_destroy(params);
+
+    if (!pBuffer->wlBuffer) {
+        Debug::log(ERR, "[alloc] zwp_linux_buffer_params_v1_create_immed failed");
+        gbm_bo_destroy(pBuffer->bo);
+        for (size_t plane = 0; plane < (size_t)pBuffer->planeCount; plane++) {
+            close(pBuffer->fd[plane]);
+        }
+
+        return nullptr;
+    }
+
+    return pBuffer;
+}
+
+void CGBMBufferAllocator::release(SBuffer* buffer) {
+    gbm_bo_destroy(buffer->bo);
+    wl_buffer_destroy(buffer->wlBuffer);
+    for (int plane = 0; plane < buffer->planeCount; plane++) {
+        close(buffer->fd[plane]);
+    }
+
+    buffer->bo       = nullptr;
+    buffer->wlBuffer = nullptr;
+}
+
+const char* CGBMBufferAllocator::name() const {
+    return "gbm";
+}
+
+// --------------- memfd --------------- //
+
+CMemfdBufferAllocator::CMemfdBufferAllocator(bool hugepages) : m_bHugepages(hugepages) {
+    ;
+}
+
+CMemfdBufferAllocator::~CMemfdBufferAllocator() {
+    destroyPool();
+}
+
+bool CMemfdBufferAllocator::createPool() {
+    m_bHugetlb = false;
+
+    if (m_bHugepages && !m_bHugetlbDisabled) {
+        m_iFD = memfd_create("xdph-shm-huge", MFD_CLOEXEC | MFD_ALLOW_SEALING | MFD_HUGETLB);
+        if (m_iFD < 0) {
+            Debug::log(LOG, "[alloc] no MFD_HUGETLB ({}), using THP advice instead", strerror(errno));
+            m_bHugetlbDisabled = true;
+        } else
+            m_bHugetlb = true;
+    }
+
+    if (m_iFD < 0)
+        m_iFD = memfd_create("xdph-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+    if (m_iFD < 0) {
+        Debug::log(ERR, "[alloc] couldn't create a memfd: {}", strerror(errno));
+        return false;
+    }
+
+    // nobody gets to pull pages out from under the compositor's mapping. Growing stays allowed.
+    fcntl(m_iFD, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL);
+
+    m_iAlign = m_bHugetlb ? HUGEPAGE_SIZE : sysconf(_SC_PAGESIZE);
+    m_iSize  = 0;
+
+    return true;
+}
+
+void CMemfdBufferAllocator::destroyPool() {
+    if (m_pPool)
+        wl_shm_pool_destroy(m_pPool);
+    if (m_pMap)
+        munmap(m_pMap, m_iSize);
+    if (m_iFD >= 0)
+        close(m_iFD);
+
+    m_pPool = nullptr;
+    m_pMap  = nullptr;
+    m_iFD   = -1;
+    m_iSize = 0;
+    m_vSlots.clear();
+}
+
+bool CMemfdBufferAllocator::grow(size_t newSize) {
+    const auto BEGIN = std::chrono::steady_clock::now();
+    rusage     usageBefore, usageAfter;
+    getrusage(RUSAGE_SELF, &usageBefore);
+
+    if (ftruncate(m_iFD, newSize) < 0) {
+        Debug::log(ERR, "[alloc] couldn't grow the shm pool to {} bytes: {}", newSize, strerror(errno));
+        return false;
+    }
+
+    // fault everything in now instead of in the middle of the first frame copies. THP has to be advised before the fault,
+    // so that one can't go through MAP_POPULATE.
+    const bool THP = m_bHugepages && !m_bHugetlb;
+    auto       map = (uint8_t*)mmap(nullptr, newSize, PROT_READ | PROT_WRITE, MAP_SHARED | (THP ? 0 : MAP_POPULATE), m_iFD, 0);
+
+    if (map == MAP_FAILED) {
+        // for hugetlb, mapping is what reserves the pages, so it fails here and not with a SIGBUS in the compositor
+        Debug::log(m_bHugetlb ? LOG : ERR, "[alloc] couldn't map the shm pool ({} bytes): {}", newSize, strerror(errno));
+        return false;
+    }
+
+    if (THP) {
+        // shmem THP only kicks in for advised mappings (shmem_enabled=advise)
+        madvise(map, newSize, MADV_HUGEPAGE);
+#ifdef MADV_POPULATE_WRITE
+        if (madvise(map, newSize, MADV_POPULATE_WRITE) < 0)
+#endif
+            madvise(map, newSize, MADV_WILLNEED);
+    }
+
+    if (m_pMap)
+        munmap(m_pMap, m_iSize);
+    m_pMap = map;
+
+    if (!m_pPool)
+        m_pPool = wl_shm_create_pool(g_pPortalManager->m_sWaylandConnection.shm, m_iFD, newSize);
+    else
+        wl_shm_pool_resize(m_pPool, newSize);
+
+    getrusage(RUSAGE_SELF, &usageAfter);
+
+    Debug::log(LOG, "[alloc] {} pool {} -> {} bytes, populated in {:.2f}ms ({} minor faults)", name(), m_iSize, newSize,
+               std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - BEGIN).count() / 1000.0, usageAfter.ru_minflt - usageBefore.ru_minflt);
+
+    m_iSize = newSize;
+    updateSlotMappings();
+
+    return true;
+}
+
+void CMemfdBufferAllocator::updateSlotMappings() {
+    for (auto& s : m_vSlots) {
+        if (s.buffer)
+            s.buffer->map = m_pMap + s.offset;
+    }
+}
+
+std::unique_ptr<SBuffer> CMemfdBufferAllocator::allocate(const SBufferRequest& request) {
+    if (m_iFD < 0 && !createPool())
+        return nullptr;
+
+    auto       slotSize = (request.size + m_iAlign - 1) & ~(m_iAlign - 1);
+    const auto LIVE     = std::count_if(m_vSlots.begin(), m_vSlots.end(), [](const auto& s) { return s.buffer; });
+    auto       slot     = std::find_if(m_vSlots.begin(), m_vSlots.end(), [&](const auto& s) { return !s.buffer && s.size == slotSize; });
+
+    if (slot == m_vSlots.end()) {
+        if (LIVE == 0 && !m_vSlots.empty()) {
+            // frame size changed. Sealed against shrinking, so start over with a fresh pool rather than leave the old slots to rot.
+            Debug::log(LOG, "[alloc] {} pool: buffer size changed, recreating", name());
+            destroyPool();
+            if (!createPool())
+                return nullptr;
+            slotSize = (request.size + m_iAlign - 1) & ~(m_iAlign - 1);
+        }
+
+        // size for the whole set at once, pw adds buffers in a burst and every growth is a remap + a resize roundtrip
+        const size_t NEWSLOTS = request.count > (size_t)LIVE ? request.count - LIVE : 1;
+        const size_t OLDSIZE  = m_iSize;
+
+        if (!grow(m_iSize + NEWSLOTS * slotSize)) {
+            if (!m_bHugetlb)
+                return nullptr;
+
+            m_bHugetlbDisabled = true;
+
+            if (m_vSlots.empty()) {
+                Debug::log(LOG, "[alloc] couldn't reserve hugepages, using THP advice instead");
+                destroyPool();
+                return allocate(request);
+            }
+
+            // the live buffers pin this pool. Leave them be and put the rest on THP, the pool is recreated without hugetlb once
+            // they're all gone.
+            if (!m_pOverflow) {
+                Debug::log(LOG, "[alloc] out of hugepages with {} buffers in use, the rest go on THP", LIVE);
+                m_pOverflow                     = std::make_unique<CMemfdBufferAllocator>(true);
+                m_pOverflow->m_bHugetlbDisabled = true;
+            }
+
+            SBufferRequest overflowRequest = request;
+            overflowRequest.count          = NEWSLOTS;
+            return m_pOverflow->allocate(overflowRequest);
+        }
+
+        for (size_t i = 0; i < NEWSLOTS; ++i) {
+            m_vSlots.emplace_back(SSlot{.offset = OLDSIZE + i * slotSize, .size = slotSize});
+        }
+
+        slot = m_vSlots.end() - NEWSLOTS;
+    }
+
+    std::unique_ptr<SBuffer> pBuffer = std::make_unique<SBuffer>();
+
+    pBuffer->allocator  = this;
+    pBuffer->w          = request.w;
+    pBuffer->h          = request.h;
+    pBuffer->fmt        = request.fmt;
+    pBuffer->planeCount = 1;
+    pBuffer->size[0]    = request.size;
+    pBuffer->stride[0]  = request.stride;
+    pBuffer->offset[0]  = 0;
+    pBuffer->fd[0]      = m_iFD;
+    pBuffer->mapOffset  = slot->offset;
+    pBuffer->map        = m_pMap + slot->offset;
+    pBuffer->mapSize    = request.size;
+    pBuffer->wlBuffer   = wl_shm_pool_create_buffer(m_pPool, slot->offset, request.w, request.h, request.stride, wlSHMFromDrmFourcc(request.fmt));
+
+    if (!pBuffer->wlBuffer) {
+        Debug::log(ERR, "[alloc] wl_shm_pool_create_buffer failed");
+        return nullptr;
+    }
+
+    slot->buffer = pBuffer.get();
+
+    return pBuffer;
+}
+
+void CMemfdBufferAllocator::release(SBuffer* buffer) {
+    wl_buffer_destroy(buffer->wlBuffer);
+
+    for (auto& s : m_vSlots) {
+        if (s.buffer == buffer)
+            s.buffer = nullptr;
+    }
+
+    // the fd and the mapping are the pool's
+    buffer->wlBuffer = nullptr;
+    buffer->fd[0]    = -1;
+    buffer->map      = nullptr;
+}
+
+const char* CMemfdBufferAllocator::name() const {
+    return m_bHugepages ? "memfd-hugepage" : "memfd";
+}
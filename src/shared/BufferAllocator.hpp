@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <vector>
+#include <gbm.h>
+#include <wayland-client.h>
+
+struct pw_buffer;
+class IBufferAllocator;
+
+struct SBuffer {
+    bool              isDMABUF = false;
+    uint32_t          w = 0, h = 0, fmt = 0;
+    int               planeCount = 0;
+
+    int               fd[4];
+    uint32_t          size[4], stride[4], offset[4];
+
+    gbm_bo*           bo = nullptr;
+
+    wl_buffer*        wlBuffer = nullptr;
+    pw_buffer*        pwBuffer = nullptr;
+
+    // our own CPU mapping, if the allocator made one
+    void*             map     = nullptr;
+    size_t            mapSize = 0;
+    // where this buffer starts in fd[0], for buffers sharing a pool
+    size_t            mapOffset  = 0;
+    bool              copiedInto = false; // a frame landed in it, see CPipewireConnection::enqueue
+    uint64_t          contentSeq = 0;     // which of the stream's frames it holds, 0 for none
+    uint64_t          stagingSeq = 0;     // which staging frame it mirrors, see CImageCopyCaptureBackend
+
+    IBufferAllocator* allocator = nullptr;
+};
+
+struct SBufferRequest {
+    uint32_t w = 0, h = 0, fmt = 0; // drm fourcc
+    uint32_t size = 0, stride = 0;  // shm only
+    uint64_t modifier = 0;          // dma only, DRM_FORMAT_MOD_INVALID lets gbm pick
+    uint32_t count    = 1;          // buffers the stream will want in total, pooled allocators size for all of them at once
+};
+
+// Where capture buffers come from. One instance per stream and kind, see CPipewireConnection::allocatorFor.
+class IBufferAllocator {
+  public:
+    virtual ~IBufferAllocator() = default;
+
+    // nullptr on failure. Sets ->allocator.
+    virtual std::unique_ptr<SBuffer> allocate(const SBufferRequest& request) = 0;
+    // frees everything allocate() made, the SBuffer itself stays with the caller
+    virtual void        release(SBuffer* buffer) = 0;
+    virtual const char* name() const             = 0;
+};
+
+class CGBMBufferAllocator : public IBufferAllocator {
+  public:
+    virtual std::unique_ptr<SBuffer> allocate(const SBufferRequest& request);
+    virtual void                     release(SBuffer* buffer);
+    virtual const char*              name() const;
+};
+
+// wl_shm buffers carved out of one memfd and one wl_shm_pool, at page aligned offsets. Owned by a single stream.
+// The pool grows (wl_shm_pool_resize) when a stream needs more or bigger buffers and is sealed against shrinking.
+// Pages are faulted in when the pool grows, so the first copy into a buffer doesn't page fault across the whole frame.
+// With hugepages, tries MFD_HUGETLB first and falls back to THP advice on a regular memfd, large frames copy with a lot
+// fewer TLB misses that way. If a hugetlb pool with buffers in use can't grow, the rest come from a THP pool next to it.
+class CMemfdBufferAllocator : public IBufferAllocator {
+  public:
+    CMemfdBufferAllocator(bool hugepages);
+    virtual ~CMemfdBufferAllocator();
+
+    virtual std::unique_ptr<SBuffer> allocate(const SBufferRequest& request);
+    virtual void                     release(SBuffer* buffer);
+    virtual const char*              name() const;
+
+  private:
+    struct SSlot {
+        size_t   offset = 0, size = 0;
+        SBuffer* buffer = nullptr; // nullptr if free
+    };
+
+    bool               createPool();
+    void               destroyPool();
+    bool               grow(size_t newSize);
+    void               updateSlotMappings();
+
+    bool               m_bHugepages       = false;
+    bool               m_bHugetlb         = false; // this pool is on hugetlbfs
+    bool               m_bHugetlbDisabled = false; // no hugetlbfs pages reserved, don't keep trying
+
+    int                m_iFD      = -1;
+    wl_shm_pool*       m_pPool    = nullptr;
+    uint8_t*           m_pMap     = nullptr;
+    size_t             m_iSize    = 0;
+    size_t             m_iAlign   = 0;
+    std::vector<SSlot> m_vSlots;
+
+    // THP pool for what didn't fit into the hugetlb one anymore, its buffers point at it and go back there
+    std::unique_ptr<CMemfdBufferAllocator> m_pOverflow;
+};
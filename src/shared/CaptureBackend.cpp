@@ -0,0 +1,628 @@
+#include "CaptureBackend.hpp"
+#include "BufferAllocator.hpp"
+#include "CursorCapture.hpp"
+#include "../core/PortalManager.hpp"
+#include "../helpers/Log.hpp"
+
+#include <libdrm/drm_fourcc.h>
+#include <algorithm>
+#include <chrono>
+
+// minimized or off every output, nothing changes on screen. Keep consumers fed at a trickle.
+constexpr double HIDDEN_TOPLEVEL_FRAME_INTERVAL_MS = 1000.0;
+
+// --------------- shared event handling --------------- //
+
+static void onSHMInfo(CScreencopyPortal::SSession* pSession, uint32_t drmFormat, uint32_t width, uint32_t height, uint32_t stride) {
+    pSession->sharingData.frameInfoSHM.w      = width;
+    pSession->sharingData.frameInfoSHM.h      = height;
+    pSession->sharingData.frameInfoSHM.fmt    = drmFormat;
+    pSession->sharingData.frameInfoSHM.size   = stride * height;
+    pSession->sharingData.frameInfoSHM.stride = stride;
+}
+
+static void onDMAInfo(CScreencopyPortal::SSession* pSession, uint32_t drmFormat, uint32_t width, uint32_t height) {
+    pSession->sharingData.frameInfoDMA.w   = width;
+    pSession->sharingData.frameInfoDMA.h   = height;
+    pSession->sharingData.frameInfoDMA.fmt = drmFormat;
+}
+
+static void onDamage(CScreencopyPortal::SSession* pSession, uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
+    if (pSession->sharingData.damageCount > 3) {
+        pSession->sharingData.damage[0] = {0, 0, pSession->sharingData.frameInfoDMA.w, pSession->sharingData.frameInfoDMA.h};
+        return;
+    }
+
+    pSession->sharingData.damage[pSession->sharingData.damageCount++] = {x, y, width, height};
+
+    Debug::log(TRACE, "[sc] damage: {} {} {} {}", x, y, width, height);
+}
+
+static void onTimestamp(CScreencopyPortal::SSession* pSession, uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec) {
+    pSession->sharingData.tvSec         = ((((uint64_t)tv_sec_hi) << 32) + (uint64_t)tv_sec_lo);
+    pSession->sharingData.tvNsec        = tv_nsec;
+    pSession->sharingData.tvTimestampNs = pSession->sharingData.tvSec * SPA_NSEC_PER_SEC + pSession->sharingData.tvNsec;
+
+    Debug::log(TRACE, "[sc] frame timestamp sec: {} nsec: {} combined: {}ns", pSession->sharingData.tvSec, pSession->sharingData.tvNsec, pSession->sharingData.tvTimestampNs);
+}
+
+// --------------- wlr-screencopy --------------- //
+
+static void wlrOnBuffer(void* data, zwlr_screencopy_frame_v1* frame, uint32_t format, uint32_t width, uint32_t height, uint32_t stride) {
+    const auto PBACKEND = (CWlrScreencopyBackend*)data;
+
+    Debug::log(TRACE, "[sc] wlrOnBuffer for {}", (void*)PBACKEND->m_pSession);
+
+    onSHMInfo(PBACKEND->m_pSession, drmFourccFromSHM((wl_shm_format)format), width, height, stride);
+
+    // todo: done if ver < 3
+}
+
+static void wlrOnFlags(void* data, zwlr_screencopy_frame_v1* frame, uint32_t flags) {
+    const auto PBACKEND = (CWlrScreencopyBackend*)data;
+
+    Debug::log(TRACE, "[sc] wlrOnFlags for {}", (void*)PBACKEND->m_pSession);
+
+    // todo: maybe check for y invert?
+}
+
+static void wlrOnReady(void* data, zwlr_screencopy_frame_v1* frame, uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec) {
+    const auto PBACKEND = (CWlrScreencopyBackend*)data;
+
+    Debug::log(TRACE, "[sc] wlrOnReady for {}", (void*)PBACKEND->m_pSession);
+
+    onTimestamp(PBACKEND->m_pSession, tv_sec_hi, tv_sec_lo, tv_nsec);
+
+    PBACKEND->cancel();
+    g_pPortalManager->m_sPortals.screencopy->onFrameReady(PBACKEND->m_pSession);
+}
+
+static void wlrOnFailed(void* data, zwlr_screencopy_frame_v1* frame) {
+    const auto PBACKEND = (CWlrScreencopyBackend*)data;
+
+    Debug::log(TRACE, "[sc] wlrOnFailed for {}", (void*)PBACKEND->m_pSession);
+
+    PBACKEND->cancel();
+    g_pPortalManager->m_sPortals.screencopy->onFrameFailed(PBACKEND->m_pSession, true);
+}
+
+static void wlrOnDamage(void* data, zwlr_screencopy_frame_v1* frame, uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
+    const auto PBACKEND = (CWlrScreencopyBackend*)data;
+
+    onDamage(PBACKEND->m_pSession, x, y, width, height);
+}
+
+static void wlrOnDmabuf(void* data, zwlr_screencopy_frame_v1* frame, uint32_t format, uint32_t width, uint32_t height) {
+    const auto PBACKEND = (CWlrScreencopyBackend*)data;
+
+    Debug::log(TRACE, "[sc] wlrOnDmabuf for {}", (void*)PBACKEND->m_pSession);
+
+    onDMAInfo(PBACKEND->m_pSession, format, width, height);
+}
+
+static void wlrOnBufferDone(void* data, zwlr_screencopy_frame_v1* frame) {
+    const auto PBACKEND = (CWlrScreencopyBackend*)data;
+
+    Debug::log(TRACE, "[sc] wlrOnBufferDone for {}", (void*)PBACKEND->m_pSession);
+
+    g_pPortalManager->m_sPortals.screencopy->onFrameConstraints(PBACKEND->m_pSession, true);
+}
+
+static const zwlr_screencopy_frame_v1_listener wlrFrameListener = {
+    .buffer       = wlrOnBuffer,
+    .flags        = wlrOnFlags,
+    .ready        = wlrOnReady,
+    .failed       = wlrOnFailed,
+    .damage       = wlrOnDamage,
+    .linux_dmabuf = wlrOnDmabuf,
+    .buffer_done  = wlrOnBufferDone,
+};
+
+CWlrScreencopyBackend::CWlrScreencopyBackend(CScreencopyPortal::SSession* session, zwlr_screencopy_manager_v1* manager) : m_pSession(session), m_pManager(manager) {
+    ;
+}
+
+CWlrScreencopyBackend::~CWlrScreencopyBackend() {
+    cancel();
+}
+
+bool CWlrScreencopyBackend::requestFrame() {
+    const auto POUTPUT = g_pPortalManager->getOutputFromName(m_pSession->selection.output);
+
+    if (!POUTPUT) {
+        Debug::log(ERR, "[screencopy] Output {} not found??", m_pSession->selection.output);
+        return false;
+    }
+
+    if (m_pSession->selection.type == TYPE_GEOMETRY)
+        m_pFrame = zwlr_screencopy_manager_v1_capture_output_region(m_pManager, m_pSession->cursorMode, POUTPUT->output, m_pSession->selection.x, m_pSession->selection.y,
+                                                                    m_pSession->selection.w, m_pSession->selection.h);
+    else
+        m_pFrame = zwlr_screencopy_manager_v1_capture_output(m_pManager, m_pSession->cursorMode, POUTPUT->output);
+
+    m_pSession->sharingData.transform = POUTPUT->transform;
+
+    zwlr_screencopy_frame_v1_add_listener(m_pFrame, &wlrFrameListener, this);
+
+    return true;
+}
+
+void CWlrScreencopyBackend::copy(SBuffer* buffer, bool fullDamage) {
+    // with damage, the compositor waits for the output to change instead of handing us the same picture again
+    if (fullDamage)
+        zwlr_screencopy_frame_v1_copy(m_pFrame, buffer->wlBuffer);
+    else
+        zwlr_screencopy_frame_v1_copy_with_damage(m_pFrame, buffer->wlBuffer);
+}
+
+void CWlrScreencopyBackend::cancel() {
+    if (m_pFrame)
+        zwlr_screencopy_frame_v1_destroy(m_pFrame);
+    m_pFrame = nullptr;
+}
+
+bool CWlrScreencopyBackend::busy() const {
+    return m_pFrame;
+}
+
+const char* CWlrScreencopyBackend::name() const {
+    return "wlr-screencopy";
+}
+
+// --------------- hyprland-toplevel-export --------------- //
+
+static void hlOnBuffer(void* data, hyprland_toplevel_export_frame_v1* frame, uint32_t format, uint32_t width, uint32_t height, uint32_t stride) {
+    const auto PBACKEND = (CToplevelExportBackend*)data;
+
+    Debug::log(TRACE, "[sc] hlOnBuffer for {}", (void*)PBACKEND->m_pSession);
+
+    onSHMInfo(PBACKEND->m_pSession, drmFourccFromSHM((wl_shm_format)format), width, height, stride);
+
+    // todo: done if ver < 3
+}
+
+static void hlOnFlags(void* data, hyprland_toplevel_export_frame_v1* frame, uint32_t flags) {
+    const auto PBACKEND = (CToplevelExportBackend*)data;
+
+    Debug::log(TRACE, "[sc] hlOnFlags for {}", (void*)PBACKEND->m_pSession);
+
+    // todo: maybe check for y invert?
+}
+
+static void hlOnReady(void* data, hyprland_toplevel_export_frame_v1* frame, uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec) {
+    const auto PBACKEND = (CToplevelExportBackend*)data;
+
+    Debug::log(TRACE, "[sc] hlOnReady for {}", (void*)PBACKEND->m_pSession);
+
+    onTimestamp(PBACKEND->m_pSession, tv_sec_hi, tv_sec_lo, tv_nsec);
+
+    PBACKEND->cancel();
+    g_pPortalManager->m_sPortals.screencopy->onFrameReady(PBACKEND->m_pSession);
+}
+
+static void hlOnFailed(void* data, hyprland_toplevel_export_frame_v1* frame) {
+    const auto PBACKEND = (CToplevelExportBackend*)data;
+
+    Debug::log(TRACE, "[sc] hlOnFailed for {}", (void*)PBACKEND->m_pSession);
+
+    PBACKEND->cancel();
+    g_pPortalManager->m_sPortals.screencopy->onFrameFailed(PBACKEND->m_pSession, true);
+}
+
+static void hlOnDamage(void* data, hyprland_toplevel_export_frame_v1* frame, uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
+    const auto PBACKEND = (CToplevelExportBackend*)data;
+
+    onDamage(PBACKEND->m_pSession, x, y, width, height);
+}
+
+static void hlOnDmabuf(void* data, hyprland_toplevel_export_frame_v1* frame, uint32_t format, uint32_t width, uint32_t height) {
+    const auto PBACKEND = (CToplevelExportBackend*)data;
+
+    Debug::log(TRACE, "[sc] hlOnDmabuf for {}", (void*)PBACKEND->m_pSession);
+
+    onDMAInfo(PBACKEND->m_pSession, format, width, height);
+}
+
+static void hlOnBufferDone(void* data, hyprland_toplevel_export_frame_v1* frame) {
+    const auto PBACKEND = (CToplevelExportBackend*)data;
+
+    Debug::log(TRACE, "[sc] hlOnBufferDone for {}", (void*)PBACKEND->m_pSession);
+
+    g_pPortalManager->m_sPortals.screencopy->onFrameConstraints(PBACKEND->m_pSession, true);
+}
+
+static const hyprland_toplevel_export_frame_v1_listener hyprlandFrameListener = {
+    .buffer       = hlOnBuffer,
+    .damage       = hlOnDamage,
+    .flags        = hlOnFlags,
+    .ready        = hlOnReady,
+    .failed       = hlOnFailed,
+    .linux_dmabuf = hlOnDmabuf,
+    .buffer_done  = hlOnBufferDone,
+};
+
+CToplevelExportBackend::CToplevelExportBackend(CScreencopyPortal::SSession* session, hyprland_toplevel_export_manager_v1* manager) : m_pSession(session), m_pManager(manager) {
+    ;
+}
+
+CToplevelExportBackend::~CToplevelExportBackend() {
+    cancel();
+}
+
+bool CToplevelExportBackend::requestFrame() {
+    if (!m_pSession->selection.windowHandle) {
+        Debug::log(ERR, "[screencopy] selected invalid window?");
+        return false;
+    }
+
+    m_pFrame = hyprland_toplevel_export_manager_v1_capture_toplevel_with_wlr_toplevel_handle(m_pManager, m_pSession->cursorMode, m_pSession->selection.windowHandle);
+    m_pSession->sharingData.transform = WL_OUTPUT_TRANSFORM_NORMAL;
+
+    hyprland_toplevel_export_frame_v1_add_listener(m_pFrame, &hyprlandFrameListener, this);
+
+    return true;
+}
+
+void CToplevelExportBackend::copy(SBuffer* buffer, bool fullDamage) {
+    hyprland_toplevel_export_frame_v1_copy(m_pFrame, buffer->wlBuffer, fullDamage);
+}
+
+void CToplevelExportBackend::cancel() {
+    if (m_pFrame)
+        hyprland_toplevel_export_frame_v1_destroy(m_pFrame);
+    m_pFrame = nullptr;
+}
+
+bool CToplevelExportBackend::busy() const {
+    return m_pFrame;
+}
+
+const char* CToplevelExportBackend::name() const {
+    return "hyprland-toplevel-export";
+}
+
+double CToplevelExportBackend::minFrameIntervalMs() {
+    const auto PTOPLEVEL = g_pPortalManager->m_sHelpers.toplevel ? g_pPortalManager->m_sHelpers.toplevel->handleFor(m_pSession->selection.windowHandle) : nullptr;
+    const bool HIDDEN    = PTOPLEVEL && (PTOPLEVEL->minimized || PTOPLEVEL->outputs.empty());
+
+    if (HIDDEN != m_bThrottled) {
+        Debug::log(LOG, "[screencopy] window for {} is {}, {}", (void*)m_pSession, HIDDEN ? "hidden" : "visible again", HIDDEN ? "throttling" : "back to full rate");
+        m_bThrottled = HIDDEN;
+    }
+
+    return HIDDEN ? HIDDEN_TOPLEVEL_FRAME_INTERVAL_MS : 0;
+}
+
+// --------------- ext-image-copy-capture --------------- //
+
+static void extOnBufferSize(void* data, ext_image_copy_capture_session_v1* session, uint32_t width, uint32_t height) {
+    const auto PBACKEND = (CImageCopyCaptureBackend*)data;
+
+    Debug::log(TRACE, "[sc] extOnBufferSize for {}: {}x{}", (void*)PBACKEND->m_pSession, width, height);
+
+    PBACKEND->m_pSession->sharingData.frameInfoSHM.w = width;
+    PBACKEND->m_pSession->sharingData.frameInfoSHM.h = height;
+    PBACKEND->m_pSession->sharingData.frameInfoDMA.w = width;
+    PBACKEND->m_pSession->sharingData.frameInfoDMA.h = height;
+}
+
+static void extOnSHMFormat(void* data, ext_image_copy_capture_session_v1* session, uint32_t format) {
+    const auto PBACKEND = (CImageCopyCaptureBackend*)data;
+
+    // the only two wl_shm formats that aren't their own drm fourcc
+    const uint32_t DRMFMT = format == WL_SHM_FORMAT_ARGB8888 ? DRM_FORMAT_ARGB8888 : (format == WL_SHM_FORMAT_XRGB8888 ? DRM_FORMAT_XRGB8888 : format);
+
+    Debug::log(TRACE, "[sc] extOnSHMFormat for {}: {}", (void*)PBACKEND->m_pSession, DRMFMT);
+
+    if (PBACKEND->m_bGotSHMFormat || bytesPerPixelFromDrmFourcc(DRMFMT) == 0)
+        return;
+
+    PBACKEND->m_bGotSHMFormat                         = true;
+    PBACKEND->m_pSession->sharingData.frameInfoSHM.fmt = DRMFMT;
+}
+
+static void extOnDmabufDevice(void* data, ext_image_copy_capture_session_v1* session, wl_array* device) {
+    // we allocate on the main device from the linux-dmabuf feedback already
+    ;
+}
+
+static void extOnDmabufFormat(void* data, ext_image_copy_capture_session_v1* session, uint32_t format, wl_array* modifiers) {
+    const auto PBACKEND = (CImageCopyCaptureBackend*)data;
+
+    Debug::log(TRACE, "[sc] extOnDmabufFormat for {}: {}", (void*)PBACKEND->m_pSession, format);
+
+    if (PBACKEND->m_bGotDMAFormat || bytesPerPixelFromDrmFourcc(format) == 0)
+        return;
+
+    PBACKEND->m_bGotDMAFormat                         = true;
+    PBACKEND->m_pSession->sharingData.frameInfoDMA.fmt = format;
+}
+
+static void extOnDone(void* data, ext_image_copy_capture_session_v1* session) {
+    const auto PBACKEND = (CImageCopyCaptureBackend*)data;
+
+    PBACKEND->onConstraintsDone();
+}
+
+static void extOnStopped(void* data, ext_image_copy_capture_session_v1* session) {
+    const auto PBACKEND = (CImageCopyCaptureBackend*)data;
+
+    Debug::log(LOG, "[sc] ext capture session for {} stopped by the compositor", (void*)PBACKEND->m_pSession);
+
+    PBACKEND->stop();
+    PBACKEND->m_pSession->sharingData.status = FRAME_NONE;
+}
+
+static const ext_image_copy_capture_session_v1_listener extSessionListener = {
+    .buffer_size   = extOnBufferSize,
+    .shm_format    = extOnSHMFormat,
+    .dmabuf_device = extOnDmabufDevice,
+    .dmabuf_format = extOnDmabufFormat,
+    .done          = extOnDone,
+    .stopped       = extOnStopped,
+};
+
+static void extOnTransform(void* data, ext_image_copy_capture_frame_v1* frame, uint32_t transform) {
+    const auto PBACKEND = (CImageCopyCaptureBackend*)data;
+
+    PBACKEND->m_pSession->sharingData.transform = (wl_output_transform)transform;
+}
+
+static void extOnDamage(void* data, ext_image_copy_capture_frame_v1* frame, int32_t x, int32_t y, int32_t width, int32_t height) {
+    const auto PBACKEND = (CImageCopyCaptureBackend*)data;
+
+    onDamage(PBACKEND->m_pSession, x, y, width, height);
+
+    if (PBACKEND->m_bStagingFrame)
+        PBACKEND->m_cDamageRing.add({(uint32_t)x, (uint32_t)y, (uint32_t)width, (uint32_t)height});
+}
+
+static void extOnPresentationTime(void* data, ext_image_copy_capture_frame_v1* frame, uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec) {
+    const auto PBACKEND = (CImageCopyCaptureBackend*)data;
+
+    onTimestamp(PBACKEND->m_pSession, tv_sec_hi, tv_sec_lo, tv_nsec);
+}
+
+static void extOnReady(void* data, ext_image_copy_capture_frame_v1* frame) {
+    const auto PBACKEND = (CImageCopyCaptureBackend*)data;
+
+    Debug::log(TRACE, "[sc] extOnReady for {}", (void*)PBACKEND->m_pSession);
+
+    if (PBACKEND->m_bStagingFrame)
+        PBACKEND->onStagingReady();
+
+    if (PBACKEND->m_pCursor && PBACKEND->m_pBuffer) {
+        for (const auto& r : PBACKEND->m_pCursor->paint(PBACKEND->m_pBuffer, true)) {
+            onDamage(PBACKEND->m_pSession, r.x, r.y, r.w, r.h);
+        }
+    }
+
+    PBACKEND->cancel();
+    g_pPortalManager->m_sPortals.screencopy->onFrameReady(PBACKEND->m_pSession);
+}
+
+static void extOnFailed(void* data, ext_image_copy_capture_frame_v1* frame, uint32_t reason) {
+    const auto PBACKEND = (CImageCopyCaptureBackend*)data;
+
+    Debug::log(TRACE, "[sc] extOnFailed for {}: reason {}", (void*)PBACKEND->m_pSession, reason);
+
+    // whatever made it into the staging buffer is undefined now
+    if (PBACKEND->m_bStagingFrame)
+        PBACKEND->m_bStagingValid = false;
+
+    PBACKEND->cancel();
+
+    // the new constraints come (or came) with a done, have the stream checked against them on the next frame
+    if (reason == EXT_IMAGE_COPY_CAPTURE_FRAME_V1_FAILURE_REASON_BUFFER_CONSTRAINTS)
+        PBACKEND->m_pSession->sharingData.formatChecked = false;
+
+    // stopped: session.stopped follows
+    g_pPortalManager->m_sPortals.screencopy->onFrameFailed(PBACKEND->m_pSession, reason != EXT_IMAGE_COPY_CAPTURE_FRAME_V1_FAILURE_REASON_STOPPED);
+}
+
+static const ext_image_copy_capture_frame_v1_listener extFrameListener = {
+    .transform         = extOnTransform,
+    .damage            = extOnDamage,
+    .presentation_time = extOnPresentationTime,
+    .ready             = extOnReady,
+    .failed            = extOnFailed,
+};
+
+CImageCopyCaptureBackend::CImageCopyCaptureBackend(CScreencopyPortal::SSession* session, ext_image_copy_capture_manager_v1* manager,
+                                                   ext_output_image_capture_source_manager_v1* sourceManager) :
+    m_pSession(session), m_pManager(manager), m_pSourceManager(sourceManager) {
+    ;
+}
+
+CImageCopyCaptureBackend::~CImageCopyCaptureBackend() {
+    stop();
+}
+
+bool CImageCopyCaptureBackend::requestFrame() {
+    if (!m_pCaptureSession) {
+        const auto POUTPUT = g_pPortalManager->getOutputFromName(m_pSession->selection.output);
+
+        if (!POUTPUT) {
+            Debug::log(ERR, "[screencopy] Output {} not found??", m_pSession->selection.output);
+            return false;
+        }
+
+        // the frames themselves never carry the cursor then, it is painted in by us and moving it costs no copy
+        const auto POINTER = g_pPortalManager->m_sWaylandConnection.pointer;
+        const bool SOFTWARECURSOR =
+            (m_pSession->cursorMode & EMBEDDED) && POINTER && std::any_cast<Hyprlang::INT>(g_pPortalManager->m_sConfig.config->getConfigValue("screencopy:software_cursor"));
+
+        m_pSource         = ext_output_image_capture_source_manager_v1_create_source(m_pSourceManager, POUTPUT->output);
+        m_pCaptureSession = ext_image_copy_capture_manager_v1_create_session(
+            m_pManager, m_pSource, (m_pSession->cursorMode & EMBEDDED) && !SOFTWARECURSOR ? EXT_IMAGE_COPY_CAPTURE_MANAGER_V1_OPTIONS_PAINT_CURSORS : 0);
+        ext_image_copy_capture_session_v1_add_listener(m_pCaptureSession, &extSessionListener, this);
+        m_pSession->sharingData.transform = POUTPUT->transform;
+
+        if (SOFTWARECURSOR)
+            m_pCursor = std::make_unique<CCursorCapture>(m_pManager, m_pSource, POINTER,
+                                                         [this]() { g_pPortalManager->m_sPortals.screencopy->queueNextShareFrame(m_pSession); });
+
+        Debug::log(LOG, "[screencopy] capturing {} through ext-image-copy-capture{}", m_pSession->selection.output, SOFTWARECURSOR ? ", cursor painted by us" : "");
+    }
+
+    if (!m_bConstraintsKnown) {
+        m_bPendingFrame = true;
+        return true;
+    }
+
+    g_pPortalManager->m_sPortals.screencopy->onFrameConstraints(m_pSession, std::exchange(m_bConstraintsChanged, false));
+
+    return true;
+}
+
+void CImageCopyCaptureBackend::onConstraintsDone() {
+    auto& shm = m_pSession->sharingData.frameInfoSHM;
+
+    // a frame in flight may still be writing into it, stagingFor reallocates on the next copy if the size changed
+    m_bStagingValid = false;
+
+    if (!m_bGotDMAFormat)
+        m_pSession->sharingData.frameInfoDMA.fmt = DRM_FORMAT_INVALID;
+
+    shm.stride = shm.w * bytesPerPixelFromDrmFourcc(shm.fmt);
+    shm.size   = shm.stride * shm.h;
+
+    Debug::log(LOG, "[sc] ext constraints for {}: {}x{}, shm format {}, dma format {}", (void*)m_pSession, shm.w, shm.h, shm.fmt, m_pSession->sharingData.frameInfoDMA.fmt);
+
+    m_bConstraintsKnown   = true;
+    m_bConstraintsChanged = true;
+    m_bGotSHMFormat       = false;
+    m_bGotDMAFormat       = false;
+
+    if (!std::exchange(m_bPendingFrame, false))
+        return;
+
+    m_bConstraintsChanged = false;
+    g_pPortalManager->m_sPortals.screencopy->onFrameConstraints(m_pSession, true);
+}
+
+void CImageCopyCaptureBackend::copy(SBuffer* buffer, bool fullDamage) {
+    const auto PSTAGING = stagingFor(buffer);
+
+    m_pBuffer       = buffer;
+    m_bStagingFrame = PSTAGING;
+    m_pFrame        = ext_image_copy_capture_session_v1_create_frame(m_pCaptureSession);
+    ext_image_copy_capture_frame_v1_add_listener(m_pFrame, &extFrameListener, this);
+    ext_image_copy_capture_frame_v1_attach_buffer(m_pFrame, PSTAGING ? PSTAGING->wlBuffer : buffer->wlBuffer);
+
+    if (PSTAGING)
+        m_cDamageRing.beginFrame();
+
+    // our pw buffers rotate, none of them holds the previous frame. Have it all redrawn. The staging buffer does, once it has one.
+    if (!PSTAGING || !m_bStagingValid || fullDamage) {
+        ext_image_copy_capture_frame_v1_damage_buffer(m_pFrame, 0, 0, buffer->w, buffer->h);
+        if (PSTAGING)
+            m_cDamageRing.addFull(buffer->w, buffer->h);
+    }
+
+    ext_image_copy_capture_frame_v1_capture(m_pFrame);
+}
+
+SBuffer* CImageCopyCaptureBackend::stagingFor(const SBuffer* target) {
+    static auto* const* PSHMSTAGING = (Hyprlang::INT* const*)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:shm_staging")->getDataStaticPtr();
+
+    if (!**PSHMSTAGING || target->isDMABUF || !target->map)
+        return nullptr;
+
+    if (m_pStaging && (m_pStaging->w != target->w || m_pStaging->h != target->h || m_pStaging->fmt != target->fmt))
+        dropStaging();
+
+    if (!m_pStaging) {
+        if (!m_pStagingAllocator)
+            m_pStagingAllocator = std::make_unique<CMemfdBufferAllocator>(true);
+
+        m_pStaging = m_pStagingAllocator->allocate(SBufferRequest{.w = target->w, .h = target->h, .fmt = target->fmt, .size = target->size[0], .stride = target->stride[0]});
+
+        if (!m_pStaging) {
+            Debug::log(ERR, "[sc] couldn't allocate a staging buffer for {}, copying whole frames", (void*)m_pSession);
+            return nullptr;
+        }
+
+        Debug::log(LOG, "[sc] staging buffer for {}: {}x{}, {} bytes", (void*)m_pSession, target->w, target->h, target->size[0]);
+    }
+
+    return m_pStaging.get();
+}
+
+void CImageCopyCaptureBackend::onStagingReady() {
+    m_bStagingValid = true;
+
+    std::vector<SCopyRect> rects;
+    if (!m_cDamageRing.since(m_pBuffer->stagingSeq, rects))
+        rects = {SCopyRect{0, 0, m_pBuffer->w, m_pBuffer->h}};
+    else if (m_pCursor) {
+        // our cursor from the last time this buffer went out, the staging buffer never has it
+        const auto OLDCURSOR = m_pCursor->paintedIn(m_pBuffer);
+        if (OLDCURSOR.w > 0 && OLDCURSOR.h > 0)
+            rects.emplace_back(SCopyRect{(uint32_t)OLDCURSOR.x, (uint32_t)OLDCURSOR.y, (uint32_t)OLDCURSOR.w, (uint32_t)OLDCURSOR.h});
+    }
+
+    // the compositor's damage can reach past the buffer on a mode change
+    for (auto& r : rects) {
+        r.x = std::min(r.x, m_pBuffer->w);
+        r.y = std::min(r.y, m_pBuffer->h);
+        r.w = std::min(r.w, m_pBuffer->w - r.x);
+        r.h = std::min(r.h, m_pBuffer->h - r.y);
+    }
+
+    const auto BEGIN = std::chrono::steady_clock::now();
+    const auto BYTES =
+        copyRects((uint8_t*)m_pBuffer->map, m_pBuffer->stride[0], (const uint8_t*)m_pStaging->map, m_pStaging->stride[0], bytesPerPixelFromDrmFourcc(m_pBuffer->fmt), rects);
+    m_pBuffer->stagingSeq = m_cDamageRing.latest();
+
+    Debug::log(TRACE, "[sc] staging copy for {}: {} rects, {} bytes ({:.1f}% of the frame) in {}us", (void*)m_pSession, rects.size(), BYTES,
+               100.0 * BYTES / m_pBuffer->size[0], std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - BEGIN).count());
+}
+
+void CImageCopyCaptureBackend::dropStaging() {
+    if (m_pStaging)
+        m_pStagingAllocator->release(m_pStaging.get());
+
+    m_pStaging.reset();
+    m_bStagingValid = false;
+    m_bStagingFrame = false;
+}
+
+void CImageCopyCaptureBackend::cancel() {
+    if (m_pFrame)
+        ext_image_copy_capture_frame_v1_destroy(m_pFrame);
+    m_pFrame        = nullptr;
+    m_pBuffer       = nullptr;
+    m_bStagingFrame = false;
+    m_bPendingFrame = false;
+}
+
+void CImageCopyCaptureBackend::stop() {
+    cancel();
+
+    // its sessions hang off the source
+    m_pCursor.reset();
+    dropStaging();
+
+    if (m_pCaptureSession)
+        ext_image_copy_capture_session_v1_destroy(m_pCaptureSession);
+    if (m_pSource)
+        ext_image_capture_source_v1_destroy(m_pSource);
+
+    m_pCaptureSession   = nullptr;
+    m_pSource           = nullptr;
+    m_bConstraintsKnown = false;
+}
+
+bool CImageCopyCaptureBackend::busy() const {
+    // the frame object only exists between copy() and ready, a frame waiting on constraints counts too
+    return m_pFrame || m_bPendingFrame;
+}
+
+const char* CImageCopyCaptureBackend::name() const {
+    return "ext-image-copy-capture";
+}
+
+CCursorCapture* CImageCopyCaptureBackend::softwareCursor() {
+    return m_pCursor.get();
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <protocols/wlr-screencopy-unstable-v1-protocol.h>
+#include <protocols/hyprland-toplevel-export-v1-protocol.h>
+#include <protocols/ext-image-capture-source-v1-protocol.h>
+#include <protocols/ext-image-copy-capture-v1-protocol.h>
+#include "../portals/Screencopy.hpp"
+#include "../helpers/RectCopy.hpp"
+
+struct SBuffer;
+class CCursorCapture;
+
+// Where a session's frames come from. Backends only speak their protocol: they ask for a frame, put the buffer constraints
+// into sharingData.frameInfo* and copy when told to. Format checks, renegotiation, dequeueing, retries and pacing belong to
+// the frame state machine (CScreencopyPortal::onFrame*), the same one for all of them.
+class ICaptureBackend {
+  public:
+    virtual ~ICaptureBackend() = default;
+
+    // false if there is nothing to capture. Answered by onFrameConstraints or onFrameFailed.
+    virtual bool        requestFrame() = 0;
+    // answered by onFrameReady or onFrameFailed
+    virtual void        copy(SBuffer* buffer, bool fullDamage) = 0;
+    // drops the frame in flight, if any
+    virtual void        cancel()     = 0;
+    virtual bool        busy() const = 0;
+    virtual const char* name() const = 0;
+
+    // how long frames should at least be apart right now, 0 if the session's framerate is all that matters
+    virtual double minFrameIntervalMs() {
+        return 0;
+    }
+
+    // the cursor painted into this backend's frames by us, see screencopy:software_cursor. nullptr if the compositor does it.
+    virtual CCursorCapture* softwareCursor() {
+        return nullptr;
+    }
+};
+
+// outputs and regions of them, wlr-screencopy. A new frame object and a new set of constraints for every frame.
+class CWlrScreencopyBackend : public ICaptureBackend {
+  public:
+    CWlrScreencopyBackend(CScreencopyPortal::SSession* session, zwlr_screencopy_manager_v1* manager);
+    virtual ~CWlrScreencopyBackend();
+
+    virtual bool                 requestFrame();
+    virtual void                 copy(SBuffer* buffer, bool fullDamage);
+    virtual void                 cancel();
+    virtual bool                 busy() const;
+    virtual const char*          name() const;
+
+    CScreencopyPortal::SSession* m_pSession = nullptr;
+    zwlr_screencopy_frame_v1*    m_pFrame   = nullptr;
+
+  private:
+    zwlr_screencopy_manager_v1* m_pManager = nullptr;
+};
+
+// windows, hyprland-toplevel-export. Same per-frame dance as wlr-screencopy, throttled while the window can't be seen.
+class CToplevelExportBackend : public ICaptureBackend {
+  public:
+    CToplevelExportBackend(CScreencopyPortal::SSession* session, hyprland_toplevel_export_manager_v1* manager);
+    virtual ~CToplevelExportBackend();
+
+    virtual bool                       requestFrame();
+    virtual void                       copy(SBuffer* buffer, bool fullDamage);
+    virtual void                       cancel();
+    virtual bool                       busy() const;
+    virtual const char*                name() const;
+    virtual double                     minFrameIntervalMs();
+
+    CScreencopyPortal::SSession*       m_pSession = nullptr;
+    hyprland_toplevel_export_frame_v1* m_pFrame   = nullptr;
+
+  private:
+    hyprland_toplevel_export_manager_v1* m_pManager   = nullptr;
+    bool                                 m_bThrottled = false;
+};
+
+// outputs, ext-image-copy-capture. One capture session for the whole share, constraints only come again when they change.
+// Shm frames go through a staging buffer that stays with the session, so the compositor only copies what changed into it,
+// and only what changed since a pw buffer last went out is copied on into that buffer (screencopy:shm_staging).
+class CImageCopyCaptureBackend : public ICaptureBackend {
+  public:
+    CImageCopyCaptureBackend(CScreencopyPortal::SSession* session, ext_image_copy_capture_manager_v1* manager, ext_output_image_capture_source_manager_v1* sourceManager);
+    virtual ~CImageCopyCaptureBackend();
+
+    virtual bool                       requestFrame();
+    virtual void                       copy(SBuffer* buffer, bool fullDamage);
+    virtual void                       cancel();
+    virtual bool                       busy() const;
+    virtual const char*                name() const;
+    virtual CCursorCapture*            softwareCursor();
+
+    void                               onConstraintsDone();
+    void                               stop();
+
+    CScreencopyPortal::SSession*       m_pSession = nullptr;
+    ext_image_copy_capture_session_v1* m_pCaptureSession = nullptr;
+    ext_image_copy_capture_frame_v1*   m_pFrame          = nullptr;
+    SBuffer*                           m_pBuffer         = nullptr; // being copied into
+    std::unique_ptr<CCursorCapture>    m_pCursor;
+
+    // the frame in flight goes into m_pStaging, m_pBuffer gets the damage from there on ready.
+    // pw buffers more than STAGING_DAMAGE_FRAMES frames behind get a full copy.
+    static constexpr size_t            STAGING_DAMAGE_FRAMES = 8;
+    bool                               m_bStagingFrame       = false;
+    bool                               m_bStagingValid       = false; // holds the latest frame, the compositor can copy just the damage
+    CDamageRing                        m_cDamageRing{STAGING_DAMAGE_FRAMES};
+
+    void                               onStagingReady();
+    void                               dropStaging();
+
+    bool                               m_bGotSHMFormat = false, m_bGotDMAFormat = false; // first one of each wins, reset on done
+
+  private:
+    ext_image_copy_capture_manager_v1*          m_pManager       = nullptr;
+    ext_output_image_capture_source_manager_v1* m_pSourceManager = nullptr;
+    ext_image_capture_source_v1*                m_pSource        = nullptr;
+
+    bool                                        m_bConstraintsKnown   = false;
+    bool                                        m_bConstraintsChanged = false;
+    bool                                        m_bPendingFrame       = false; // asked for before the constraints came
+
+    std::unique_ptr<CMemfdBufferAllocator>      m_pStagingAllocator;
+    std::unique_ptr<SBuffer>                    m_pStaging;
+
+    SBuffer*                                    stagingFor(const SBuffer* target);
+};
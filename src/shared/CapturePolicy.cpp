@@ -0,0 +1,186 @@
+#include "CapturePolicy.hpp"
+#include "ScreencopyShared.hpp"
+#include "../core/PortalManager.hpp"
+#include "../helpers/Log.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <optional>
+#include <regex>
+#include <vector>
+
+struct SCaptureRule {
+    std::string                         appidRegexStr;
+    std::regex                          appidRegex;
+
+    std::optional<uint32_t>             maxFPS, buffers, buffersMin, pipelineDepth, priority;
+    std::optional<eCaptureMemoryType>   memory;
+    std::optional<eCaptureDamageMode>   damage;
+    std::optional<eCaptureShmAllocator> shm;
+    std::optional<bool>                 constantRate;
+};
+
+// filled while parsing, before g_pPortalManager exists
+static std::vector<SCaptureRule> captureRules;
+
+static std::string trim(const std::string& str) {
+    const auto BEGIN = str.find_first_not_of(" \t");
+    if (BEGIN == std::string::npos)
+        return "";
+    const auto END = str.find_last_not_of(" \t");
+    return str.substr(BEGIN, END - BEGIN + 1);
+}
+
+// the whole string, decimal, no sign. stoul would take "-1" (and wrap it) or "30abc".
+static uint32_t parseCount(const std::string& str) {
+    uint32_t   value     = 0;
+    const auto END       = str.data() + str.size();
+    const auto [PTR, EC] = std::from_chars(str.data(), END, value);
+
+    if (str.empty() || EC != std::errc{} || PTR != END)
+        throw std::invalid_argument(std::format("{} is not a non-negative integer", str));
+
+    return value;
+}
+
+Hyprlang::CParseResult onCaptureRuleKeyword(const char* command, const char* value) {
+    Hyprlang::CParseResult result;
+
+    std::vector<std::string> fields;
+    std::string              rolling = value;
+    while (true) {
+        const auto COMMA = rolling.find(',');
+        fields.push_back(trim(rolling.substr(0, COMMA)));
+        if (COMMA == std::string::npos)
+            break;
+        rolling = rolling.substr(COMMA + 1);
+    }
+
+    if (fields.size() < 2 || fields[0].empty()) {
+        result.setError("capture_rule: expected an app id regex followed by at least one key:value");
+        return result;
+    }
+
+    SCaptureRule rule;
+    rule.appidRegexStr = fields[0];
+
+    try {
+        rule.appidRegex = std::regex(fields[0]);
+    } catch (std::exception& e) {
+        result.setError(std::format("capture_rule: invalid regex {}: {}", fields[0], e.what()).c_str());
+        return result;
+    }
+
+    for (size_t i = 1; i < fields.size(); ++i) {
+        const auto COLON = fields[i].find(':');
+        if (COLON == std::string::npos) {
+            result.setError(std::format("capture_rule: expected key:value, got {}", fields[i]).c_str());
+            return result;
+        }
+
+        const auto KEY = trim(fields[i].substr(0, COLON));
+        const auto VAL = trim(fields[i].substr(COLON + 1));
+
+        try {
+            if (KEY == "max_fps")
+                rule.maxFPS = parseCount(VAL);
+            else if (KEY == "buffers")
+                rule.buffers = parseCount(VAL);
+            else if (KEY == "buffers_min")
+                rule.buffersMin = parseCount(VAL);
+            else if (KEY == "pipeline_depth")
+                rule.pipelineDepth = parseCount(VAL);
+            else if (KEY == "priority")
+                rule.priority = parseCount(VAL);
+            else if (KEY == "memory") {
+                if (VAL == "shm")
+                    rule.memory = CAPTURE_MEMORY_SHM;
+                else if (VAL == "dma")
+                    rule.memory = CAPTURE_MEMORY_DMA;
+                else
+                    throw std::invalid_argument("memory must be shm or dma");
+            } else if (KEY == "damage") {
+                if (VAL == "wait")
+                    rule.damage = CAPTURE_DAMAGE_WAIT;
+                else if (VAL == "full")
+                    rule.damage = CAPTURE_DAMAGE_FULL;
+                else
+                    throw std::invalid_argument("damage must be wait or full");
+            } else if (KEY == "shm") {
+                if (VAL == "auto")
+                    rule.shm = CAPTURE_SHM_AUTO;
+                else if (VAL == "memfd")
+                    rule.shm = CAPTURE_SHM_MEMFD;
+                else if (VAL == "hugepage")
+                    rule.shm = CAPTURE_SHM_HUGEPAGE;
+                else
+                    throw std::invalid_argument("shm must be auto, memfd or hugepage");
+            } else if (KEY == "constant_rate") {
+                if (VAL == "on")
+                    rule.constantRate = true;
+                else if (VAL == "off")
+                    rule.constantRate = false;
+                else
+                    throw std::invalid_argument("constant_rate must be on or off");
+            } else {
+                result.setError(std::format("capture_rule: unknown key {}", KEY).c_str());
+                return result;
+            }
+        } catch (std::exception& e) {
+            result.setError(std::format("capture_rule: bad value for {}: {}", KEY, e.what()).c_str());
+            return result;
+        }
+    }
+
+    captureRules.emplace_back(std::move(rule));
+
+    return result;
+}
+
+SCapturePolicy resolveCapturePolicy(const std::string& appid) {
+    static auto* const* PFPS = (Hyprlang::INT* const*)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:max_fps")->getDataStaticPtr();
+
+    SCapturePolicy      policy;
+    policy.maxFPS        = **PFPS <= 0 ? 0 : **PFPS;
+    policy.buffers       = XDPH_PWR_BUFFERS;
+    policy.buffersMin    = XDPH_PWR_BUFFERS_MIN;
+    policy.pipelineDepth = XDPH_PWR_BUFFERS_MAX;
+
+    for (auto& r : captureRules) {
+        if (!std::regex_search(appid, r.appidRegex))
+            continue;
+
+        Debug::log(LOG, "[policy] appid {} matched rule {}", appid, r.appidRegexStr);
+
+        if (r.maxFPS)
+            policy.maxFPS = *r.maxFPS;
+        if (r.buffers)
+            policy.buffers = *r.buffers;
+        if (r.buffersMin)
+            policy.buffersMin = *r.buffersMin;
+        if (r.pipelineDepth)
+            policy.pipelineDepth = *r.pipelineDepth;
+        if (r.priority)
+            policy.priority = *r.priority;
+        if (r.constantRate)
+            policy.constantRate = *r.constantRate;
+        if (r.memory)
+            policy.memory = *r.memory;
+        if (r.damage)
+            policy.damage = *r.damage;
+        if (r.shm)
+            policy.shm = *r.shm;
+    }
+
+    // pw wants min <= default <= max, and at least one buffer
+    policy.pipelineDepth = std::clamp(policy.pipelineDepth, 1u, (uint32_t)XDPH_PWR_BUFFERS_MAX);
+    policy.buffersMin    = std::clamp(policy.buffersMin, 1u, policy.pipelineDepth);
+    policy.buffers       = std::clamp(policy.buffers, policy.buffersMin, policy.pipelineDepth);
+    policy.priority      = std::max(policy.priority, 1u);
+
+    Debug::log(LOG, "[policy] appid {}: fps {}, buffers {} ({}-{}), memory {}, damage {}, shm {}, priority {}, constant rate {}", appid, policy.maxFPS, policy.buffers,
+               policy.buffersMin, policy.pipelineDepth, policy.memory == CAPTURE_MEMORY_SHM ? "shm" : "dma", policy.damage == CAPTURE_DAMAGE_FULL ? "full" : "wait",
+               policy.shm == CAPTURE_SHM_MEMFD ? "memfd" : (policy.shm == CAPTURE_SHM_HUGEPAGE ? "hugepage" : "auto"), policy.priority, policy.constantRate);
+
+    return policy;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <hyprlang.hpp>
+
+/*
+    Per-application capture rules, e.g.
+
+    capture_rule = ^(org.example.call)$, max_fps:30, buffers:3
+    capture_rule = ^(com.obsproject.Studio)$, max_fps:144, memory:dma, pipeline_depth:8
+    capture_rule = ^(remote-support)$, damage:wait, memory:shm, shm:hugepage
+    capture_rule = ^(org.example.recorder)$, priority:4, constant_rate:on
+
+    priority weighs a session's share of screencopy:max_bandwidth when casts have to slow down, see rebalanceBandwidth.
+    constant_rate keeps frames coming at the full rate on a still screen, re-sending the last one instead of copying it again.
+
+    The first field is a regex matched against the session's app id, the rest are key:value pairs.
+    Later matching rules override earlier ones, per key.
+*/
+
+enum eCaptureMemoryType : uint8_t {
+    CAPTURE_MEMORY_DMA = 0, // prefer dmabuf, fall back to shm
+    CAPTURE_MEMORY_SHM,     // prefer shm, still offer dmabuf
+};
+
+enum eCaptureDamageMode : uint8_t {
+    CAPTURE_DAMAGE_WAIT = 0, // compositor holds the copy until something changed
+    CAPTURE_DAMAGE_FULL,     // copy on every tick, regardless of damage
+};
+
+enum eCaptureShmAllocator : uint8_t {
+    CAPTURE_SHM_AUTO = 0, // hugepages for large frames
+    CAPTURE_SHM_MEMFD,
+    CAPTURE_SHM_HUGEPAGE,
+};
+
+struct SCapturePolicy {
+    uint32_t             maxFPS        = 0; // 0 = output refresh rate
+    uint32_t             buffers       = 0;
+    uint32_t             buffersMin    = 0;
+    uint32_t             pipelineDepth = 0; // max buffers in flight between us and the consumer
+    eCaptureMemoryType   memory        = CAPTURE_MEMORY_DMA;
+    eCaptureDamageMode   damage        = CAPTURE_DAMAGE_WAIT;
+    eCaptureShmAllocator shm           = CAPTURE_SHM_AUTO;
+    uint32_t             priority      = 1;
+    bool                 constantRate  = false;
+};
+
+Hyprlang::CParseResult onCaptureRuleKeyword(const char* command, const char* value);
+SCapturePolicy         resolveCapturePolicy(const std::string& appid);
@@ -0,0 +1,344 @@
+#include "CursorCapture.hpp"
+#include "BufferAllocator.hpp"
+#include "../helpers/Log.hpp"
+
+#include <libdrm/drm_fourcc.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+// --------------- blending --------------- //
+
+// a CPU view of a rect of a buffer. Dmabufs are mapped for just that rect, drivers detile small regions cheaply.
+struct SMappedRect {
+    uint8_t* data   = nullptr;
+    uint32_t stride = 0;
+    void*    gbmMap = nullptr;
+    gbm_bo*  bo     = nullptr;
+};
+
+static bool mapRect(SBuffer* buffer, const CCursorCapture::SRect& rect, SMappedRect& out) {
+    if (!buffer->isDMABUF) {
+        if (!buffer->map)
+            return false;
+
+        out.stride = buffer->stride[0];
+        out.data   = (uint8_t*)buffer->map + (size_t)rect.y * out.stride + (size_t)rect.x * 4;
+        return true;
+    }
+
+    if (!buffer->bo)
+        return false;
+
+    out.bo   = buffer->bo;
+    out.data = (uint8_t*)gbm_bo_map(buffer->bo, rect.x, rect.y, rect.w, rect.h, GBM_BO_TRANSFER_READ_WRITE, &out.stride, &out.gbmMap);
+    return out.data;
+}
+
+static void unmapRect(SMappedRect& mapped) {
+    if (mapped.bo && mapped.gbmMap)
+        gbm_bo_unmap(mapped.bo, mapped.gbmMap);
+}
+
+// premultiplied source over an opaque destination, one row. Plain byte loops over a handful of pixels, the compiler
+// vectorizes them well enough and the rect is a few kilobytes at most.
+static void blendRow(uint8_t* __restrict dst, const uint8_t* __restrict src, uint32_t pixels, bool swapRB) {
+    for (uint32_t i = 0; i < pixels; ++i) {
+        const uint8_t* s   = src + i * 4;
+        uint8_t*       d   = dst + i * 4;
+        const uint32_t INV = 255 - s[3];
+
+        // (x * inv) / 255, rounded, without the division
+        const auto MUL = [INV](uint32_t x) { return (uint8_t)((x * INV + 128 + ((x * INV + 128) >> 8)) >> 8); };
+
+        d[0] = (swapRB ? s[2] : s[0]) + MUL(d[0]);
+        d[1] = s[1] + MUL(d[1]);
+        d[2] = (swapRB ? s[0] : s[2]) + MUL(d[2]);
+    }
+}
+
+// --------------- listeners --------------- //
+
+static void cursorOnEnter(void* data, ext_image_copy_capture_cursor_session_v1* session) {
+    const auto PCURSOR  = (CCursorCapture*)data;
+    PCURSOR->m_bEntered = true;
+    PCURSOR->onMoved();
+}
+
+static void cursorOnLeave(void* data, ext_image_copy_capture_cursor_session_v1* session) {
+    const auto PCURSOR  = (CCursorCapture*)data;
+    PCURSOR->m_bEntered = false;
+    PCURSOR->onMoved();
+}
+
+static void cursorOnPosition(void* data, ext_image_copy_capture_cursor_session_v1* session, int32_t x, int32_t y) {
+    const auto PCURSOR = (CCursorCapture*)data;
+    PCURSOR->m_iX      = x;
+    PCURSOR->m_iY      = y;
+    PCURSOR->onMoved();
+}
+
+static void cursorOnHotspot(void* data, ext_image_copy_capture_cursor_session_v1* session, int32_t x, int32_t y) {
+    const auto PCURSOR   = (CCursorCapture*)data;
+    PCURSOR->m_iHotspotX = x;
+    PCURSOR->m_iHotspotY = y;
+    PCURSOR->onMoved();
+}
+
+static const ext_image_copy_capture_cursor_session_v1_listener cursorSessionListener = {
+    .enter    = cursorOnEnter,
+    .leave    = cursorOnLeave,
+    .position = cursorOnPosition,
+    .hotspot  = cursorOnHotspot,
+};
+
+static void imageOnBufferSize(void* data, ext_image_copy_capture_session_v1* session, uint32_t width, uint32_t height) {
+    const auto PCURSOR        = (CCursorCapture*)data;
+    PCURSOR->m_sConstraints.w = width;
+    PCURSOR->m_sConstraints.h = height;
+}
+
+static void imageOnSHMFormat(void* data, ext_image_copy_capture_session_v1* session, uint32_t format) {
+    // argb8888 is always there, it's what we ask for
+    ;
+}
+
+static void imageOnDmabufDevice(void* data, ext_image_copy_capture_session_v1* session, wl_array* device) {
+    ;
+}
+
+static void imageOnDmabufFormat(void* data, ext_image_copy_capture_session_v1* session, uint32_t format, wl_array* modifiers) {
+    ;
+}
+
+static void imageOnDone(void* data, ext_image_copy_capture_session_v1* session) {
+    const auto PCURSOR = (CCursorCapture*)data;
+    PCURSOR->onConstraintsDone();
+}
+
+static void imageOnStopped(void* data, ext_image_copy_capture_session_v1* session) {
+    Debug::log(LOG, "[cursor] cursor capture session stopped by the compositor");
+}
+
+static const ext_image_copy_capture_session_v1_listener imageSessionListener = {
+    .buffer_size   = imageOnBufferSize,
+    .shm_format    = imageOnSHMFormat,
+    .dmabuf_device = imageOnDmabufDevice,
+    .dmabuf_format = imageOnDmabufFormat,
+    .done          = imageOnDone,
+    .stopped       = imageOnStopped,
+};
+
+static void imageOnTransform(void* data, ext_image_copy_capture_frame_v1* frame, uint32_t transform) {
+    ;
+}
+
+static void imageOnDamage(void* data, ext_image_copy_capture_frame_v1* frame, int32_t x, int32_t y, int32_t width, int32_t height) {
+    ;
+}
+
+static void imageOnPresentationTime(void* data, ext_image_copy_capture_frame_v1* frame, uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec) {
+    ;
+}
+
+static void imageOnReady(void* data, ext_image_copy_capture_frame_v1* frame) {
+    const auto PCURSOR = (CCursorCapture*)data;
+    PCURSOR->onImageReady();
+}
+
+static void imageOnFailed(void* data, ext_image_copy_capture_frame_v1* frame, uint32_t reason) {
+    const auto PCURSOR = (CCursorCapture*)data;
+
+    Debug::log(TRACE, "[cursor] cursor image capture failed: reason {}", reason);
+
+    // new constraints come with a done, which captures again
+    PCURSOR->onImageFailed(reason == EXT_IMAGE_COPY_CAPTURE_FRAME_V1_FAILURE_REASON_UNKNOWN);
+}
+
+static const ext_image_copy_capture_frame_v1_listener imageFrameListener = {
+    .transform         = imageOnTransform,
+    .damage            = imageOnDamage,
+    .presentation_time = imageOnPresentationTime,
+    .ready             = imageOnReady,
+    .failed            = imageOnFailed,
+};
+
+// --------------- CCursorCapture --------------- //
+
+CCursorCapture::CCursorCapture(ext_image_copy_capture_manager_v1* manager, ext_image_capture_source_v1* source, wl_pointer* pointer, std::function<void()> onChanged) :
+    m_fnOnChanged(onChanged) {
+    m_pAllocator     = std::make_unique<CMemfdBufferAllocator>(false);
+    m_pCursorSession = ext_image_copy_capture_manager_v1_create_pointer_cursor_session(manager, source, pointer);
+    ext_image_copy_capture_cursor_session_v1_add_listener(m_pCursorSession, &cursorSessionListener, this);
+
+    m_pCaptureSession = ext_image_copy_capture_cursor_session_v1_get_capture_session(m_pCursorSession);
+    ext_image_copy_capture_session_v1_add_listener(m_pCaptureSession, &imageSessionListener, this);
+}
+
+CCursorCapture::~CCursorCapture() {
+    if (m_pFrame)
+        ext_image_copy_capture_frame_v1_destroy(m_pFrame);
+    if (m_pCaptureSession)
+        ext_image_copy_capture_session_v1_destroy(m_pCaptureSession);
+    if (m_pCursorSession)
+        ext_image_copy_capture_cursor_session_v1_destroy(m_pCursorSession);
+    if (m_pImageBuffer)
+        m_pAllocator->release(m_pImageBuffer.get());
+}
+
+void CCursorCapture::onConstraintsDone() {
+    if (m_pFrame) {
+        ext_image_copy_capture_frame_v1_destroy(m_pFrame);
+        m_pFrame = nullptr;
+    }
+
+    if (m_pImageBuffer && (m_pImageBuffer->w != m_sConstraints.w || m_pImageBuffer->h != m_sConstraints.h)) {
+        m_pAllocator->release(m_pImageBuffer.get());
+        m_pImageBuffer.reset();
+    }
+
+    if (!m_pImageBuffer && m_sConstraints.w && m_sConstraints.h) {
+        const auto W = m_sConstraints.w, H = m_sConstraints.h;
+        m_pImageBuffer = m_pAllocator->allocate(SBufferRequest{.w = W, .h = H, .fmt = DRM_FORMAT_ARGB8888, .size = W * H * 4, .stride = W * 4});
+
+        if (!m_pImageBuffer) {
+            Debug::log(ERR, "[cursor] couldn't allocate a {}x{} cursor buffer", m_sConstraints.w, m_sConstraints.h);
+            return;
+        }
+    }
+
+    captureImage();
+}
+
+void CCursorCapture::captureImage() {
+    if (!m_pImageBuffer || m_pFrame)
+        return;
+
+    m_pFrame = ext_image_copy_capture_session_v1_create_frame(m_pCaptureSession);
+    ext_image_copy_capture_frame_v1_add_listener(m_pFrame, &imageFrameListener, this);
+    ext_image_copy_capture_frame_v1_attach_buffer(m_pFrame, m_pImageBuffer->wlBuffer);
+    ext_image_copy_capture_frame_v1_damage_buffer(m_pFrame, 0, 0, m_pImageBuffer->w, m_pImageBuffer->h);
+    ext_image_copy_capture_frame_v1_capture(m_pFrame);
+}
+
+void CCursorCapture::onImageReady() {
+    ext_image_copy_capture_frame_v1_destroy(m_pFrame);
+    m_pFrame = nullptr;
+
+    if (!m_pImageBuffer->map) {
+        captureImage();
+        return;
+    }
+
+    m_iImageW = m_pImageBuffer->w;
+    m_iImageH = m_pImageBuffer->h;
+    m_vImage.assign((uint8_t*)m_pImageBuffer->map, (uint8_t*)m_pImageBuffer->map + (size_t)m_iImageW * m_iImageH * 4);
+
+    Debug::log(TRACE, "[cursor] new cursor image {}x{}", m_iImageW, m_iImageH);
+
+    onMoved();
+
+    // held by the compositor until the image changes
+    captureImage();
+}
+
+void CCursorCapture::onImageFailed(bool retry) {
+    ext_image_copy_capture_frame_v1_destroy(m_pFrame);
+    m_pFrame = nullptr;
+
+    if (retry)
+        captureImage();
+}
+
+void CCursorCapture::onMoved() {
+    m_bDirty = true;
+    m_fnOnChanged();
+}
+
+bool CCursorCapture::dirty() const {
+    return m_bDirty;
+}
+
+CCursorCapture::SRect CCursorCapture::paintedIn(const SBuffer* buffer) const {
+    const auto IT = m_mUnder.find(buffer);
+    return IT == m_mUnder.end() ? SRect{} : IT->second.rect;
+}
+
+void CCursorCapture::forget(const SBuffer* buffer) {
+    m_mUnder.erase(buffer);
+}
+
+CCursorCapture::SRect CCursorCapture::currentRect(const SBuffer* buffer) const {
+    if (!m_bEntered || m_vImage.empty())
+        return {};
+
+    // clipped to the frame
+    const int32_t X0 = std::clamp(m_iX - m_iHotspotX, 0, (int32_t)buffer->w);
+    const int32_t Y0 = std::clamp(m_iY - m_iHotspotY, 0, (int32_t)buffer->h);
+    const int32_t X1 = std::clamp(m_iX - m_iHotspotX + (int32_t)m_iImageW, 0, (int32_t)buffer->w);
+    const int32_t Y1 = std::clamp(m_iY - m_iHotspotY + (int32_t)m_iImageH, 0, (int32_t)buffer->h);
+
+    return {X0, Y0, X1 - X0, Y1 - Y0};
+}
+
+std::vector<CCursorCapture::SRect> CCursorCapture::paint(SBuffer* buffer, bool fresh) {
+    const auto BEGIN = std::chrono::steady_clock::now();
+    const bool SWAPRB = buffer->fmt == DRM_FORMAT_XBGR8888 || buffer->fmt == DRM_FORMAT_ABGR8888;
+
+    if (buffer->fmt != DRM_FORMAT_XRGB8888 && buffer->fmt != DRM_FORMAT_ARGB8888 && buffer->fmt != DRM_FORMAT_XBGR8888 && buffer->fmt != DRM_FORMAT_ABGR8888) {
+        Debug::log(TRACE, "[cursor] can't blend into format {}, leaving the cursor out", buffer->fmt);
+        return {};
+    }
+
+    std::vector<SRect> changed;
+    size_t             bytes = 0;
+
+    // take off what we drew before. A fresh copy overwrote it already.
+    auto& under = m_mUnder[buffer];
+    if (!fresh && under.rect.w > 0 && under.rect.h > 0) {
+        SMappedRect mapped;
+        if (mapRect(buffer, under.rect, mapped)) {
+            for (int32_t row = 0; row < under.rect.h; ++row) {
+                memcpy(mapped.data + (size_t)row * mapped.stride, under.pixels.data() + (size_t)row * under.rect.w * 4, under.rect.w * 4);
+            }
+            unmapRect(mapped);
+            bytes += under.pixels.size();
+        }
+    }
+
+    const auto RECT = currentRect(buffer);
+    under.rect      = RECT;
+    under.pixels.resize((size_t)RECT.w * RECT.h * 4);
+
+    if (RECT.w > 0 && RECT.h > 0) {
+        SMappedRect mapped;
+        if (mapRect(buffer, RECT, mapped)) {
+            // where the clipped rect starts in the cursor image
+            const int32_t IMAGEX = RECT.x - (m_iX - m_iHotspotX);
+            const int32_t IMAGEY = RECT.y - (m_iY - m_iHotspotY);
+
+            for (int32_t row = 0; row < RECT.h; ++row) {
+                uint8_t* dst = mapped.data + (size_t)row * mapped.stride;
+                memcpy(under.pixels.data() + (size_t)row * RECT.w * 4, dst, RECT.w * 4);
+                blendRow(dst, m_vImage.data() + ((size_t)(IMAGEY + row) * m_iImageW + IMAGEX) * 4, RECT.w, SWAPRB);
+            }
+
+            unmapRect(mapped);
+            bytes += under.pixels.size() * 2;
+        } else
+            under.rect = {};
+    }
+
+    if (m_sLastSent.w > 0 && m_sLastSent.h > 0)
+        changed.emplace_back(m_sLastSent);
+    if (under.rect.w > 0 && under.rect.h > 0)
+        changed.emplace_back(under.rect);
+
+    m_sLastSent = under.rect;
+    m_bDirty    = false;
+
+    Debug::log(TRACE, "[cursor] painted at {},{} ({}x{}) into {} frame, {} bytes touched in {}us", RECT.x, RECT.y, RECT.w, RECT.h, fresh ? "a fresh" : "the latest", bytes,
+               std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - BEGIN).count());
+
+    return changed;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <protocols/ext-image-capture-source-v1-protocol.h>
+#include <protocols/ext-image-copy-capture-v1-protocol.h>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+struct SBuffer;
+class CMemfdBufferAllocator;
+
+// The pointer's cursor over a capture source, captured on its own through an ext-image-copy-capture cursor session and
+// blended into frames that were captured without one. Frames then come out the same for every cursor mode, and a cursor
+// that only moved is two small rects redrawn in-process instead of a new frame from the compositor.
+class CCursorCapture {
+  public:
+    CCursorCapture(ext_image_copy_capture_manager_v1* manager, ext_image_capture_source_v1* source, wl_pointer* pointer, std::function<void()> onChanged);
+    ~CCursorCapture();
+
+    struct SRect {
+        int32_t x = 0, y = 0, w = 0, h = 0;
+    };
+
+    // draws the cursor into a buffer. fresh: the compositor just copied a frame into it, otherwise it holds the latest
+    // frame with our cursor on it from before, which gets restored first. Returns what changed since the last frame sent.
+    std::vector<SRect> paint(SBuffer* buffer, bool fresh);
+    // moved or changed since the last paint
+    bool               dirty() const;
+    // where it was last drawn into a buffer, empty if it isn't in there
+    SRect              paintedIn(const SBuffer* buffer) const;
+    // the buffer is being freed, a new one can get its address
+    void               forget(const SBuffer* buffer);
+
+    // for the listeners
+    void               onConstraintsDone();
+    void               onImageReady();
+    void               onImageFailed(bool retry);
+    void               onMoved();
+
+    struct {
+        uint32_t w = 0, h = 0;
+    } m_sConstraints;
+
+    bool    m_bEntered = false;
+    int32_t m_iX = 0, m_iY = 0, m_iHotspotX = 0, m_iHotspotY = 0;
+
+  private:
+    void                                      captureImage();
+    SRect                                     currentRect(const SBuffer* buffer) const;
+
+    ext_image_copy_capture_cursor_session_v1* m_pCursorSession  = nullptr;
+    ext_image_copy_capture_session_v1*        m_pCaptureSession = nullptr;
+    ext_image_copy_capture_frame_v1*          m_pFrame          = nullptr;
+
+    std::unique_ptr<CMemfdBufferAllocator>    m_pAllocator;
+    std::unique_ptr<SBuffer>                  m_pImageBuffer;
+
+    // premultiplied ARGB8888, what we blend from. Copied out so the next capture can go into the buffer right away.
+    std::vector<uint8_t>                      m_vImage;
+    uint32_t                                  m_iImageW = 0, m_iImageH = 0;
+
+    // what the cursor covered in each buffer we drew it into, to take it off again
+    struct SUnder {
+        SRect                rect;
+        std::vector<uint8_t> pixels;
+    };
+    std::unordered_map<const SBuffer*, SUnder> m_mUnder;
+
+    SRect                                      m_sLastSent; // where the consumer last saw it
+    bool                                       m_bDirty = false;
+
+    std::function<void()>                      m_fnOnChanged;
+};
@@ -0,0 +1,462 @@
+#include "OutputGrab.hpp"
+#include "ScreencopyShared.hpp"
+#include "../core/PortalManager.hpp"
+#include "../helpers/Log.hpp"
+#include "../helpers/PresentClock.hpp"
+
+#include <libdrm/drm_fourcc.h>
+#include <algorithm>
+#include <cmath>
+#include <poll.h>
+#include <thread>
+
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
+// below this, starting threads costs more than it saves. Three 4K outputs are ~75MB of RGB.
+constexpr size_t PARALLEL_MIN_BYTES  = 8 * 1024 * 1024;
+constexpr size_t MAX_COMPOSE_THREADS = 4;
+
+// --------------- listeners --------------- //
+
+// both protocols send the same events, only the frame types differ
+
+static void onFrameBuffer(COutputGrab::SFrame* pFrame, uint32_t format, uint32_t width, uint32_t height, uint32_t stride) {
+    pFrame->fmt     = drmFourccFromSHM((wl_shm_format)format);
+    pFrame->bufferW = width;
+    pFrame->bufferH = height;
+    pFrame->stride  = stride;
+
+    // a window has no place in the layout, it's its own space at its buffer's size
+    if (pFrame->toplevelFrame) {
+        pFrame->w = width;
+        pFrame->h = height;
+    }
+}
+
+static void onFrameReady(COutputGrab::SFrame* pFrame, uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec) {
+    // the compositor's timestamp of the contents, CLOCK_MONOTONIC
+    const uint64_t NS = ((((uint64_t)tv_sec_hi << 32) | tv_sec_lo) * 1000000000ull) + tv_nsec;
+
+    pFrame->done                = true;
+    pFrame->grab->m_iCapturedNs = std::max(pFrame->grab->m_iCapturedNs, NS ? NS : CPresentClock::now());
+}
+
+static void onFrameFailed(COutputGrab::SFrame* pFrame) {
+    Debug::log(ERR, "[grab] capturing {} failed", pFrame->name);
+
+    pFrame->done   = true;
+    pFrame->failed = true;
+}
+
+static void grabOnBuffer(void* data, zwlr_screencopy_frame_v1* frame, uint32_t format, uint32_t width, uint32_t height, uint32_t stride) {
+    const auto PFRAME = (COutputGrab::SFrame*)data;
+
+    onFrameBuffer(PFRAME, format, width, height, stride);
+
+    // before v3 there's no buffer_done, shm is all we get
+    if (zwlr_screencopy_frame_v1_get_version(frame) < 3)
+        PFRAME->grab->onBufferDone(PFRAME);
+}
+
+static void grabOnFlags(void* data, zwlr_screencopy_frame_v1* frame, uint32_t flags) {
+    const auto PFRAME = (COutputGrab::SFrame*)data;
+    PFRAME->yInvert   = flags & ZWLR_SCREENCOPY_FRAME_V1_FLAGS_Y_INVERT;
+}
+
+static void grabOnReady(void* data, zwlr_screencopy_frame_v1* frame, uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec) {
+    onFrameReady((COutputGrab::SFrame*)data, tv_sec_hi, tv_sec_lo, tv_nsec);
+}
+
+static void grabOnFailed(void* data, zwlr_screencopy_frame_v1* frame) {
+    onFrameFailed((COutputGrab::SFrame*)data);
+}
+
+static void grabOnDamage(void* data, zwlr_screencopy_frame_v1* frame, uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
+    ;
+}
+
+static void grabOnDmabuf(void* data, zwlr_screencopy_frame_v1* frame, uint32_t format, uint32_t width, uint32_t height) {
+    ;
+}
+
+static void grabOnBufferDone(void* data, zwlr_screencopy_frame_v1* frame) {
+    const auto PFRAME = (COutputGrab::SFrame*)data;
+    PFRAME->grab->onBufferDone(PFRAME);
+}
+
+static const zwlr_screencopy_frame_v1_listener grabFrameListener = {
+    .buffer       = grabOnBuffer,
+    .flags        = grabOnFlags,
+    .ready        = grabOnReady,
+    .failed       = grabOnFailed,
+    .damage       = grabOnDamage,
+    .linux_dmabuf = grabOnDmabuf,
+    .buffer_done  = grabOnBufferDone,
+};
+
+static void grabOnToplevelBuffer(void* data, hyprland_toplevel_export_frame_v1* frame, uint32_t format, uint32_t width, uint32_t height, uint32_t stride) {
+    onFrameBuffer((COutputGrab::SFrame*)data, format, width, height, stride);
+}
+
+static void grabOnToplevelFlags(void* data, hyprland_toplevel_export_frame_v1* frame, uint32_t flags) {
+    const auto PFRAME = (COutputGrab::SFrame*)data;
+    PFRAME->yInvert   = flags & HYPRLAND_TOPLEVEL_EXPORT_FRAME_V1_FLAGS_Y_INVERT;
+}
+
+static void grabOnToplevelReady(void* data, hyprland_toplevel_export_frame_v1* frame, uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec) {
+    onFrameReady((COutputGrab::SFrame*)data, tv_sec_hi, tv_sec_lo, tv_nsec);
+}
+
+static void grabOnToplevelFailed(void* data, hyprland_toplevel_export_frame_v1* frame) {
+    onFrameFailed((COutputGrab::SFrame*)data);
+}
+
+static void grabOnToplevelDamage(void* data, hyprland_toplevel_export_frame_v1* frame, uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
+    ;
+}
+
+static void grabOnToplevelDmabuf(void* data, hyprland_toplevel_export_frame_v1* frame, uint32_t format, uint32_t width, uint32_t height) {
+    ;
+}
+
+static void grabOnToplevelBufferDone(void* data, hyprland_toplevel_export_frame_v1* frame) {
+    const auto PFRAME = (COutputGrab::SFrame*)data;
+    PFRAME->grab->onBufferDone(PFRAME);
+}
+
+static const hyprland_toplevel_export_frame_v1_listener grabToplevelFrameListener = {
+    .buffer       = grabOnToplevelBuffer,
+    .damage       = grabOnToplevelDamage,
+    .flags        = grabOnToplevelFlags,
+    .ready        = grabOnToplevelReady,
+    .failed       = grabOnToplevelFailed,
+    .linux_dmabuf = grabOnToplevelDmabuf,
+    .buffer_done  = grabOnToplevelBufferDone,
+};
+
+// --------------- pixels --------------- //
+
+// where a pixel of the output as displayed is in its buffer. The inverse of the output's transform, as wlroots does it.
+static void displayToBuffer(wl_output_transform transform, uint32_t dispW, uint32_t dispH, uint32_t x, uint32_t y, uint32_t& bx, uint32_t& by) {
+    switch (transform) {
+        case WL_OUTPUT_TRANSFORM_NORMAL: bx = x, by = y; break;
+        case WL_OUTPUT_TRANSFORM_90: bx = y, by = dispW - x - 1; break; // inverse of 90 is 270
+        case WL_OUTPUT_TRANSFORM_180: bx = dispW - x - 1, by = dispH - y - 1; break;
+        case WL_OUTPUT_TRANSFORM_270: bx = dispH - y - 1, by = x; break;
+        case WL_OUTPUT_TRANSFORM_FLIPPED: bx = dispW - x - 1, by = y; break;
+        case WL_OUTPUT_TRANSFORM_FLIPPED_90: bx = y, by = x; break;
+        case WL_OUTPUT_TRANSFORM_FLIPPED_180: bx = x, by = dispH - y - 1; break;
+        case WL_OUTPUT_TRANSFORM_FLIPPED_270: bx = dispH - y - 1, by = dispW - x - 1; break;
+    }
+}
+
+static bool readableFormat(uint32_t fmt) {
+    switch (fmt) {
+        case DRM_FORMAT_XRGB8888:
+        case DRM_FORMAT_ARGB8888:
+        case DRM_FORMAT_XBGR8888:
+        case DRM_FORMAT_ABGR8888:
+        case DRM_FORMAT_XRGB2101010:
+        case DRM_FORMAT_ARGB2101010:
+        case DRM_FORMAT_XBGR2101010:
+        case DRM_FORMAT_ABGR2101010: return true;
+        default: return false;
+    }
+}
+
+static void toRGB(uint32_t fmt, const uint8_t* px, uint8_t* out) {
+    switch (fmt) {
+        case DRM_FORMAT_XRGB8888:
+        case DRM_FORMAT_ARGB8888:
+            out[0] = px[2];
+            out[1] = px[1];
+            out[2] = px[0];
+            break;
+        case DRM_FORMAT_XBGR8888:
+        case DRM_FORMAT_ABGR8888:
+            out[0] = px[0];
+            out[1] = px[1];
+            out[2] = px[2];
+            break;
+        case DRM_FORMAT_XRGB2101010:
+        case DRM_FORMAT_ARGB2101010: {
+            const uint32_t V = px[0] | (px[1] << 8) | (px[2] << 16) | ((uint32_t)px[3] << 24);
+            out[0]           = (V >> 22) & 0xFF;
+            out[1]           = (V >> 12) & 0xFF;
+            out[2]           = (V >> 2) & 0xFF;
+            break;
+        }
+        case DRM_FORMAT_XBGR2101010:
+        case DRM_FORMAT_ABGR2101010: {
+            const uint32_t V = px[0] | (px[1] << 8) | (px[2] << 16) | ((uint32_t)px[3] << 24);
+            out[0]           = (V >> 2) & 0xFF;
+            out[1]           = (V >> 12) & 0xFF;
+            out[2]           = (V >> 22) & 0xFF;
+            break;
+        }
+        default: break;
+    }
+}
+
+// --------------- COutputGrab --------------- //
+
+COutputGrab::COutputGrab(zwlr_screencopy_manager_v1* manager, const std::vector<SOutput*>& outputs, bool cursor) {
+    m_pQueue = wl_display_create_queue(g_pPortalManager->m_sWaylandConnection.display);
+
+    for (const auto& o : outputs) {
+        if (o->logical.w <= 0 || o->logical.h <= 0) {
+            Debug::log(WARN, "[grab] no logical geometry for {}, leaving it out", o->name);
+            continue;
+        }
+
+        const auto PFRAME = m_vFrames.emplace_back(std::make_unique<SFrame>()).get();
+        PFRAME->grab      = this;
+        PFRAME->name      = o->name;
+        PFRAME->x         = o->logical.x;
+        PFRAME->y         = o->logical.y;
+        PFRAME->w         = o->logical.w;
+        PFRAME->h         = o->logical.h;
+        PFRAME->transform = o->transform;
+
+        // on our queue before anything can arrive for it, the request isn't even flushed yet
+        PFRAME->frame = zwlr_screencopy_manager_v1_capture_output(manager, cursor, o->output);
+        wl_proxy_set_queue((wl_proxy*)PFRAME->frame, m_pQueue);
+        zwlr_screencopy_frame_v1_add_listener(PFRAME->frame, &grabFrameListener, PFRAME);
+    }
+}
+
+COutputGrab::COutputGrab(hyprland_toplevel_export_manager_v1* manager, zwlr_foreign_toplevel_handle_v1* window, const std::string& name, bool cursor) {
+    m_pQueue = wl_display_create_queue(g_pPortalManager->m_sWaylandConnection.display);
+
+    const auto PFRAME = m_vFrames.emplace_back(std::make_unique<SFrame>()).get();
+    PFRAME->grab      = this;
+    PFRAME->name      = name;
+
+    PFRAME->toplevelFrame = hyprland_toplevel_export_manager_v1_capture_toplevel_with_wlr_toplevel_handle(manager, cursor, window);
+    wl_proxy_set_queue((wl_proxy*)PFRAME->toplevelFrame, m_pQueue);
+    hyprland_toplevel_export_frame_v1_add_listener(PFRAME->toplevelFrame, &grabToplevelFrameListener, PFRAME);
+}
+
+COutputGrab::~COutputGrab() {
+    for (auto& f : m_vFrames) {
+        if (f->frame)
+            zwlr_screencopy_frame_v1_destroy(f->frame);
+        if (f->toplevelFrame)
+            hyprland_toplevel_export_frame_v1_destroy(f->toplevelFrame);
+        if (f->buffer)
+            m_allocator.release(f->buffer.get());
+    }
+
+    wl_event_queue_destroy(m_pQueue);
+}
+
+void COutputGrab::onBufferDone(SFrame* pFrame) {
+    if (pFrame->buffer)
+        return;
+
+    pFrame->buffer = m_allocator.allocate(SBufferRequest{.w = pFrame->bufferW, .h = pFrame->bufferH, .fmt = pFrame->fmt, .size = pFrame->stride * pFrame->bufferH, .stride = pFrame->stride});
+
+    if (!pFrame->buffer) {
+        Debug::log(ERR, "[grab] couldn't allocate a {}x{} buffer for {}", pFrame->bufferW, pFrame->bufferH, pFrame->name);
+        pFrame->done   = true;
+        pFrame->failed = true;
+        return;
+    }
+
+    if (pFrame->toplevelFrame)
+        hyprland_toplevel_export_frame_v1_copy(pFrame->toplevelFrame, pFrame->buffer->wlBuffer, true);
+    else
+        zwlr_screencopy_frame_v1_copy(pFrame->frame, pFrame->buffer->wlBuffer);
+}
+
+bool COutputGrab::capture(int timeoutMs) {
+    const auto DISPLAY  = g_pPortalManager->m_sWaylandConnection.display;
+    const auto DEADLINE = CPresentClock::now() + (uint64_t)timeoutMs * 1000000;
+    const auto PENDING  = [this]() { return std::ranges::any_of(m_vFrames, [](const auto& f) { return !f->done; }); };
+
+    bool       ok = true;
+
+    while (PENDING()) {
+        if (wl_display_dispatch_queue_pending(DISPLAY, m_pQueue) < 0) {
+            ok = false;
+            break;
+        }
+
+        if (!PENDING())
+            break;
+
+        if (wl_display_prepare_read_queue(DISPLAY, m_pQueue) != 0)
+            continue;
+
+        wl_display_flush(DISPLAY);
+
+        const auto NOW = CPresentClock::now();
+        pollfd     pfd = {.fd = wl_display_get_fd(DISPLAY), .events = POLLIN};
+
+        if (NOW >= DEADLINE || poll(&pfd, 1, (DEADLINE - NOW) / 1000000 + 1) <= 0) {
+            wl_display_cancel_read(DISPLAY);
+            Debug::log(ERR, "[grab] frames didn't come in within {}ms", timeoutMs);
+            ok = false;
+            break;
+        }
+
+        if (wl_display_read_events(DISPLAY) < 0) {
+            ok = false;
+            break;
+        }
+    }
+
+    // reading put other clients' events on their queues too, don't leave them for the next wakeup
+    g_pPortalManager->dispatchWayland();
+
+    return ok && std::ranges::none_of(m_vFrames, [](const auto& f) { return f->failed; }) && !m_vFrames.empty();
+}
+
+void COutputGrab::bounds(int32_t& x, int32_t& y, int32_t& w, int32_t& h) const {
+    int32_t x0 = INT32_MAX, y0 = INT32_MAX, x1 = INT32_MIN, y1 = INT32_MIN;
+
+    for (const auto& f : m_vFrames) {
+        x0 = std::min(x0, f->x);
+        y0 = std::min(y0, f->y);
+        x1 = std::max(x1, f->x + f->w);
+        y1 = std::max(y1, f->y + f->h);
+    }
+
+    x = x0, y = y0, w = std::max(0, x1 - x0), h = std::max(0, y1 - y0);
+}
+
+// one row of a 1:1 span, untransformed: the common case and most of the pixels of a screenshot
+static void convertRow(uint32_t fmt, const uint8_t* src, uint8_t* dst, uint32_t n) {
+    uint32_t i = 0;
+
+    if (fmt == DRM_FORMAT_XRGB8888 || fmt == DRM_FORMAT_ARGB8888 || fmt == DRM_FORMAT_XBGR8888 || fmt == DRM_FORMAT_ABGR8888) {
+        const bool BGR = fmt == DRM_FORMAT_XRGB8888 || fmt == DRM_FORMAT_ARGB8888;
+
+#ifdef __SSSE3__
+        const __m128i SHUFFLE = BGR ? _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1) : _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+        // 4 pixels in, 12 bytes out but 16 stored: stop while the spare 4 still land inside this span
+        for (; i + 6 <= n; i += 4) {
+            _mm_storeu_si128((__m128i*)(dst + i * 3), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + i * 4)), SHUFFLE));
+        }
+#endif
+
+        const uint32_t R = BGR ? 2 : 0, B = BGR ? 0 : 2;
+        for (; i < n; ++i) {
+            dst[i * 3]     = src[i * 4 + R];
+            dst[i * 3 + 1] = src[i * 4 + 1];
+            dst[i * 3 + 2] = src[i * 4 + B];
+        }
+
+        return;
+    }
+
+    for (; i < n; ++i) {
+        toRGB(fmt, src + i * 4, dst + i * 3);
+    }
+}
+
+// rows [rowBegin, rowEnd) of the image, as far as this frame covers them
+static void composeRows(const COutputGrab::SFrame& f, int32_t x, int32_t y, int32_t w, int32_t h, double scale, SRGBImage& out, uint32_t rowBegin, uint32_t rowEnd) {
+    const bool     ROTATED = f.transform & WL_OUTPUT_TRANSFORM_90;
+    const uint32_t DISPW   = ROTATED ? f.bufferH : f.bufferW;
+    const uint32_t DISPH   = ROTATED ? f.bufferW : f.bufferH;
+    const uint8_t* PIXELS  = (const uint8_t*)f.buffer->map;
+
+    // the part of the image this output covers
+    const uint32_t CX0 = std::floor((std::max(x, f.x) - x) * scale);
+    const uint32_t CY0 = std::max<uint32_t>(rowBegin, std::floor((std::max(y, f.y) - y) * scale));
+    const uint32_t CX1 = std::min<uint32_t>(out.w, std::ceil((std::min(x + w, f.x + f.w) - x) * scale));
+    const uint32_t CY1 = std::min<uint32_t>(rowEnd, std::ceil((std::min(y + h, f.y + f.h) - y) * scale));
+
+    if (CX0 >= CX1)
+        return;
+
+    // same density as the image and not rotated or mirrored, rows go across as they are
+    const bool DIRECT = f.transform == WL_OUTPUT_TRANSFORM_NORMAL && DISPW == (uint32_t)std::lround(f.w * scale);
+
+    for (uint32_t cy = CY0; cy < CY1; ++cy) {
+        // pixel centers, nearest neighbour when the output's scale is lower
+        const double   LY = y + (cy + 0.5) / scale - f.y;
+        const uint32_t DY = std::clamp(LY * DISPH / f.h, 0.0, DISPH - 1.0);
+        uint8_t*       dst = out.rgb.data() + (size_t)cy * out.w * 3;
+
+        if (DIRECT) {
+            const uint32_t DX0 = std::clamp((x + (CX0 + 0.5) / scale - f.x) * DISPW / f.w, 0.0, DISPW - 1.0);
+            const uint32_t N   = std::min(CX1 - CX0, DISPW - DX0);
+            const uint32_t BY  = f.yInvert ? f.bufferH - DY - 1 : DY;
+            convertRow(f.fmt, PIXELS + (size_t)BY * f.stride + (size_t)DX0 * 4, dst + (size_t)CX0 * 3, N);
+            continue;
+        }
+
+        for (uint32_t cx = CX0; cx < CX1; ++cx) {
+            const double   LX = x + (cx + 0.5) / scale - f.x;
+            const uint32_t DX = std::clamp(LX * DISPW / f.w, 0.0, DISPW - 1.0);
+
+            uint32_t       bx = 0, by = 0;
+            displayToBuffer(f.transform, DISPW, DISPH, DX, DY, bx, by);
+            if (f.yInvert)
+                by = f.bufferH - by - 1;
+
+            toRGB(f.fmt, PIXELS + (size_t)by * f.stride + (size_t)bx * 4, dst + (size_t)cx * 3);
+        }
+    }
+}
+
+bool COutputGrab::compose(int32_t x, int32_t y, int32_t w, int32_t h, SRGBImage& out) {
+    std::vector<SFrame*> inBox;
+    double               scale = 0;
+
+    for (const auto& f : m_vFrames) {
+        if (f->x >= x + w || f->y >= y + h || f->x + f->w <= x || f->y + f->h <= y)
+            continue;
+
+        if (!readableFormat(f->fmt)) {
+            Debug::log(ERR, "[grab] can't read format {} of {}", f->fmt, f->name);
+            return false;
+        }
+
+        const bool ROTATED = f->transform & WL_OUTPUT_TRANSFORM_90;
+        scale              = std::max(scale, (double)(ROTATED ? f->bufferH : f->bufferW) / f->w);
+        inBox.emplace_back(f.get());
+    }
+
+    if (inBox.empty() || w <= 0 || h <= 0)
+        return false;
+
+    out.w = std::ceil(w * scale);
+    out.h = std::ceil(h * scale);
+    out.rgb.assign((size_t)out.w * out.h * 3, 0);
+
+    // bands of rows through all outputs, so a wide layout splits as evenly as a tall one
+    const auto COMPOSEROWS = [&](uint32_t begin, uint32_t end) {
+        for (const auto& f : inBox) {
+            composeRows(*f, x, y, w, h, scale, out, begin, end);
+        }
+    };
+
+    const size_t THREADS = out.rgb.size() >= PARALLEL_MIN_BYTES ? std::clamp<size_t>(std::thread::hardware_concurrency(), 1, MAX_COMPOSE_THREADS) : 1;
+
+    if (THREADS == 1) {
+        COMPOSEROWS(0, out.h);
+        return true;
+    }
+
+    std::vector<std::thread> workers;
+    workers.reserve(THREADS - 1);
+
+    const uint32_t SHARE = (out.h + THREADS - 1) / THREADS;
+    for (size_t i = 1; i < THREADS; ++i) {
+        workers.emplace_back(COMPOSEROWS, std::min<uint32_t>(out.h, i * SHARE), std::min<uint32_t>(out.h, (i + 1) * SHARE));
+    }
+
+    COMPOSEROWS(0, std::min(out.h, SHARE));
+
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    return true;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <protocols/wlr-screencopy-unstable-v1-protocol.h>
+#include <protocols/hyprland-toplevel-export-v1-protocol.h>
+#include "BufferAllocator.hpp"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct SOutput;
+
+// 8 bit RGB, rows packed
+struct SRGBImage {
+    uint32_t             w = 0, h = 0;
+    std::vector<uint8_t> rgb;
+};
+
+// A still of each of a set of outputs over wlr-screencopy into shm, all asked for at once. For screenshots: frames are
+// taken the moment a request comes in and cropped or composed afterwards, whatever happens on screen in the meantime.
+// Or of one window over hyprland-toplevel-export, its own buffer with nothing on top, at 0,0 and the buffer's size.
+class COutputGrab {
+  public:
+    COutputGrab(zwlr_screencopy_manager_v1* manager, const std::vector<SOutput*>& outputs, bool cursor);
+    COutputGrab(hyprland_toplevel_export_manager_v1* manager, zwlr_foreign_toplevel_handle_v1* window, const std::string& name, bool cursor);
+    ~COutputGrab();
+
+    // dispatches its own queue until every frame is in or the time is up. false if any of them didn't make it.
+    bool     capture(int timeoutMs);
+
+    // a box of the global logical space, at the highest scale among the outputs in it. What no output covers is black.
+    // false if it's outside all of them or a frame is in a format we can't read. Large images are composed in bands of rows
+    // on a few threads, untransformed outputs at the image's scale copy row by row.
+    bool     compose(int32_t x, int32_t y, int32_t w, int32_t h, SRGBImage& out);
+    // the box around all outputs
+    void     bounds(int32_t& x, int32_t& y, int32_t& w, int32_t& h) const;
+
+    uint64_t m_iCapturedNs = 0; // CLOCK_MONOTONIC, when the last frame came in
+
+    struct SFrame {
+        COutputGrab*                       grab          = nullptr;
+        zwlr_screencopy_frame_v1*          frame         = nullptr;
+        hyprland_toplevel_export_frame_v1* toplevelFrame = nullptr;
+        std::unique_ptr<SBuffer>           buffer;
+
+        // of the output when the grab began
+        std::string                        name;
+        int32_t                            x = 0, y = 0, w = 0, h = 0; // logical
+        wl_output_transform                transform = WL_OUTPUT_TRANSFORM_NORMAL;
+
+        uint32_t                           fmt = 0, bufferW = 0, bufferH = 0, stride = 0;
+        bool                               yInvert = false;
+        bool                               done = false, failed = false;
+    };
+
+    std::vector<std::unique_ptr<SFrame>> m_vFrames;
+
+    void                                 onBufferDone(SFrame* pFrame);
+
+  private:
+    CMemfdBufferAllocator                m_allocator{false};
+    wl_event_queue*                      m_pQueue = nullptr;
+};
@@ -0,0 +1,306 @@
+#include "RestoreTokenStore.hpp"
+#include "../core/PortalManager.hpp"
+#include "../helpers/Log.hpp"
+#include "../helpers/Serialization.hpp"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/random.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <filesystem>
+#include <cstring>
+#include <cstdlib>
+
+// record: u32 payload length, u32 fnv-1a of the payload, payload. A torn tail fails the checksum and gets cut off.
+constexpr size_t   RECORD_HEADER_LEN = sizeof(uint32_t) * 2;
+constexpr size_t   COMPACT_MIN_DEAD  = 256;
+constexpr uint64_t SECONDS_PER_DAY   = 60 * 60 * 24;
+
+static uint32_t    fnv1a(const char* data, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (uint8_t)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static std::string storePath() {
+    const auto STATE_HOME = getenv("XDG_STATE_HOME");
+    const auto HOME       = getenv("HOME");
+
+    if (STATE_HOME)
+        return std::string{STATE_HOME} + "/xdph/restore-tokens";
+    if (HOME)
+        return std::string{HOME} + "/.local/state/xdph/restore-tokens";
+    return "";
+}
+
+static std::string encodeRecord(uint8_t op, const std::string& token, const SRestoreGrant* grant) {
+    std::string payload;
+    writeRaw<uint8_t>(payload, op);
+    writeString(payload, token);
+
+    if (grant) {
+        writeRaw<int32_t>(payload, grant->type);
+        writeString(payload, grant->output);
+        writeRaw<uint32_t>(payload, grant->x);
+        writeRaw<uint32_t>(payload, grant->y);
+        writeRaw<uint32_t>(payload, grant->w);
+        writeRaw<uint32_t>(payload, grant->h);
+        writeString(payload, grant->windowClass);
+        writeString(payload, grant->windowTitle);
+        writeRaw<uint32_t>(payload, grant->cursorMode);
+        writeRaw<uint64_t>(payload, grant->issued);
+        writeRaw<uint64_t>(payload, grant->lastUsed);
+    }
+
+    std::string record;
+    writeRaw<uint32_t>(record, payload.size());
+    writeRaw<uint32_t>(record, fnv1a(payload.data(), payload.size()));
+    record.append(payload);
+    return record;
+}
+
+CRestoreTokenStore::CRestoreTokenStore() {
+    m_szPath = storePath();
+
+    if (m_szPath.empty()) {
+        Debug::log(WARN, "[tokens] no $XDG_STATE_HOME nor $HOME, restore tokens won't survive a restart");
+        return;
+    }
+
+    load();
+}
+
+CRestoreTokenStore::~CRestoreTokenStore() {
+    if (m_iFD >= 0)
+        close(m_iFD);
+}
+
+void CRestoreTokenStore::load() {
+    const auto      BEGIN = std::chrono::steady_clock::now();
+
+    std::error_code ec;
+    std::filesystem::create_directories(std::filesystem::path(m_szPath).parent_path(), ec);
+
+    m_iFD = open(m_szPath.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (m_iFD < 0) {
+        Debug::log(ERR, "[tokens] couldn't open {}: {}", m_szPath, strerror(errno));
+        return;
+    }
+
+    struct stat st;
+    if (fstat(m_iFD, &st) < 0 || st.st_size == 0)
+        return;
+
+    const auto DATA = (const char*)mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, m_iFD, 0);
+    if (DATA == MAP_FAILED) {
+        Debug::log(ERR, "[tokens] couldn't map {}: {}", m_szPath, strerror(errno));
+        return;
+    }
+
+    const uint64_t NOW     = time(nullptr);
+    size_t         records = 0;
+    size_t         offset  = 0;
+
+    while (offset + RECORD_HEADER_LEN <= (size_t)st.st_size) {
+        CByteReader header{DATA + offset, RECORD_HEADER_LEN};
+        const auto  LEN  = header.read<uint32_t>();
+        const auto  HASH = header.read<uint32_t>();
+
+        if (offset + RECORD_HEADER_LEN + LEN > (size_t)st.st_size || fnv1a(DATA + offset + RECORD_HEADER_LEN, LEN) != HASH)
+            break;
+
+        CByteReader reader{DATA + offset + RECORD_HEADER_LEN, LEN};
+        const auto  OP    = reader.read<uint8_t>();
+        auto        token = reader.readString();
+
+        if (OP == RECORD_PUT) {
+            SRestoreGrant grant;
+            grant.type        = reader.read<int32_t>();
+            grant.output      = reader.readString();
+            grant.x           = reader.read<uint32_t>();
+            grant.y           = reader.read<uint32_t>();
+            grant.w           = reader.read<uint32_t>();
+            grant.h           = reader.read<uint32_t>();
+            grant.windowClass = reader.readString();
+            grant.windowTitle = reader.readString();
+            grant.cursorMode  = reader.read<uint32_t>();
+            grant.issued      = reader.read<uint64_t>();
+            grant.lastUsed    = reader.read<uint64_t>();
+
+            if (!reader.good())
+                break;
+
+            if (m_mGrants.contains(token))
+                m_iDeadRecords++;
+
+            m_mGrants[std::move(token)] = std::move(grant);
+        } else if (OP == RECORD_DEL && reader.good()) {
+            // the del and whatever it deleted
+            m_iDeadRecords += m_mGrants.erase(token) + 1;
+        } else
+            break;
+
+        offset += RECORD_HEADER_LEN + LEN;
+        records++;
+    }
+
+    munmap((void*)DATA, st.st_size);
+
+    if (offset < (size_t)st.st_size) {
+        Debug::log(WARN, "[tokens] dropping {} bytes of a torn write at the end of {}", st.st_size - offset, m_szPath);
+        ftruncate(m_iFD, offset);
+    }
+
+    // expired ones are dead weight, the next compaction drops them
+    std::erase_if(m_mGrants, [&](const auto& g) {
+        if (!expired(g.second, NOW))
+            return false;
+        m_iDeadRecords++;
+        return true;
+    });
+
+    Debug::log(LOG, "[tokens] loaded {} grants from {} records in {:.2f}ms", m_mGrants.size(), records,
+               std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - BEGIN).count() / 1000.0);
+
+    compactIfNeeded();
+}
+
+void CRestoreTokenStore::append(eRecordOp op, const std::string& token, const SRestoreGrant* grant) {
+    if (m_iFD < 0)
+        return;
+
+    const auto RECORD = encodeRecord(op, token, grant);
+
+    // O_APPEND, one write per record. If we die halfway, load() cuts the tail.
+    if (write(m_iFD, RECORD.data(), RECORD.size()) != (ssize_t)RECORD.size())
+        Debug::log(ERR, "[tokens] couldn't write to {}: {}", m_szPath, strerror(errno));
+}
+
+void CRestoreTokenStore::compactIfNeeded() {
+    if (m_iFD < 0 || m_iDeadRecords < COMPACT_MIN_DEAD || m_iDeadRecords < m_mGrants.size())
+        return;
+
+    const auto  TMPPATH = m_szPath + ".tmp";
+    std::string out;
+
+    for (auto& [token, grant] : m_mGrants) {
+        if (grant.persistent)
+            out += encodeRecord(RECORD_PUT, token, &grant);
+    }
+
+    const int FD = open(TMPPATH.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+    if (FD < 0) {
+        Debug::log(ERR, "[tokens] couldn't compact, {}: {}", TMPPATH, strerror(errno));
+        return;
+    }
+
+    if (write(FD, out.data(), out.size()) != (ssize_t)out.size() || fsync(FD) < 0 || rename(TMPPATH.c_str(), m_szPath.c_str()) < 0) {
+        Debug::log(ERR, "[tokens] couldn't compact {}: {}", m_szPath, strerror(errno));
+        close(FD);
+        unlink(TMPPATH.c_str());
+        return;
+    }
+
+    Debug::log(LOG, "[tokens] compacted {}, dropped {} dead records", m_szPath, m_iDeadRecords);
+
+    close(m_iFD);
+    m_iFD          = FD;
+    m_iDeadRecords = 0;
+}
+
+bool CRestoreTokenStore::expired(const SRestoreGrant& grant, uint64_t now) const {
+    static auto* const* PIDLEDAYS = (Hyprlang::INT* const*)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:restore_token_idle_days")->getDataStaticPtr();
+    static auto* const* PMAXDAYS  = (Hyprlang::INT* const*)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:restore_token_max_age_days")->getDataStaticPtr();
+
+    if (**PIDLEDAYS > 0 && now > grant.lastUsed + **PIDLEDAYS * SECONDS_PER_DAY)
+        return true;
+
+    if (**PMAXDAYS > 0 && now > grant.issued + **PMAXDAYS * SECONDS_PER_DAY)
+        return true;
+
+    return false;
+}
+
+std::string CRestoreTokenStore::issue(const SRestoreGrant& grant) {
+    uint8_t bytes[16];
+    if (getrandom(bytes, sizeof(bytes), 0) != sizeof(bytes)) {
+        // never block or fail a Start on this, the token only has to be unguessable enough to not collide
+        for (auto& b : bytes)
+            b = rand();
+    }
+
+    std::string token;
+    for (auto& b : bytes)
+        token += std::format("{:02x}", b);
+
+    SRestoreGrant newGrant = grant;
+    newGrant.issued        = time(nullptr);
+    newGrant.lastUsed      = newGrant.issued;
+
+    update(token, newGrant);
+
+    return token;
+}
+
+void CRestoreTokenStore::update(const std::string& token, const SRestoreGrant& grant) {
+    const auto IT            = m_mGrants.find(token);
+    const bool WASPERSISTENT = IT != m_mGrants.end() && IT->second.persistent;
+
+    m_mGrants[token] = grant;
+
+    if (grant.persistent) {
+        append(RECORD_PUT, token, &grant);
+        if (WASPERSISTENT)
+            m_iDeadRecords++;
+    } else if (WASPERSISTENT) {
+        // downgraded to persist_mode 1, make sure it doesn't come back on the next load
+        append(RECORD_DEL, token, nullptr);
+        m_iDeadRecords += 2;
+    }
+
+    compactIfNeeded();
+}
+
+void CRestoreTokenStore::revoke(const std::string& token) {
+    const auto IT = m_mGrants.find(token);
+    if (IT == m_mGrants.end())
+        return;
+
+    if (IT->second.persistent) {
+        append(RECORD_DEL, token, nullptr);
+        m_iDeadRecords += 2;
+    }
+
+    m_mGrants.erase(IT);
+
+    compactIfNeeded();
+}
+
+const SRestoreGrant* CRestoreTokenStore::lookup(const std::string& token) {
+    const auto IT = m_mGrants.find(token);
+    if (IT == m_mGrants.end())
+        return nullptr;
+
+    const uint64_t NOW = time(nullptr);
+
+    if (expired(IT->second, NOW)) {
+        Debug::log(LOG, "[tokens] token {} expired", token);
+        revoke(token);
+        return nullptr;
+    }
+
+    // a day of resolution is plenty for idle expiry and saves a record per restore
+    if (NOW - IT->second.lastUsed >= SECONDS_PER_DAY) {
+        IT->second.lastUsed = NOW;
+        if (IT->second.persistent) {
+            append(RECORD_PUT, token, &IT->second);
+            m_iDeadRecords++;
+        }
+    }
+
+    return &IT->second;
+}
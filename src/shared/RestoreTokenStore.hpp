@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+// what a restore token grants
+struct SRestoreGrant {
+    int32_t     type = -1; // eSelectionType
+    std::string output;
+    uint32_t    x = 0, y = 0, w = 0, h = 0;
+
+    // last seen identity of the shared window, handles don't outlive the window nor our wl connection
+    std::string windowClass, windowTitle;
+
+    uint32_t    cursorMode = 0;
+    uint64_t    issued = 0, lastUsed = 0; // unix seconds
+
+    // persist_mode 1 grants die with us and never hit the disk
+    bool persistent = true;
+};
+
+// Token -> grant database. Backed by an append-only log in $XDG_STATE_HOME/xdph/restore-tokens,
+// replayed through mmap on the first use and compacted once dead records pile up.
+class CRestoreTokenStore {
+  public:
+    CRestoreTokenStore();
+    ~CRestoreTokenStore();
+
+    // returns the new token
+    std::string          issue(const SRestoreGrant& grant);
+    void                 update(const std::string& token, const SRestoreGrant& grant);
+    void                 revoke(const std::string& token);
+
+    // nullptr if unknown or expired. Bumps lastUsed.
+    const SRestoreGrant* lookup(const std::string& token);
+
+  private:
+    enum eRecordOp : uint8_t {
+        RECORD_PUT = 1,
+        RECORD_DEL,
+    };
+
+    void                                           load();
+    void                                           append(eRecordOp op, const std::string& token, const SRestoreGrant* grant);
+    void                                           compactIfNeeded();
+    bool                                           expired(const SRestoreGrant& grant, uint64_t now) const;
+
+    std::string                                    m_szPath;
+    int                                            m_iFD = -1;
+
+    std::unordered_map<std::string, SRestoreGrant> m_mGrants;
+    size_t                                         m_iDeadRecords = 0;
+};
@@ -29,8 +29,8 @@ std::string buildWindowList() {
 
     for (auto& e : g_pPortalManager->m_sHelpers.toplevel->m_vToplevels) {
 
-        result += std::format("{}[HC>]{}[HT>]{}[HE>]", (uint32_t)(((uint64_t)e->handle) & 0xFFFFFFFF), sanitizeNameForWindowList(e->windowClass),
-                              sanitizeNameForWindowList(e->windowTitle));
+        result += std::format("{}[HC>]{}[HT>]{}[HE>]", (uint32_t)(((uint64_t)e->handle) & 0xFFFFFFFF), sanitizeNameForWindowList(e->windowClass()),
+                              sanitizeNameForWindowList(std::string{e->windowTitle()}));
     }
 
     return result;
@@ -162,6 +162,29 @@ uint32_t drmFourccFromSHM(wl_shm_format format) {
     }
 }
 
+uint32_t bytesPerPixelFromDrmFourcc(uint32_t format) {
+    switch (format) {
+        case DRM_FORMAT_ARGB8888:
+        case DRM_FORMAT_XRGB8888:
+        case DRM_FORMAT_RGBA8888:
+        case DRM_FORMAT_RGBX8888:
+        case DRM_FORMAT_ABGR8888:
+        case DRM_FORMAT_XBGR8888:
+        case DRM_FORMAT_BGRA8888:
+        case DRM_FORMAT_BGRX8888:
+        case DRM_FORMAT_XRGB2101010:
+        case DRM_FORMAT_XBGR2101010:
+        case DRM_FORMAT_RGBX1010102:
+        case DRM_FORMAT_BGRX1010102:
+        case DRM_FORMAT_ARGB2101010:
+        case DRM_FORMAT_ABGR2101010:
+        case DRM_FORMAT_RGBA1010102:
+        case DRM_FORMAT_BGRA1010102: return 4;
+        case DRM_FORMAT_BGR888: return 3;
+        default: return 0; // not single plane packed, or not something we share
+    }
+}
+
 spa_video_format pwFromDrmFourcc(uint32_t format) {
     switch (format) {
         case DRM_FORMAT_ARGB8888: return SPA_VIDEO_FORMAT_BGRA;
@@ -207,13 +230,13 @@ spa_video_format pwStripAlpha(spa_video_format format) {
     }
 }
 
-spa_pod* build_buffer(spa_pod_builder* b, uint32_t blocks, uint32_t size, uint32_t stride, uint32_t datatype) {
+spa_pod* build_buffer(spa_pod_builder* b, uint32_t blocks, uint32_t size, uint32_t stride, uint32_t datatype, uint32_t buffers, uint32_t buffersMin, uint32_t buffersMax) {
     assert(blocks > 0);
     assert(datatype > 0);
     spa_pod_frame f[1];
 
     spa_pod_builder_push_object(b, &f[0], SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers);
-    spa_pod_builder_add(b, SPA_PARAM_BUFFERS_buffers, SPA_POD_CHOICE_RANGE_Int(XDPH_PWR_BUFFERS, XDPH_PWR_BUFFERS_MIN, 32), 0);
+    spa_pod_builder_add(b, SPA_PARAM_BUFFERS_buffers, SPA_POD_CHOICE_RANGE_Int(buffers, buffersMin, buffersMax), 0);
     spa_pod_builder_add(b, SPA_PARAM_BUFFERS_blocks, SPA_POD_Int(blocks), 0);
     if (size > 0) {
         spa_pod_builder_add(b, SPA_PARAM_BUFFERS_size, SPA_POD_Int(size), 0);
@@ -289,46 +312,3 @@ spa_pod* build_format(spa_pod_builder* b, spa_video_format format, uint32_t widt
     spa_pod_builder_add(b, SPA_FORMAT_VIDEO_maxFramerate, SPA_POD_CHOICE_RANGE_Fraction(&SPA_FRACTION(framerate, 1), &SPA_FRACTION(1, 1), &SPA_FRACTION(framerate, 1)), 0);
     return (spa_pod*)spa_pod_builder_pop(b, &f[0]);
 }
-
-void randname(char* buf) {
-    struct timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
-    long r = ts.tv_nsec;
-    for (int i = 0; i < 6; ++i) {
-        assert(buf[i] == 'X');
-        buf[i] = 'A' + (r & 15) + (r & 16) * 2;
-        r >>= 5;
-    }
-}
-
-int anonymous_shm_open() {
-    char name[]  = "/xdph-shm-XXXXXX";
-    int  retries = 100;
-
-    do {
-        randname(name + strlen(name) - 6);
-
-        --retries;
-        // shm_open guarantees that O_CLOEXEC is set
-        int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
-        if (fd >= 0) {
-            shm_unlink(name);
-            return fd;
-        }
-    } while (retries > 0 && errno == EEXIST);
-
-    return -1;
-}
-
-wl_buffer* import_wl_shm_buffer(int fd, wl_shm_format fmt, int width, int height, int stride) {
-    int size = stride * height;
-
-    if (fd < 0)
-        return NULL;
-
-    wl_shm_pool* pool   = wl_shm_create_pool(g_pPortalManager->m_sWaylandConnection.shm, fd, size);
-    wl_buffer*   buffer = wl_shm_pool_create_buffer(pool, 0, width, height, stride, fmt);
-    wl_shm_pool_destroy(pool);
-
-    return buffer;
-}
@@ -16,6 +16,7 @@ extern "C" {
 
 #define XDPH_PWR_BUFFERS     4
 #define XDPH_PWR_BUFFERS_MIN 2
+#define XDPH_PWR_BUFFERS_MAX 32
 #define XDPH_PWR_ALIGN       16
 
 enum eSelectionType {
@@ -41,11 +42,10 @@ struct wl_buffer;
 SSelectionData   promptForScreencopySelection();
 uint32_t         drmFourccFromSHM(wl_shm_format format);
 spa_video_format pwFromDrmFourcc(uint32_t format);
+uint32_t         bytesPerPixelFromDrmFourcc(uint32_t format);
 wl_shm_format    wlSHMFromDrmFourcc(uint32_t format);
 spa_video_format pwStripAlpha(spa_video_format format);
 std::string      getRandName(std::string prefix);
 spa_pod*         build_format(spa_pod_builder* b, spa_video_format format, uint32_t width, uint32_t height, uint32_t framerate, uint64_t* modifiers, int modifier_count);
 spa_pod*         fixate_format(spa_pod_builder* b, spa_video_format format, uint32_t width, uint32_t height, uint32_t framerate, uint64_t* modifier);
-spa_pod*         build_buffer(spa_pod_builder* b, uint32_t blocks, uint32_t size, uint32_t stride, uint32_t datatype);
-int              anonymous_shm_open();
-wl_buffer*       import_wl_shm_buffer(int fd, wl_shm_format fmt, int width, int height, int stride);
\ No newline at end of file
+spa_pod*         build_buffer(spa_pod_builder* b, uint32_t blocks, uint32_t size, uint32_t stride, uint32_t datatype, uint32_t buffers, uint32_t buffersMin, uint32_t buffersMax);
\ No newline at end of file
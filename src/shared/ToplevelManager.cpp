@@ -2,43 +2,83 @@
 #include "../helpers/Log.hpp"
 #include "../core/PortalManager.hpp"
 
+#include <algorithm>
+#include <cctype>
+
+// below this the arena isn't worth rewriting
+constexpr size_t TITLE_COMPACT_MIN_GARBAGE = 64 * 1024;
+
+// everything only lands in pending until done. A window retitling itself many times a second costs a string assign (no
+// allocation once the buffer is big enough), and findByIdentity never sees half of an update.
 static void toplevelTitle(void* data, zwlr_foreign_toplevel_handle_v1* zwlr_foreign_toplevel_handle_v1, const char* title) {
     const auto PTL = (SToplevelHandle*)data;
 
-    if (title)
-        PTL->windowTitle = title;
+    if (!title)
+        return;
 
-    Debug::log(TRACE, "[toplevel] toplevel at {} set title to {}", data, PTL->windowTitle);
+    PTL->pending.title    = title;
+    PTL->pending.hasTitle = true;
 }
 
 static void toplevelAppid(void* data, zwlr_foreign_toplevel_handle_v1* zwlr_foreign_toplevel_handle_v1, const char* app_id) {
     const auto PTL = (SToplevelHandle*)data;
 
-    if (app_id)
-        PTL->windowClass = app_id;
+    if (!app_id)
+        return;
+
+    PTL->pending.appid    = app_id;
+    PTL->pending.hasAppid = true;
+}
+
+// enter and leave are deltas, they go onto a copy of the current set
+static std::vector<wl_output*>& pendingOutputs(SToplevelHandle* handle) {
+    if (!handle->pending.hasOutputs) {
+        handle->pending.outputs.assign(handle->outputs.begin(), handle->outputs.end());
+        handle->pending.hasOutputs = true;
+    }
 
-    Debug::log(TRACE, "[toplevel] toplevel at {} set class to {}", data, PTL->windowClass);
+    return handle->pending.outputs;
 }
 
 static void toplevelEnterOutput(void* data, zwlr_foreign_toplevel_handle_v1* zwlr_foreign_toplevel_handle_v1, wl_output* output) {
-    ;
+    const auto PTL     = (SToplevelHandle*)data;
+    auto&      OUTPUTS = pendingOutputs(PTL);
+
+    if (std::find(OUTPUTS.begin(), OUTPUTS.end(), output) == OUTPUTS.end())
+        OUTPUTS.push_back(output);
 }
 
 static void toplevelLeaveOutput(void* data, zwlr_foreign_toplevel_handle_v1* zwlr_foreign_toplevel_handle_v1, wl_output* output) {
-    ;
+    const auto PTL = (SToplevelHandle*)data;
+
+    std::erase(pendingOutputs(PTL), output);
 }
 
 static void toplevelState(void* data, zwlr_foreign_toplevel_handle_v1* zwlr_foreign_toplevel_handle_v1, wl_array* state) {
-    ;
+    const auto PTL = (SToplevelHandle*)data;
+
+    PTL->pending.activated = false;
+    PTL->pending.minimized = false;
+    PTL->pending.hasState  = true;
+
+    for (auto* s = (uint32_t*)state->data; (char*)s < (char*)state->data + state->size; ++s) {
+        if (*s == ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_STATE_ACTIVATED)
+            PTL->pending.activated = true;
+        else if (*s == ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_STATE_MINIMIZED)
+            PTL->pending.minimized = true;
+    }
 }
 
 static void toplevelDone(void* data, zwlr_foreign_toplevel_handle_v1* zwlr_foreign_toplevel_handle_v1) {
-    ;
+    const auto PTL = (SToplevelHandle*)data;
+
+    PTL->mgr->onDone(PTL);
 }
 
 static void toplevelClosed(void* data, zwlr_foreign_toplevel_handle_v1* zwlr_foreign_toplevel_handle_v1) {
     const auto PTL = (SToplevelHandle*)data;
 
+    PTL->mgr->onClosed(PTL);
     std::erase_if(PTL->mgr->m_vToplevels, [&](const auto& e) { return e.get() == PTL; });
 
     Debug::log(TRACE, "[toplevel] toplevel at {} closed", data);
@@ -64,9 +104,11 @@ static void managerToplevel(void* data, zwlr_foreign_toplevel_manager_v1* mgr, z
 
     Debug::log(TRACE, "[toplevel] New toplevel at {}", (void*)toplevel);
 
-    const auto PTL = PMGR->m_vToplevels.emplace_back(std::make_unique<SToplevelHandle>("?", "?", toplevel, PMGR)).get();
+    const auto PTL = PMGR->m_vToplevels.emplace_back(std::make_unique<SToplevelHandle>(toplevel, PMGR)).get();
 
     zwlr_foreign_toplevel_handle_v1_add_listener(toplevel, &toplevelListener, PTL);
+
+    PMGR->onCreated(PTL);
 }
 
 static void managerFinished(void* data, zwlr_foreign_toplevel_manager_v1* mgr) {
@@ -74,7 +116,7 @@ static void managerFinished(void* data, zwlr_foreign_toplevel_manager_v1* mgr) {
 
     Debug::log(ERR, "[toplevel] Compositor sent .finished???");
 
-    PMGR->m_vToplevels.clear();
+    PMGR->clearToplevels();
 }
 
 inline const zwlr_foreign_toplevel_manager_v1_listener managerListener = {
@@ -82,13 +124,219 @@ inline const zwlr_foreign_toplevel_manager_v1_listener managerListener = {
     .finished = managerFinished,
 };
 
+const std::string& SToplevelHandle::windowClass() const {
+    return *className;
+}
+
+std::string_view SToplevelHandle::windowTitle() const {
+    return mgr->titleOf(this);
+}
+
 bool CToplevelManager::exists(zwlr_foreign_toplevel_handle_v1* handle) {
+    return handleFor(handle);
+}
+
+SToplevelHandle* CToplevelManager::handleFor(zwlr_foreign_toplevel_handle_v1* handle) {
     for (auto& h : m_vToplevels) {
         if (h->handle == handle)
-            return true;
+            return h.get();
+    }
+
+    return nullptr;
+}
+
+// lowercased byte trigrams packed into a u32. Titles shorter than 3 get one "trigram" of what's there.
+static std::vector<uint32_t> trigramsOf(std::string_view str) {
+    std::vector<uint32_t> result;
+
+    const auto            LOWER = [&](size_t i) -> uint32_t { return i < str.size() ? (uint8_t)std::tolower((unsigned char)str[i]) : 0; };
+
+    if (str.size() < 3) {
+        if (!str.empty())
+            result.push_back((LOWER(0) << 16) | (LOWER(1) << 8) | LOWER(2));
+        return result;
+    }
+
+    result.reserve(str.size() - 2);
+    for (size_t i = 0; i + 2 < str.size(); ++i)
+        result.push_back((LOWER(i) << 16) | (LOWER(i + 1) << 8) | LOWER(i + 2));
+
+    std::sort(result.begin(), result.end());
+    result.erase(std::unique(result.begin(), result.end()), result.end());
+    return result;
+}
+
+// jaccard over two sorted sets
+static float trigramSimilarity(const std::vector<uint32_t>& a, const std::vector<uint32_t>& b) {
+    if (a.empty() || b.empty())
+        return 0.F;
+
+    size_t common = 0;
+    for (size_t i = 0, j = 0; i < a.size() && j < b.size();) {
+        if (a[i] == b[j]) {
+            common++;
+            i++;
+            j++;
+        } else if (a[i] < b[j])
+            i++;
+        else
+            j++;
     }
 
-    return false;
+    return (float)common / (float)(a.size() + b.size() - common);
+}
+
+SToplevelHandle* CToplevelManager::findByIdentity(const std::string& windowClass, const std::string& windowTitle, const std::string& output) {
+    const auto CLASSIT = m_sClassNames.find(windowClass);
+    if (CLASSIT == m_sClassNames.end())
+        return nullptr;
+
+    const auto IT = m_mByClass.find(&*CLASSIT);
+    if (IT == m_mByClass.end() || IT->second.empty())
+        return nullptr;
+
+    if (IT->second.size() == 1)
+        return IT->second.front();
+
+    const auto       BEGIN   = std::chrono::steady_clock::now();
+    const auto       QUERY   = trigramsOf(windowTitle);
+    const auto       POUTPUT = output.empty() ? nullptr : g_pPortalManager->getOutputFromName(output);
+
+    SToplevelHandle* best      = nullptr;
+    float            bestScore = -1.F;
+
+    for (auto& h : IT->second) {
+        // title dominates, the output breaks ties between similar titles, recency breaks the rest
+        float score = h->windowTitle() == windowTitle ? 2.F : trigramSimilarity(QUERY, h->titleTrigrams);
+
+        if (POUTPUT && std::find(h->outputs.begin(), h->outputs.end(), POUTPUT->output) != h->outputs.end())
+            score += 0.5F;
+
+        if (m_iActivationSerial > 0)
+            score += 0.25F * h->lastActivated / m_iActivationSerial;
+
+        if (score > bestScore) {
+            bestScore = score;
+            best      = h;
+        }
+    }
+
+    Debug::log(TRACE, "[toplevel] identity {} / {} matched {} ({}) with score {:.2f} among {} in {}us", windowClass, windowTitle, (void*)best, best->windowTitle(), bestScore,
+               IT->second.size(), std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - BEGIN).count());
+
+    return best;
+}
+
+void CToplevelManager::onCreated(SToplevelHandle* handle) {
+    setClass(handle, "?");
+    setTitle(handle, "?");
+}
+
+void CToplevelManager::onDone(SToplevelHandle* handle) {
+    auto& pending = handle->pending;
+
+    if (pending.hasAppid && pending.appid != *handle->className) {
+        setClass(handle, pending.appid);
+        Debug::log(TRACE, "[toplevel] toplevel at {} set class to {}", (void*)handle, *handle->className);
+    }
+
+    if (pending.hasTitle && pending.title != handle->windowTitle()) {
+        setTitle(handle, pending.title);
+        Debug::log(TRACE, "[toplevel] toplevel at {} set title to {}", (void*)handle, pending.title);
+    }
+
+    if (pending.hasState) {
+        // the state is resent whole on every change (maximize, fullscreen...), only getting focus counts
+        if (pending.activated && !handle->activated)
+            onActivated(handle);
+
+        handle->activated = pending.activated;
+        handle->minimized = pending.minimized;
+    }
+
+    // swap, so both vectors keep their capacity
+    if (pending.hasOutputs)
+        handle->outputs.swap(pending.outputs);
+
+    // clear() keeps the capacity for the next round
+    pending.title.clear();
+    pending.appid.clear();
+    pending.outputs.clear();
+    pending.hasTitle = pending.hasAppid = pending.hasState = pending.hasOutputs = false;
+}
+
+const std::string* CToplevelManager::internClass(const std::string& name) {
+    // unordered_set nodes don't move, the pointer stays good
+    return &*m_sClassNames.emplace(name).first;
+}
+
+void CToplevelManager::setClass(SToplevelHandle* handle, const std::string& name) {
+    if (handle->className) {
+        if (const auto IT = m_mByClass.find(handle->className); IT != m_mByClass.end()) {
+            std::erase(IT->second, handle);
+            if (IT->second.empty())
+                m_mByClass.erase(IT);
+        }
+    }
+
+    handle->className = internClass(name);
+    m_mByClass[handle->className].push_back(handle);
+}
+
+void CToplevelManager::setTitle(SToplevelHandle* handle, std::string_view title) {
+    m_iTitleGarbage += handle->titleLength;
+
+    // moved to the new title before compacting, or the old one would be carried over and no longer counted as garbage
+    handle->titleOffset = m_vTitleArena.size();
+    handle->titleLength = title.size();
+    m_vTitleArena.insert(m_vTitleArena.end(), title.begin(), title.end());
+
+    if (m_iTitleGarbage >= TITLE_COMPACT_MIN_GARBAGE && m_iTitleGarbage > m_vTitleArena.size() / 2)
+        compactTitles();
+
+    handle->titleTrigrams = trigramsOf(title);
+}
+
+std::string_view CToplevelManager::titleOf(const SToplevelHandle* handle) const {
+    return {m_vTitleArena.data() + handle->titleOffset, handle->titleLength};
+}
+
+void CToplevelManager::compactTitles() {
+    const auto        OLDSIZE = m_vTitleArena.size();
+    std::vector<char> arena;
+    arena.reserve(OLDSIZE - m_iTitleGarbage);
+
+    for (auto& h : m_vToplevels) {
+        const auto OFFSET = arena.size();
+        arena.insert(arena.end(), m_vTitleArena.begin() + h->titleOffset, m_vTitleArena.begin() + h->titleOffset + h->titleLength);
+        h->titleOffset = OFFSET;
+    }
+
+    m_vTitleArena   = std::move(arena);
+    m_iTitleGarbage = 0;
+
+    Debug::log(TRACE, "[toplevel] compacted titles of {} toplevels from {} to {} bytes, {} classes", m_vToplevels.size(), OLDSIZE, m_vTitleArena.size(), m_sClassNames.size());
+}
+
+void CToplevelManager::onActivated(SToplevelHandle* handle) {
+    handle->lastActivated = ++m_iActivationSerial;
+}
+
+void CToplevelManager::onClosed(SToplevelHandle* handle) {
+    m_iTitleGarbage += handle->titleLength;
+
+    if (const auto IT = m_mByClass.find(handle->className); IT != m_mByClass.end()) {
+        std::erase(IT->second, handle);
+        if (IT->second.empty())
+            m_mByClass.erase(IT);
+    }
+}
+
+void CToplevelManager::clearToplevels() {
+    m_mByClass.clear();
+    m_vToplevels.clear();
+    m_vTitleArena.clear();
+    m_iTitleGarbage = 0;
 }
 
 CToplevelManager::CToplevelManager(wl_registry* registry, uint32_t name, uint32_t version) {
@@ -105,8 +353,10 @@ void CToplevelManager::activate() {
 
     m_pManager = (zwlr_foreign_toplevel_manager_v1*)wl_registry_bind(m_sWaylandConnection.registry, m_sWaylandConnection.name, &zwlr_foreign_toplevel_manager_v1_interface,
                                                                      m_sWaylandConnection.version);
+    // handles come in on the manager's queue, title storms stay out of the capture path
+    wl_proxy_set_queue((wl_proxy*)m_pManager, g_pPortalManager->m_sWaylandConnection.queues.toplevel);
     zwlr_foreign_toplevel_manager_v1_add_listener(m_pManager, &managerListener, this);
-    wl_display_roundtrip(g_pPortalManager->m_sWaylandConnection.display);
+    wl_display_roundtrip_queue(g_pPortalManager->m_sWaylandConnection.display, g_pPortalManager->m_sWaylandConnection.queues.toplevel);
 
     Debug::log(LOG, "[toplevel] Activated, bound to {:x}, toplevels: {}", (uintptr_t)m_pManager, m_vToplevels.size());
 }
@@ -121,7 +371,7 @@ void CToplevelManager::deactivate() {
 
     zwlr_foreign_toplevel_manager_v1_destroy(m_pManager);
     m_pManager = nullptr;
-    m_vToplevels.clear();
+    clearToplevels();
 
     Debug::log(LOG, "[toplevel] unbound manager");
 }
\ No newline at end of file
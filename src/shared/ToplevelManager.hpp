@@ -3,16 +3,43 @@
 #include <wayland-client.h>
 #include <protocols/wlr-foreign-toplevel-management-unstable-v1-protocol.h>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <memory>
+#include <unordered_map>
+#include <unordered_set>
 
 class CToplevelManager;
 
 struct SToplevelHandle {
-    std::string                      windowClass;
-    std::string                      windowTitle;
     zwlr_foreign_toplevel_handle_v1* handle = nullptr;
     CToplevelManager*                mgr    = nullptr;
+
+    // interned in mgr, same pointer for every window of a class
+    const std::string*               className = nullptr;
+    // in mgr's title arena
+    uint32_t                         titleOffset = 0, titleLength = 0;
+
+    // what the compositor sent since the last done, applied all at once then
+    struct {
+        std::string             title, appid;
+        bool                    hasTitle = false, hasAppid = false;
+
+        bool                    activated = false, minimized = false, hasState = false;
+        std::vector<wl_output*> outputs; // the whole set once an output was entered or left
+        bool                    hasOutputs = false;
+    } pending;
+
+    const std::string&               windowClass() const;
+    // only valid until the next title change of any window, copy it if you keep it
+    std::string_view                 windowTitle() const;
+
+    // for findByIdentity
+    std::vector<uint32_t>   titleTrigrams; // sorted, unique
+    std::vector<wl_output*> outputs;
+    uint64_t                lastActivated = 0; // activation serial, higher is more recent
+
+    bool                    activated = false, minimized = false;
 };
 
 class CToplevelManager {
@@ -23,6 +50,19 @@ class CToplevelManager {
     void                                          deactivate();
 
     bool                                          exists(zwlr_foreign_toplevel_handle_v1* handle);
+    SToplevelHandle*                              handleFor(zwlr_foreign_toplevel_handle_v1* handle);
+
+    // re-identify a window we only know by what it looked like, handles don't survive restarts. nullptr if no class matches.
+    // Among same-class windows, scores title trigram similarity, the output it was on and how recently it was focused.
+    SToplevelHandle*                              findByIdentity(const std::string& windowClass, const std::string& windowTitle, const std::string& output = "");
+
+    // called by the handle listeners. onDone applies everything pending and keeps the class index and trigrams in sync.
+    void                                          onCreated(SToplevelHandle* handle);
+    void                                          onDone(SToplevelHandle* handle);
+    void                                          onActivated(SToplevelHandle* handle);
+    void                                          onClosed(SToplevelHandle* handle);
+
+    std::string_view                              titleOf(const SToplevelHandle* handle) const;
 
     std::vector<std::unique_ptr<SToplevelHandle>> m_vToplevels;
 
@@ -31,6 +71,21 @@ class CToplevelManager {
 
     int64_t                           m_iActivateLocks = 0;
 
+    // a handful of classes shared by many windows, interned once and never freed
+    std::unordered_set<std::string>                                       m_sClassNames;
+    std::unordered_map<const std::string*, std::vector<SToplevelHandle*>> m_mByClass;
+    uint64_t                                                              m_iActivationSerial = 0;
+
+    // every title back to back. A change appends and leaves the old bytes as garbage until the next compaction.
+    std::vector<char>                                                     m_vTitleArena;
+    size_t                                                                m_iTitleGarbage = 0;
+
+    const std::string*                                                    internClass(const std::string& name);
+    void                                                                  setClass(SToplevelHandle* handle, const std::string& name);
+    void                                                                  setTitle(SToplevelHandle* handle, std::string_view title);
+    void                                                                  compactTitles();
+    void                                                                  clearToplevels();
+
     struct {
         wl_registry* registry = nullptr;
         uint32_t     name     = 0;